@@ -0,0 +1,229 @@
+/****************************************************************************
+*       Load source for the DNS responder.
+*
+*       Usage : ./dns_bench.out [-t threads] [-d seconds] [-w window]
+*                               [-a address] <names file> <any port number>
+*
+*       Asks the responder for the names in the file, one per line with
+*       an optional type after it (A by default), round and round for
+*       the given time. Each thread keeps up to a window of queries in
+*       flight on a socket of its own, sends them with sendmmsg and takes
+*       the answers with recvmmsg, much as the responder does itself; a
+*       query not answered within LOST_MS is counted lost. Prints the
+*       answers per second and how many there were of each kind.
+*
+*       Run on the same host, the load source takes CPU time from the
+*       responder; the rate per CPU second the responder prints when it
+*       exits is the one to compare.
+*
+*****************************************************************************/
+
+#define _GNU_SOURCE
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "zone.h"
+
+#define BATCH 64
+#define THREADS 1
+#define SECONDS 5
+#define WINDOW 256          /* Queries in flight per thread. */
+#define LOST_MS 100
+
+struct query {
+    unsigned char packet[DNS_HEADER_LEN + DNS_NAME_MAX + 4];
+    int len;
+};
+
+struct job {
+    pthread_t thread;
+    struct sockaddr_in6 addr;
+    const struct query *queries;
+    int nqueries, window, first;
+    double deadline;
+    long sent, noerror, nxdomain, other, lost;
+};
+
+void error(const char *msg) {
+    perror(msg);
+    exit(EXIT_FAILURE);
+}
+
+static double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void *run(void *arg) {
+    struct job *j = arg;
+    struct mmsghdr out[BATCH], in[BATCH];
+    struct iovec out_iov[BATCH], in_iov[BATCH];
+    unsigned char replies[BATCH][DNS_UDP_MAX];
+    int sockfd = socket(AF_INET6, SOCK_DGRAM, 0), flight = 0, next = j->first;
+
+    if (sockfd < 0 || connect(sockfd, (struct sockaddr *)&j->addr, sizeof(j->addr)) < 0)
+        error("ERROR connecting");
+    for (int i = 0; i < BATCH; i++) {
+        in_iov[i] = (struct iovec){ replies[i], DNS_UDP_MAX };
+        in[i].msg_hdr = (struct msghdr){ .msg_iov = &in_iov[i], .msg_iovlen = 1 };
+        out[i].msg_hdr = (struct msghdr){ .msg_iov = &out_iov[i], .msg_iovlen = 1 };
+    }
+    while (now() < j->deadline) {
+        struct pollfd pfd = { sockfd, POLLIN, 0 };
+        int n = 0, m;
+
+        /* Fill the window. Each name has an id of its own. */
+        while (flight + n < j->window && n < BATCH) {
+            const struct query *q = &j->queries[next];
+            out_iov[n] = (struct iovec){ (void *)q->packet, q->len };
+            next = (next + 1) % j->nqueries;
+            n++;
+        }
+        if (n && (m = sendmmsg(sockfd, out, n, 0)) > 0) {
+            flight += m;
+            j->sent += m;
+        }
+
+        if (poll(&pfd, 1, LOST_MS) <= 0) {
+            j->lost += flight;
+            flight = 0;
+            continue;
+        }
+        m = recvmmsg(sockfd, in, BATCH, MSG_DONTWAIT, NULL);
+        for (int i = 0; i < m; i++) {
+            int rcode = in[i].msg_len >= DNS_HEADER_LEN ? replies[i][3] & 0xf : -1;
+            if (rcode == 0)
+                j->noerror++;
+            else if (rcode == 3)
+                j->nxdomain++;
+            else
+                j->other++;
+        }
+        if (m > 0)
+            flight -= m < flight ? m : flight;
+    }
+    close(sockfd);
+    return NULL;
+}
+
+/* Reads "name [type]" lines into queries. Returns how many. */
+static int readNames(const char *path, struct query **queries) {
+    FILE *f = fopen(path, "r");
+    char line[1024], name[1024], type[16];
+    int n = 0, cap = 0;
+
+    if (f == NULL)
+        error("ERROR opening names file");
+    *queries = NULL;
+    while (fgets(line, sizeof(line), f)) {
+        int fields = sscanf(line, "%1023s %15s", name, type), qtype, len;
+        struct query *q;
+
+        if (fields < 1 || name[0] == '#')
+            continue;
+        qtype = fields == 2 ? zoneType(type) : DNS_TYPE_A;
+        if (n == cap) {
+            cap = cap ? cap * 2 : 64;
+            if ((*queries = realloc(*queries, cap * sizeof(**queries))) == NULL)
+                error("ERROR reading names");
+        }
+        q = &(*queries)[n];
+        memset(q->packet, 0, DNS_HEADER_LEN);
+        q->packet[0] = n >> 8;
+        q->packet[1] = n;
+        q->packet[2] = 0x01;        /* RD, as a stub resolver sets it. */
+        q->packet[5] = 1;           /* One question. */
+        if (qtype < 0 || (len = zoneName(name, NULL, 0, q->packet + DNS_HEADER_LEN)) < 0) {
+            fprintf(stderr, "%s: bad line %s", path, line);
+            exit(EXIT_FAILURE);
+        }
+        len += DNS_HEADER_LEN;
+        q->packet[len++] = qtype >> 8;
+        q->packet[len++] = qtype;
+        q->packet[len++] = 0;
+        q->packet[len++] = DNS_CLASS_IN;
+        q->len = len;
+        n++;
+    }
+    fclose(f);
+    if (n == 0) {
+        fprintf(stderr, "%s: no names\n", path);
+        exit(EXIT_FAILURE);
+    }
+    return n;
+}
+
+int main(int argc, char *argv[]) {
+  const char *address = "127.0.0.1";
+  struct sockaddr_in6 addr = { .sin6_family = AF_INET6 };
+  struct query *queries;
+  struct job *jobs;
+  long sent = 0, noerror = 0, nxdomain = 0, other = 0, lost = 0;
+  int opt, threads = THREADS, seconds = SECONDS, window = WINDOW, nqueries;
+  double start, elapsed;
+
+  while ((opt = getopt(argc, argv, "t:d:w:a:")) != -1) {
+    if (opt == 't')
+      threads = strtol(optarg, NULL, 10);
+    else if (opt == 'd')
+      seconds = strtol(optarg, NULL, 10);
+    else if (opt == 'w')
+      window = strtol(optarg, NULL, 10);
+    else if (opt == 'a')
+      address = optarg;
+    else
+      error("Usage : ./dns_bench.out [-t threads] [-d seconds] [-w window] [-a address] <names file> <port>");
+  }
+  if (optind + 2 > argc) {
+      error("ERROR names file and port required");
+  }
+  if (threads < 1)
+    threads = 1;
+  if (window < 1)
+    window = 1;
+  nqueries = readNames(argv[optind], &queries);
+  addr.sin6_port = htons(strtol(argv[optind + 1], NULL, 10));
+  if (inet_pton(AF_INET6, address, &addr.sin6_addr) != 1) {
+    struct in_addr v4;
+    if (inet_pton(AF_INET, address, &v4) != 1)
+      error("ERROR bad address");
+    addr.sin6_addr.s6_addr[10] = addr.sin6_addr.s6_addr[11] = 0xff;
+    memcpy(&addr.sin6_addr.s6_addr[12], &v4, 4);
+  }
+
+  jobs = calloc(threads, sizeof(*jobs));
+  start = now();
+  for (int t = 0; t < threads; t++) {
+    jobs[t].addr = addr;
+    jobs[t].queries = queries;
+    jobs[t].nqueries = nqueries;
+    jobs[t].window = window;
+    jobs[t].first = (long)t * nqueries / threads;
+    jobs[t].deadline = start + seconds;
+    pthread_create(&jobs[t].thread, NULL, run, &jobs[t]);
+  }
+  for (int t = 0; t < threads; t++) {
+    pthread_join(jobs[t].thread, NULL);
+    sent += jobs[t].sent;
+    noerror += jobs[t].noerror;
+    nxdomain += jobs[t].nxdomain;
+    other += jobs[t].other;
+    lost += jobs[t].lost;
+  }
+  elapsed = now() - start;
+  printf("%ld queries in %.1f s with %d threads: %.0f answers per second\n",
+         sent, elapsed, threads, (noerror + nxdomain + other) / elapsed);
+  printf("NOERROR %ld, NXDOMAIN %ld, other %ld, lost %ld\n", noerror, nxdomain, other, lost);
+  free(jobs);
+  free(queries);
+  return 0;
+}
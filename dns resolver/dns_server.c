@@ -0,0 +1,334 @@
+/****************************************************************************
+*       Authoritative DNS responder for the game backends.
+*
+*       Usage : ./dns_server.out [-t threads] [-a address]
+*                                <zone file> <any port number>
+*
+*       Answers UDP queries for the names of one zone (see zone.h) so
+*       that clients can find the game servers by name, SRV records
+*       included. Every thread has a socket of its own bound to the same
+*       port with SO_REUSEPORT, and the kernel spreads the queries over
+*       them; a thread takes up to BATCH queries with one recvmmsg and
+*       sends all their answers with one sendmmsg. An answer is the
+*       header and question of the query followed by the sections
+*       compiled when the zone was loaded, copied as they are.
+*
+*       SIGHUP loads the zone file again. The new zone replaces the old
+*       one with an atomic exchange, so queries go on being answered
+*       while it loads, and each from one zone or the other, never a
+*       mix. A thread counts its epoch up before and after every batch;
+*       the old zone is freed once no thread is still in a batch that
+*       started before the exchange. If the file has an error the old
+*       zone stays.
+*
+*       SIGUSR1 prints the queries answered so far, SIGINT and SIGTERM
+*       print them too and exit: the rate over the wall time and over
+*       the CPU time of the process, which is the rate of one core fully
+*       busy with queries.
+*
+*****************************************************************************/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include "zone.h"
+
+#define BATCH 64            /* Queries per recvmmsg. */
+#define THREADS 1
+
+/* Response codes. */
+#define RCODE_NOERROR  0
+#define RCODE_FORMERR  1
+#define RCODE_NXDOMAIN 3
+#define RCODE_NOTIMP   4
+#define RCODE_REFUSED  5
+
+/* Header flags. */
+#define FLAG_QR 0x8000
+#define FLAG_AA 0x0400
+#define FLAG_TC 0x0200
+#define FLAG_RD 0x0100
+
+struct worker {
+    alignas(64) atomic_uint epoch;  /* Odd while answering a batch. */
+    atomic_ulong queries;
+    pthread_t thread;
+    int sockfd;
+    unsigned char in[BATCH][DNS_UDP_MAX];
+    unsigned char out[BATCH][DNS_UDP_MAX];
+};
+
+static _Atomic(struct zone *) current;
+
+void error(const char *msg) {
+    perror(msg);
+    exit(EXIT_FAILURE);
+}
+
+static void put16(unsigned char *p, unsigned v) {
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static unsigned get16(const unsigned char *p) {
+    return p[0] << 8 | p[1];
+}
+
+/* Writes the answer to a query of len bytes into out. Returns its length,
+ * or 0 if the query gets none. */
+static int answer(const struct zone *z, const unsigned char *q, int len, unsigned char *out) {
+    unsigned char name[DNS_NAME_MAX];
+    unsigned flags = get16(q + 2);
+    int p = DNS_HEADER_LEN, name_len = 0, rcode = RCODE_NOERROR, type, class, reply;
+    const struct zone_entry *e = NULL;
+
+    if (len < DNS_HEADER_LEN || flags & FLAG_QR)
+        return 0;
+    memcpy(out, q, 2);
+    memset(out + 4, 0, DNS_HEADER_LEN - 4);
+    flags = FLAG_QR | FLAG_AA | (flags & (0x7800 | FLAG_RD));
+    if (flags & 0x7800) {
+        put16(out + 2, flags | RCODE_NOTIMP);
+        return DNS_HEADER_LEN;
+    }
+
+    /* The one question, its name in lower case as the zone has it. */
+    while (p < len && q[p] && q[p] < 64 && name_len + q[p] + 1 < DNS_NAME_MAX) {
+        name[name_len++] = q[p];
+        for (int i = 1; i <= q[p] && p + i < len; i++)
+            name[name_len++] = q[p + i] | ((unsigned)q[p + i] - 'A' < 26 ? 0x20 : 0);
+        p += q[p] + 1;
+    }
+    if (get16(q + 4) != 1 || p + 5 > len || q[p]) {
+        put16(out + 2, flags | RCODE_FORMERR);
+        return DNS_HEADER_LEN;
+    }
+    name[name_len++] = 0;
+    p += 5;
+    type = get16(q + p - 4);
+    class = get16(q + p - 2);
+    reply = p;
+    memcpy(out + DNS_HEADER_LEN, q + DNS_HEADER_LEN, p - DNS_HEADER_LEN);
+    put16(out + 4, 1);
+
+    if (class != DNS_CLASS_IN || !zoneContains(z, name, name_len))
+        rcode = RCODE_REFUSED;
+    else if (type == ZONE_EXISTS || (e = zoneFind(z, name, name_len, type)) == NULL)
+        rcode = zoneFind(z, name, name_len, ZONE_EXISTS) ? RCODE_NOERROR : RCODE_NXDOMAIN;
+    if (rcode == RCODE_REFUSED)
+        flags &= ~FLAG_AA;
+    if (e) {
+        if (e->flags & ZONE_TRUNCATED)
+            flags |= FLAG_TC;
+        memcpy(out + reply, z->data + e->answer, e->answer_len);
+        reply += e->answer_len;
+        put16(out + 6, e->ancount);
+        put16(out + 10, e->arcount);
+    }
+    put16(out + 2, flags | rcode);
+    return reply;
+}
+
+static void *serve(void *arg) {
+    struct worker *w = arg;
+    struct mmsghdr in[BATCH], out[BATCH];
+    struct iovec in_iov[BATCH], out_iov[BATCH];
+    struct sockaddr_in6 from[BATCH];
+
+    for (int i = 0; i < BATCH; i++) {
+        in_iov[i] = (struct iovec){ w->in[i], DNS_UDP_MAX };
+        out_iov[i].iov_base = w->out[i];
+    }
+    for (;;) {
+        int n, replies = 0;
+
+        for (int i = 0; i < BATCH; i++)
+            in[i].msg_hdr = (struct msghdr){ .msg_name = &from[i], .msg_namelen = sizeof(from[i]),
+                                             .msg_iov = &in_iov[i], .msg_iovlen = 1 };
+        n = recvmmsg(w->sockfd, in, BATCH, MSG_WAITFORONE, NULL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            error("ERROR on recvmmsg");
+        }
+
+        atomic_fetch_add(&w->epoch, 1);
+        const struct zone *z = atomic_load(&current);
+        for (int i = 0; i < n; i++) {
+            int len = answer(z, w->in[i], in[i].msg_len, w->out[replies]);
+            if (len == 0)
+                continue;
+            out_iov[replies].iov_base = w->out[replies];
+            out_iov[replies].iov_len = len;
+            out[replies].msg_hdr = (struct msghdr){ .msg_name = &from[i], .msg_namelen = in[i].msg_hdr.msg_namelen,
+                                                    .msg_iov = &out_iov[replies], .msg_iovlen = 1 };
+            replies++;
+        }
+        atomic_fetch_add(&w->epoch, 1);
+
+        /* A reply the socket cannot take is lost, as the network could
+         * have lost it; the client asks again. */
+        for (int sent = 0; sent < replies; ) {
+            int m = sendmmsg(w->sockfd, out + sent, replies - sent, 0);
+            if (m < 0 && errno == EINTR)
+                continue;
+            if (m <= 0) {
+                sent++;
+                continue;
+            }
+            sent += m;
+        }
+        atomic_fetch_add_explicit(&w->queries, n, memory_order_relaxed);
+    }
+    return NULL;
+}
+
+static int openSocket(const char *address, int port) {
+    struct sockaddr_in6 addr = { .sin6_family = AF_INET6, .sin6_port = htons(port), .sin6_addr = in6addr_any };
+    int sockfd = socket(AF_INET6, SOCK_DGRAM, 0), on = 1, off = 0;
+
+    if (sockfd < 0)
+        error("ERROR opening socket");
+    if (address) {
+        struct in_addr v4;
+        if (inet_pton(AF_INET, address, &v4) == 1) {
+            /* IPv4 as a mapped address on the dual stack socket. */
+            addr.sin6_addr.s6_addr[10] = addr.sin6_addr.s6_addr[11] = 0xff;
+            memcpy(&addr.sin6_addr.s6_addr[12], &v4, 4);
+        } else if (inet_pton(AF_INET6, address, &addr.sin6_addr) != 1) {
+            fprintf(stderr, "ERROR bad address %s\n", address);
+            exit(EXIT_FAILURE);
+        }
+    }
+    setsockopt(sockfd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)
+        error("ERROR setting SO_REUSEPORT");
+    if (bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        error("ERROR on binding");
+    return sockfd;
+}
+
+static double seconds(const struct timespec *t) {
+    return t->tv_sec + t->tv_nsec / 1e9;
+}
+
+static void report(struct worker *workers, int threads, const struct timespec *start) {
+    struct timespec now;
+    struct rusage ru;
+    unsigned long queries = 0;
+    double wall, cpu;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    getrusage(RUSAGE_SELF, &ru);
+    for (int t = 0; t < threads; t++)
+        queries += atomic_load_explicit(&workers[t].queries, memory_order_relaxed);
+    wall = seconds(&now) - seconds(start);
+    cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+    printf("%lu queries in %.1f s: %.0f per second, %.0f per CPU second (%.1f s CPU)\n",
+           queries, wall, wall > 0 ? queries / wall : 0, cpu > 0 ? queries / cpu : 0, cpu);
+    fflush(stdout);
+}
+
+/* Swaps in the zone file as it is now, and frees the old zone once no
+ * thread can still be reading it. */
+static void reload(const char *path, struct worker *workers, int threads) {
+    char err[256];
+    struct zone *z = zoneLoad(path, err, sizeof(err)), *old;
+    unsigned epochs[threads];
+
+    if (z == NULL) {
+        fprintf(stderr, "%s: %s, keeping the old zone\n", path, err);
+        return;
+    }
+    old = atomic_exchange(&current, z);
+    for (int t = 0; t < threads; t++)
+        epochs[t] = atomic_load(&workers[t].epoch);
+    for (int t = 0; t < threads; t++)
+        while (epochs[t] & 1 && atomic_load(&workers[t].epoch) == epochs[t])
+            sched_yield();
+    zoneFree(old);
+    printf("Reloaded %s: %ld records, %ld names\n", path, z->records, z->names);
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[]) {
+  const char *address = NULL, *path;
+  struct worker *workers;
+  struct timespec start;
+  struct zone *z;
+  char err[256];
+  sigset_t mask;
+  int opt, threads = THREADS, port;
+
+  while ((opt = getopt(argc, argv, "t:a:")) != -1) {
+    if (opt == 't')
+      threads = strtol(optarg, NULL, 10);
+    else if (opt == 'a')
+      address = optarg;
+    else
+      error("Usage : ./dns_server.out [-t threads] [-a address] <zone file> <port>");
+  }
+  if (optind + 2 > argc) {
+      error("ERROR zone file and port required");
+  }
+  if (threads < 1)
+    threads = 1;
+  path = argv[optind];
+  port = strtol(argv[optind + 1], NULL, 10);
+
+  if ((z = zoneLoad(path, err, sizeof(err))) == NULL) {
+    fprintf(stderr, "%s: %s\n", path, err);
+    exit(EXIT_FAILURE);
+  }
+  atomic_store(&current, z);
+  printf("Loaded %s: %ld records, %ld names\n", path, z->records, z->names);
+
+  /* Signals are taken by this thread alone, with sigwaitinfo. */
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGHUP);
+  sigaddset(&mask, SIGUSR1);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+  workers = aligned_alloc(64, threads * sizeof(*workers));
+  if (workers == NULL)
+    error("ERROR allocating workers");
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int t = 0; t < threads; t++) {
+    atomic_init(&workers[t].epoch, 0);
+    atomic_init(&workers[t].queries, 0);
+    workers[t].sockfd = openSocket(address, port);
+  }
+  for (int t = 0; t < threads; t++)
+    if (pthread_create(&workers[t].thread, NULL, serve, &workers[t]) != 0)
+      error("ERROR starting threads");
+  printf("Answering on port %d with %d threads\n", port, threads);
+  fflush(stdout);
+
+  for (;;) {
+    int sig = sigwaitinfo(&mask, NULL);
+    if (sig == SIGHUP)
+      reload(path, workers, threads);
+    else if (sig == SIGUSR1)
+      report(workers, threads, &start);
+    else if (sig == SIGINT || sig == SIGTERM)
+      break;
+  }
+  report(workers, threads, &start);
+  return 0;
+}
@@ -4,13 +4,88 @@
 Spyder Editor
 by Kumar Aman
 
+Usage: google_dns_resolver.py [-s host:port] [-f names file] [name [type]]
+
+Without -s the system resolver looks the name up. With -s the query goes
+straight to that DNS server, dns_server.out for one, and any type can be
+asked for. -f asks for every "name [type]" line of a file, as
+dns_bench.out does.
 """
 import sys
 import socket
+import struct
+
+TYPES = {"A": 1, "TXT": 16, "AAAA": 28, "SRV": 33}
+RCODES = {0: "NOERROR", 1: "FORMERR", 2: "SERVFAIL", 3: "NXDOMAIN", 4: "NOTIMP", 5: "REFUSED"}
+
+
+def readName(packet, pos):
+    labels = []
+    end = None
+    while packet[pos]:
+        if packet[pos] >= 0xC0:
+            if end is None:
+                end = pos + 2
+            pos = struct.unpack("!H", packet[pos:pos + 2])[0] & 0x3FFF
+            continue
+        labels.append(packet[pos + 1:pos + 1 + packet[pos]].decode())
+        pos += packet[pos] + 1
+    return ".".join(labels) + ".", end if end is not None else pos + 1
+
+
+def readData(packet, pos, rtype, rdlen):
+    if rtype == TYPES["A"]:
+        return socket.inet_ntop(socket.AF_INET, packet[pos:pos + 4])
+    if rtype == TYPES["AAAA"]:
+        return socket.inet_ntop(socket.AF_INET6, packet[pos:pos + 16])
+    if rtype == TYPES["SRV"]:
+        priority, weight, port = struct.unpack("!HHH", packet[pos:pos + 6])
+        return "%d %d %d %s" % (priority, weight, port, readName(packet, pos + 6)[0])
+    if rtype == TYPES["TXT"]:
+        return '"%s"' % packet[pos + 1:pos + 1 + packet[pos]].decode()
+    return packet[pos:pos + rdlen].hex()
+
+
+def query(server, name, qtype):
+    qname = b"".join(bytes([len(label)]) + label.encode() for label in name.strip(".").split(".") if label)
+    packet = struct.pack("!HHHHHH", 0x1234, 0x0100, 1, 0, 0, 0) + qname + b"\0" + struct.pack("!HH", TYPES[qtype], 1)
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.settimeout(2)
+    sock.sendto(packet, server)
+    reply = sock.recv(512)
+    sock.close()
+
+    flags, qdcount, ancount, nscount, arcount = struct.unpack("!HHHHH", reply[2:12])
+    print("%s %s: %s%s" % (name, qtype, RCODES.get(flags & 15, flags & 15), " (truncated)" if flags & 0x200 else ""))
+    pos = 12
+    for i in range(qdcount):
+        pos = readName(reply, pos)[1] + 4
+    for i in range(ancount + nscount + arcount):
+        owner, pos = readName(reply, pos)
+        rtype, rclass, ttl, rdlen = struct.unpack("!HHIH", reply[pos:pos + 10])
+        rtypes = {v: k for k, v in TYPES.items()}
+        print("   %s %d %s %s" % (owner, ttl, rtypes.get(rtype, rtype), readData(reply, pos + 10, rtype, rdlen)))
+        pos += 10 + rdlen
+
+
+args = sys.argv[1:]
+server = None
+names = []
+while args and args[0] in ("-s", "-f") and len(args) > 1:
+    if args[0] == "-s":
+        host, port = args[1].rsplit(":", 1)
+        server = (host, int(port))
+    else:
+        with open(args[1]) as f:
+            names += [line.split() for line in f if line.strip() and not line.startswith("#")]
+    args = args[2:]
+if args:
+    names.append(args)
+if not names:
+    names.append([input("Provide the domain address to resolve: ")])
 
-if (len(sys.argv) < 2):
-    server = input("Provide the domain address to resolve: ")
-else:
-    server = sys.argv[1]
-    
-print("IP: ", socket.gethostbyname(server))
\ No newline at end of file
+for fields in names:
+    if server is None:
+        print("IP: ", socket.gethostbyname(fields[0]))
+    else:
+        query(server, fields[0], fields[1].upper() if len(fields) > 1 else "A")
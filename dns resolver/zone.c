@@ -0,0 +1,459 @@
+/****************************************************************************
+*       Zone of the DNS responder: loading and lookups (see zone.h).
+*
+*****************************************************************************/
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "zone.h"
+
+#define LINE_LEN  1024
+#define RDATA_MAX 512
+#define DEFAULT_TTL 300
+
+struct record {
+    unsigned char name[DNS_NAME_MAX];
+    int name_len;
+    int type;
+    uint32_t ttl;
+    unsigned char rdata[RDATA_MAX];
+    int rdata_len;
+    int target;             /* SRV: offset of the target name in rdata. */
+};
+
+/* Growing block of bytes. */
+struct buf {
+    unsigned char *p;
+    long len, cap;
+};
+
+static int reserve(struct buf *b, long len) {
+    if (b->len + len <= b->cap)
+        return 0;
+    long cap = b->cap ? b->cap : 4096;
+    while (cap < b->len + len)
+        cap *= 2;
+    unsigned char *p = realloc(b->p, cap);
+    if (p == NULL)
+        return -1;
+    b->p = p;
+    b->cap = cap;
+    return 0;
+}
+
+static int put(struct buf *b, const void *data, long len) {
+    if (reserve(b, len) < 0)
+        return -1;
+    memcpy(b->p + b->len, data, len);
+    b->len += len;
+    return 0;
+}
+
+static int put16(struct buf *b, unsigned v) {
+    unsigned char x[2] = { v >> 8, v };
+    return put(b, x, 2);
+}
+
+static int put32(struct buf *b, uint32_t v) {
+    unsigned char x[4] = { v >> 24, v >> 16, v >> 8, v };
+    return put(b, x, 4);
+}
+
+static uint32_t hashName(const unsigned char *name, int len, int type) {
+    uint32_t h = 2166136261u;   /* FNV-1a */
+
+    for (int i = 0; i < len; i++)
+        h = (h ^ name[i]) * 16777619u;
+    h = (h ^ (type & 0xff)) * 16777619u;
+    return (h ^ type >> 8) * 16777619u;
+}
+
+int zoneName(const char *text, const unsigned char *origin, int origin_len, unsigned char *wire) {
+    int len = 0, absolute = 0;
+
+    if (!strcmp(text, "@")) {
+        if (origin == NULL)
+            return -1;
+        memcpy(wire, origin, origin_len);
+        return origin_len;
+    }
+    if (!strcmp(text, "."))
+        text = "";
+    while (*text) {
+        const char *dot = strchr(text, '.');
+        int label = dot ? dot - text : (int)strlen(text);
+
+        if (label == 0 || label > 63 || len + 1 + label >= DNS_NAME_MAX)
+            return -1;
+        wire[len++] = label;
+        for (int i = 0; i < label; i++)
+            wire[len++] = tolower((unsigned char)text[i]);
+        text += label;
+        if (*text == '.' && *++text == '\0')
+            absolute = 1;
+    }
+    if (absolute || origin == NULL || len == 0) {
+        wire[len++] = 0;
+        return len;
+    }
+    if (len + origin_len > DNS_NAME_MAX)
+        return -1;
+    memcpy(wire + len, origin, origin_len);
+    return len + origin_len;
+}
+
+int zoneType(const char *name) {
+    static const struct { const char *name; int type; } types[] = {
+        { "A", DNS_TYPE_A }, { "AAAA", DNS_TYPE_AAAA }, { "SRV", DNS_TYPE_SRV }, { "TXT", DNS_TYPE_TXT },
+    };
+
+    for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++)
+        if (!strcasecmp(name, types[i].name))
+            return types[i].type;
+    return -1;
+}
+
+static int below(const unsigned char *name, int len, const unsigned char *origin, int origin_len) {
+    int p = 0, at = len - origin_len;
+
+    if (at < 0 || memcmp(name + at, origin, origin_len))
+        return 0;
+    /* The origin has to start at a label. */
+    while (p < at)
+        p += name[p] + 1;
+    return p == at;
+}
+
+int zoneContains(const struct zone *z, const unsigned char *name, int len) {
+    return below(name, len, z->origin, z->origin_len);
+}
+
+const struct zone_entry *zoneFind(const struct zone *z, const unsigned char *name, int len, int type) {
+    uint32_t h = hashName(name, len, type);
+
+    for (uint32_t i = h & z->mask; z->slots[i].key_len; i = (i + 1) & z->mask) {
+        const struct zone_entry *e = &z->slots[i];
+        if (e->hash == h && e->type == type && e->key_len == len && !memcmp(z->data + e->key, name, len))
+            return e;
+    }
+    return NULL;
+}
+
+/* Parses the data of a record after its type. Returns -1 if it is not
+ * valid. */
+static int parseData(struct record *r, char *data, const unsigned char *origin, int origin_len) {
+    char target[LINE_LEN];
+    unsigned priority, weight, port;
+    int n;
+
+    switch (r->type) {
+    case DNS_TYPE_A:
+        r->rdata_len = 4;
+        return inet_pton(AF_INET, data, r->rdata) == 1 ? 0 : -1;
+    case DNS_TYPE_AAAA:
+        r->rdata_len = 16;
+        return inet_pton(AF_INET6, data, r->rdata) == 1 ? 0 : -1;
+    case DNS_TYPE_SRV:
+        if (sscanf(data, "%u %u %u %1023s", &priority, &weight, &port, target) != 4 ||
+            priority > 65535 || weight > 65535 || port > 65535)
+            return -1;
+        r->rdata[0] = priority >> 8;
+        r->rdata[1] = priority;
+        r->rdata[2] = weight >> 8;
+        r->rdata[3] = weight;
+        r->rdata[4] = port >> 8;
+        r->rdata[5] = port;
+        r->target = 6;
+        if ((n = zoneName(target, origin, origin_len, r->rdata + 6)) < 0)
+            return -1;
+        r->rdata_len = 6 + n;
+        return 0;
+    case DNS_TYPE_TXT:
+        /* One string, quoted or to the end of the line. */
+        if (*data == '"') {
+            char *end = strrchr(++data, '"');
+            if (end == NULL)
+                return -1;
+            *end = '\0';
+        }
+        if ((n = strlen(data)) > 255)
+            return -1;
+        r->rdata[0] = n;
+        memcpy(r->rdata + 1, data, n);
+        r->rdata_len = 1 + n;
+        return 0;
+    }
+    return -1;
+}
+
+static int compareRecords(const void *a, const void *b) {
+    const struct record *x = a, *y = b;
+    int n = x->name_len < y->name_len ? x->name_len : y->name_len;
+    int c = memcmp(x->name, y->name, n);
+
+    if (c)
+        return c;
+    if (x->name_len != y->name_len)
+        return x->name_len - y->name_len;
+    return x->type - y->type;
+}
+
+/* Index of the first record with this name and type, or -1. */
+static long findRecords(const struct record *recs, long n, const unsigned char *name, int len, int type) {
+    struct record key;
+    long lo = 0, hi = n;
+
+    memcpy(key.name, name, len);
+    key.name_len = len;
+    key.type = type;
+    while (lo < hi) {
+        long mid = (lo + hi) / 2;
+        if (compareRecords(&recs[mid], &key) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo < n && !compareRecords(&recs[lo], &key) ? lo : -1;
+}
+
+static int putRecord(struct buf *b, const struct record *r) {
+    return put16(b, r->type) | put16(b, DNS_CLASS_IN) | put32(b, r->ttl) |
+           put16(b, r->rdata_len) | put(b, r->rdata, r->rdata_len);
+}
+
+/* Compiles the records [first, last) of one name and type into data. */
+static int compile(struct buf *data, const struct record *recs, long n, long first, long last,
+                   struct zone_entry *e) {
+    const struct record *r = &recs[first];
+    long answers;
+
+    memset(e, 0, sizeof(*e));
+    e->type = r->type;
+    e->key_len = r->name_len;
+    e->key = data->len;
+    if (put(data, r->name, r->name_len) < 0)
+        return -1;
+    e->answer = data->len;
+    for (long i = first; i < last; i++) {
+        /* The owner is the name in the question, right after the header. */
+        if (put16(data, 0xc000 | DNS_HEADER_LEN) < 0 || putRecord(data, &recs[i]) < 0)
+            return -1;
+        e->ancount++;
+    }
+    answers = data->len;
+
+    /* Addresses of SRV targets, each target once. */
+    for (long i = first; i < last && r->type == DNS_TYPE_SRV; i++) {
+        const unsigned char *target = recs[i].rdata + recs[i].target;
+        int target_len = recs[i].rdata_len - recs[i].target, seen = 0;
+
+        for (long j = first; j < i; j++)
+            seen |= recs[j].rdata_len - recs[j].target == target_len &&
+                    !memcmp(recs[j].rdata + recs[j].target, target, target_len);
+        for (int t = 0; t < 2 && !seen; t++) {
+            int type = t ? DNS_TYPE_AAAA : DNS_TYPE_A;
+            for (long a = findRecords(recs, n, target, target_len, type);
+                 a >= 0 && a < n && recs[a].type == type && recs[a].name_len == target_len &&
+                 !memcmp(recs[a].name, target, target_len); a++) {
+                if (put(data, target, target_len) < 0 || putRecord(data, &recs[a]) < 0)
+                    return -1;
+                e->arcount++;
+            }
+        }
+    }
+
+    /* What the question takes is known: it asks for this very name. */
+    if (DNS_HEADER_LEN + e->key_len + 4 + data->len - e->answer > DNS_UDP_MAX) {
+        data->len = answers;
+        e->arcount = 0;
+    }
+    if (DNS_HEADER_LEN + e->key_len + 4 + data->len - e->answer > DNS_UDP_MAX) {
+        data->len = e->answer;
+        e->ancount = 0;
+        e->flags = ZONE_TRUNCATED;
+    }
+    e->answer_len = data->len - e->answer;
+    return 0;
+}
+
+static int insert(struct zone *z, const struct zone_entry *e) {
+    uint32_t i;
+
+    if (zoneFind(z, z->data + e->key, e->key_len, e->type))
+        return 0;
+    for (i = e->hash & z->mask; z->slots[i].key_len; i = (i + 1) & z->mask)
+        ;
+    z->slots[i] = *e;
+    return 1;
+}
+
+static struct zone *fail(char *err, int errlen, int line, const char *msg, struct record *recs,
+                         struct buf *data, struct zone_entry *entries, struct zone *z) {
+    if (line)
+        snprintf(err, errlen, "line %d: %s", line, msg);
+    else
+        snprintf(err, errlen, "%s", msg);
+    free(recs);
+    free(data->p);
+    free(entries);
+    if (z)
+        free(z->slots);
+    free(z);
+    return NULL;
+}
+
+/* Next field of a line, or NULL at its end or a comment. */
+static char *field(char **rest) {
+    char *start = *rest + strspn(*rest, " \t");
+
+    if (*start == '\0' || *start == '#')
+        return NULL;
+    *rest = start + strcspn(start, " \t");
+    if (**rest)
+        *(*rest)++ = '\0';
+    return start;
+}
+
+static int number(const char *text) {
+    return *text && strspn(text, "0123456789") == strlen(text);
+}
+
+struct zone *zoneLoad(const char *path, char *err, int errlen) {
+    FILE *f = fopen(path, "r");
+    char line[LINE_LEN];
+    unsigned char origin[DNS_NAME_MAX];
+    int origin_len = 0, lineno = 0;
+    uint32_t ttl = DEFAULT_TTL;
+    struct record *recs = NULL;
+    long nrecs = 0, cap = 0, nentries = 0, wanted = 0, slots;
+    struct zone_entry *entries = NULL;
+    struct buf data = { 0 };
+    struct zone *z = NULL;
+
+    if (f == NULL)
+        return fail(err, errlen, 0, "cannot open the zone file", NULL, &data, NULL, NULL);
+    while (fgets(line, sizeof(line), f)) {
+        char *rest = line, *name, *type;
+        struct record *r;
+
+        lineno++;
+        line[strcspn(line, "\r\n")] = '\0';
+        if ((name = field(&rest)) == NULL)
+            continue;
+        if (!strcmp(name, "$ORIGIN")) {
+            char *text = field(&rest);
+            if (text == NULL || text[strlen(text) - 1] != '.' ||
+                (origin_len = zoneName(text, NULL, 0, origin)) < 0) {
+                fclose(f);
+                return fail(err, errlen, lineno, "bad $ORIGIN", recs, &data, NULL, NULL);
+            }
+            continue;
+        }
+        if (!strcmp(name, "$TTL")) {
+            char *text = field(&rest);
+            if (text == NULL || !number(text)) {
+                fclose(f);
+                return fail(err, errlen, lineno, "bad $TTL", recs, &data, NULL, NULL);
+            }
+            ttl = strtoul(text, NULL, 10);
+            continue;
+        }
+        if (origin_len == 0) {
+            fclose(f);
+            return fail(err, errlen, lineno, "record before $ORIGIN", recs, &data, NULL, NULL);
+        }
+
+        if (nrecs == cap) {
+            struct record *grown = realloc(recs, (cap ? cap * 2 : 64) * sizeof(*recs));
+            if (grown == NULL) {
+                fclose(f);
+                return fail(err, errlen, 0, "out of memory", recs, &data, NULL, NULL);
+            }
+            recs = grown;
+            cap = cap ? cap * 2 : 64;
+        }
+        r = &recs[nrecs];
+        memset(r, 0, sizeof(*r));
+        r->ttl = ttl;
+        /* Name, optional TTL and type; the data is the rest of the line. */
+        if ((type = field(&rest)) != NULL && number(type)) {
+            r->ttl = strtoul(type, NULL, 10);
+            type = field(&rest);
+        }
+        rest += strspn(rest, " \t");
+        for (char *end = rest + strlen(rest); end > rest && (end[-1] == ' ' || end[-1] == '\t'); )
+            *--end = '\0';
+        if (type == NULL || (r->name_len = zoneName(name, origin, origin_len, r->name)) < 0 ||
+            (r->type = zoneType(type)) < 0 || parseData(r, rest, origin, origin_len) < 0) {
+            fclose(f);
+            return fail(err, errlen, lineno, "bad record", recs, &data, NULL, NULL);
+        }
+        if (!below(r->name, r->name_len, origin, origin_len)) {
+            fclose(f);
+            return fail(err, errlen, lineno, "name outside the zone", recs, &data, NULL, NULL);
+        }
+        nrecs++;
+    }
+    fclose(f);
+    if (origin_len == 0)
+        return fail(err, errlen, 0, "no $ORIGIN", recs, &data, NULL, NULL);
+
+    /* An entry for every name and type there are records for, then one
+     * for every name: those of the records, the origin and all the names
+     * in between, which exist even without records of their own. */
+    qsort(recs, nrecs, sizeof(*recs), compareRecords);
+    entries = calloc(nrecs + 1, sizeof(*entries));
+    if (entries == NULL || put(&data, origin, origin_len) < 0)
+        return fail(err, errlen, 0, "out of memory", recs, &data, entries, NULL);
+    entries[nentries++] = (struct zone_entry){ .type = ZONE_EXISTS, .key_len = origin_len };
+    for (long i = 0, j; i < nrecs; i = j) {
+        for (j = i; j < nrecs && !compareRecords(&recs[i], &recs[j]); j++)
+            ;
+        if (compile(&data, recs, nrecs, i, j, &entries[nentries++]) < 0)
+            return fail(err, errlen, 0, "out of memory", recs, &data, entries, NULL);
+    }
+    for (long i = 0; i < nentries; i++)
+        for (int p = 0; p < entries[i].key_len; p += data.p[entries[i].key + p] + 1)
+            wanted++;
+    z = calloc(1, sizeof(*z));
+    for (slots = 16; slots < 2 * (nentries + wanted); slots *= 2)
+        ;
+    if (z == NULL || (z->slots = calloc(slots, sizeof(*z->slots))) == NULL)
+        return fail(err, errlen, 0, "out of memory", recs, &data, entries, z);
+    z->mask = slots - 1;
+    z->data = data.p;
+    memcpy(z->origin, origin, origin_len);
+    z->origin_len = origin_len;
+    z->records = nrecs;
+    for (long i = 1; i < nentries; i++) {
+        entries[i].hash = hashName(data.p + entries[i].key, entries[i].key_len, entries[i].type);
+        insert(z, &entries[i]);
+    }
+    for (long i = 0; i < nentries; i++) {
+        struct zone_entry name = { .type = ZONE_EXISTS, .key = entries[i].key, .key_len = entries[i].key_len };
+
+        for (;;) {
+            name.hash = hashName(data.p + name.key, name.key_len, ZONE_EXISTS);
+            z->names += insert(z, &name);
+            if (name.key_len == origin_len)
+                break;
+            name.key_len -= data.p[name.key] + 1;
+            name.key += data.p[name.key] + 1;
+        }
+    }
+    free(entries);
+    free(recs);
+    return z;
+}
+
+void zoneFree(struct zone *z) {
+    if (z == NULL)
+        return;
+    free(z->slots);
+    free(z->data);
+    free(z);
+}
@@ -0,0 +1,95 @@
+/****************************************************************************
+*       Zone of the DNS responder: the records it is authoritative for,
+*       compiled into the answers it sends.
+*
+*       A zone file has a record per line, blank lines and lines starting
+*       with # aside:
+*
+*       $ORIGIN games.example.
+*       $TTL 30
+*       @              A     10.0.0.1
+*       backend1       A     10.0.0.11
+*       backend1   60  AAAA  fd00::11
+*       _ttt._tcp      SRV   10 50 5101 backend1
+*       motd           TXT   "Tic Tac Toe"
+*
+*       Names ending in a dot are absolute, others are relative to the
+*       origin, and @ is the origin itself; every name has to be in the
+*       zone, at or below the origin. The TTL of a record is optional
+*       and defaults to the last $TTL. Types are A, AAAA, SRV and TXT,
+*       class IN only.
+*
+*       Loading compiles the answer to every name and type there is a
+*       record for: the answer and additional sections as they go on
+*       the wire after the question, the owner names pointing back at
+*       the question. SRV answers carry the A and AAAA records of their
+*       targets in the zone as additional records, as long as the
+*       answer still fits in a plain UDP message; one that does not fit
+*       even without them is answered truncated. The compiled answers
+*       go into one block of memory, found through an open addressing
+*       hash table by lower case wire name and type. A zone is never
+*       changed once loaded, so any number of threads can read it.
+*
+*****************************************************************************/
+
+#ifndef ZONE_H
+#define ZONE_H
+
+#include <stdint.h>
+
+#define DNS_HEADER_LEN 12
+#define DNS_NAME_MAX   255  /* Wire form, with the final zero length. */
+#define DNS_UDP_MAX    512  /* Messages without EDNS. */
+
+#define DNS_TYPE_A    1
+#define DNS_TYPE_TXT  16
+#define DNS_TYPE_AAAA 28
+#define DNS_TYPE_SRV  33
+#define DNS_CLASS_IN  1
+
+/* Type of the entry that says a name exists, with records of its own or
+ * only names below it. */
+#define ZONE_EXISTS 0
+
+/* Entry flags. */
+#define ZONE_TRUNCATED 1    /* Too big for UDP; answered with TC set. */
+
+struct zone_entry {
+    uint32_t hash;
+    uint16_t type;
+    uint16_t key_len;       /* 0 for an empty slot. */
+    uint32_t key;           /* Offset of the wire name in data. */
+    uint32_t answer;        /* Offset of the compiled sections in data. */
+    uint16_t answer_len;
+    uint16_t ancount, arcount;
+    uint16_t flags;
+};
+
+struct zone {
+    uint32_t mask;          /* Slots less one; there are a power of two. */
+    struct zone_entry *slots;
+    unsigned char *data;
+    unsigned char origin[DNS_NAME_MAX];
+    int origin_len;
+    long records, names;
+};
+
+/* Loads and compiles a zone file. Returns NULL with a message in err if
+ * it cannot be read or has an error. */
+struct zone *zoneLoad(const char *path, char *err, int errlen);
+void zoneFree(struct zone *z);
+
+/* Looks up a lower case wire name. zoneFind returns NULL if there are no
+ * records of the type; ZONE_EXISTS finds any name in the zone. */
+const struct zone_entry *zoneFind(const struct zone *z, const unsigned char *name, int len, int type);
+int zoneContains(const struct zone *z, const unsigned char *name, int len);
+
+/* Turns a name in text into lower case wire form, relative names onto
+ * origin (which may be NULL for none). Returns the length, or -1 if it
+ * is not a valid name. */
+int zoneName(const char *text, const unsigned char *origin, int origin_len, unsigned char *wire);
+
+/* Type by name, or -1. */
+int zoneType(const char *name);
+
+#endif
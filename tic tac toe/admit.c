@@ -0,0 +1,42 @@
+/****************************************************************************
+*       Admission control for new connections: token buckets.
+*
+*****************************************************************************/
+
+#include <stddef.h>
+
+#include "admit.h"
+
+int bucketTake(struct bucket *b, long now, int rate, int burst) {
+    if (rate <= 0)
+        return 1;
+    b->tokens += (now - b->stamp) * (double)rate / 1000;
+    if (b->tokens > burst)
+        b->tokens = burst;
+    b->stamp = now;
+    if (b->tokens < 1)
+        return 0;
+    b->tokens -= 1;
+    return 1;
+}
+
+int addrTake(struct addr_table *t, uint32_t addr, long now, int rate, int burst) {
+    unsigned home = (uint32_t)(addr * 2654435769u) >> (32 - ADDR_BITS);
+    struct addr_bucket *oldest = NULL;
+
+    if (rate <= 0)
+        return 1;
+    for (unsigned i = 0; i < ADDR_WINDOW; i++) {
+        struct addr_bucket *slot = &t->slots[(home + i) & (ADDR_SLOTS - 1)];
+
+        if (slot->addr == addr)
+            return bucketTake(&slot->b, now, rate, burst);
+        if (oldest == NULL || slot->addr == 0 || (oldest->addr && slot->b.stamp < oldest->b.stamp))
+            oldest = slot;
+    }
+
+    oldest->addr = addr;
+    oldest->b.tokens = burst;
+    oldest->b.stamp = now;
+    return bucketTake(&oldest->b, now, rate, burst);
+}
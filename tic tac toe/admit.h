@@ -0,0 +1,43 @@
+/****************************************************************************
+*       Admission control for new connections: token buckets, globally
+*       and per source address.
+*
+*       A bucket holds up to burst tokens and gains rate tokens a second;
+*       every connection takes one. The per address buckets live in a
+*       fixed table. An address that is not in its window of the table
+*       takes the slot that was used longest ago, which is as good as a
+*       full bucket for an address that was quiet that long.
+*
+*****************************************************************************/
+
+#ifndef ADMIT_H
+#define ADMIT_H
+
+#include <stdint.h>
+
+#define ADDR_BITS   12
+#define ADDR_SLOTS  (1 << ADDR_BITS)
+#define ADDR_WINDOW 8
+
+struct bucket {
+    double tokens;
+    long stamp;             /* ms of the last refill. */
+};
+
+struct addr_bucket {
+    uint32_t addr;          /* 0 for a free slot. */
+    struct bucket b;
+};
+
+struct addr_table {
+    struct addr_bucket slots[ADDR_SLOTS];
+};
+
+/* Returns 1 and takes a token if there is one, 0 if not. A rate of 0
+ * means no limit. */
+int bucketTake(struct bucket *b, long now, int rate, int burst);
+
+/* Same for the bucket of an IPv4 address. */
+int addrTake(struct addr_table *t, uint32_t addr, long now, int rate, int burst);
+
+#endif
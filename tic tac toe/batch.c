@@ -0,0 +1,148 @@
+/****************************************************************************
+*       Many games played at once, stored by field (see batch.h).
+*
+*****************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "batch.h"
+
+typedef int8_t s8 __attribute__((vector_size(BATCH_LANES)));
+typedef int16_t s16 __attribute__((vector_size(BATCH_LANES * 2)));
+typedef uint16_t u16 __attribute__((vector_size(BATCH_LANES * 2)));
+
+/* Rows, columns and diagonals, as bitboards. */
+static const int16_t lines[8] = { 0007, 0070, 0700, 0111, 0222, 0444, 0421, 0124 };
+
+int batchInit(struct game_batch *b, int n) {
+    memset(b, 0, sizeof(*b));
+    b->n = (n + BATCH_LANES - 1) / BATCH_LANES * BATCH_LANES;
+    b->bits[0] = calloc(b->n, sizeof(uint16_t));
+    b->bits[1] = calloc(b->n, sizeof(uint16_t));
+    b->turn = calloc(b->n, 1);
+    b->moves = calloc(b->n, 1);
+    b->last_move = calloc(b->n, 1);
+    b->status = calloc(b->n, 1);
+    b->winner = calloc(b->n, 1);
+    for (int w = 0; w < 3; w++)
+        b->history[w] = calloc(b->n, sizeof(uint16_t));
+    if (!b->bits[0] || !b->bits[1] || !b->turn || !b->moves || !b->last_move ||
+        !b->status || !b->winner || !b->history[0] || !b->history[1] || !b->history[2]) {
+        batchFree(b);
+        return -1;
+    }
+    for (int i = 0; i < b->n; i++)
+        batchReset(b, i);
+    return 0;
+}
+
+void batchFree(struct game_batch *b) {
+    free(b->bits[0]);
+    free(b->bits[1]);
+    free(b->turn);
+    free(b->moves);
+    free(b->last_move);
+    free(b->status);
+    free(b->winner);
+    for (int w = 0; w < 3; w++)
+        free(b->history[w]);
+    memset(b, 0, sizeof(*b));
+}
+
+void batchReset(struct game_batch *b, int i) {
+    b->bits[0][i] = b->bits[1][i] = 0;
+    b->turn[i] = 1;
+    b->moves[i] = 0;
+    b->last_move[i] = -1;
+    b->status[i] = GAME_RUNNING;
+    b->winner[i] = -1;
+    b->history[0][i] = b->history[1][i] = b->history[2][i] = 0;
+}
+
+void batchGet(const struct game_batch *b, int i, struct game *g) {
+    for (int cell = 0; cell < BOARD_CELLS; cell++)
+        g->board[cell / 3][cell % 3] = b->bits[1][i] >> cell & 1 ? 'X' : b->bits[0][i] >> cell & 1 ? 'O' : ' ';
+    g->turn = b->turn[i];
+    g->moves = b->moves[i];
+    g->last_move = b->last_move[i];
+    g->status = b->status[i];
+    g->winner = b->winner[i];
+    g->history = b->history[0][i] | (uint32_t)b->history[1][i] << 16 | (uint64_t)b->history[2][i] << 32;
+}
+
+#define LOAD8(v, p) (memcpy(&v8, (p), sizeof(v8)), v = __builtin_convertvector(v8, s16))
+#define STORE8(p, v) (v8 = __builtin_convertvector(v, s8), memcpy((p), &v8, sizeof(v8)))
+
+void batchPlay(struct game_batch *b, const int8_t *players, const int8_t *moves, int8_t *results) {
+    for (int i = 0; i < b->n; i += BATCH_LANES) {
+        s8 v8;
+        s16 o, x, p, move, turn, count, last, status, winner;
+        s16 bit, valid, is_x, mine, win, draw, ok;
+        u16 nibble, history[3];     /* Nibble 3 of a move to 8 is 1 << 15. */
+
+        memcpy(&o, b->bits[0] + i, sizeof(o));
+        memcpy(&x, b->bits[1] + i, sizeof(x));
+        for (int w = 0; w < 3; w++)
+            memcpy(&history[w], b->history[w] + i, sizeof(history[w]));
+        LOAD8(p, players + i);
+        LOAD8(move, moves + i);
+        LOAD8(turn, b->turn + i);
+        LOAD8(count, b->moves + i);
+        LOAD8(last, b->last_move + i);
+        LOAD8(status, b->status + i);
+        LOAD8(winner, b->winner + i);
+
+        /* Checks of gamePlay and checkMove, every lane at once. A move
+         * off the board has no bit and fails them anyway. Baseline x86-64
+         * cannot shift each lane by a count of its own, hence the loops
+         * here and for the history. */
+        valid = (p != BATCH_IDLE) & (p == turn) & (status == GAME_RUNNING) &
+                (move >= 0) & (move < BOARD_CELLS);
+        bit = (s16){ 0 };
+        for (int cell = 0; cell < BOARD_CELLS; cell++)
+            bit |= (move == (int16_t)cell) & (int16_t)(1 << cell);
+        valid &= ((o | x) & bit) == 0;
+
+        /* updateBoard. */
+        bit &= valid;
+        is_x = p == 1;
+        x |= bit & is_x;
+        o |= bit & ~is_x;
+
+        /* checkBoard, on every line of the mover's cells. */
+        mine = (x & is_x) | (o & ~is_x);
+        win = (s16){ 0 };
+        for (int l = 0; l < 8; l++)
+            win |= (mine & lines[l]) == lines[l];
+        win &= valid;
+
+        /* The move is nibble count of the history: nibble count % 4 of
+         * word count / 4, put in place by multiplying. */
+        nibble = (u16){ 0 };
+        for (int n = 0; n < 4; n++)
+            nibble |= (u16)((count & 3) == (int16_t)n) & (uint16_t)(1 << 4 * n);
+        nibble *= (u16)(move & valid);
+        for (int w = 0; w < 3; w++)
+            history[w] |= nibble & (u16)((count >> 2) == (int16_t)w);
+        count -= valid;     /* valid is -1 where the move counts. */
+        draw = valid & ~win & (count == BOARD_CELLS);
+        ok = valid & ~win & ~draw;
+
+        last = (move & valid) | (last & ~valid);
+        status |= (win & GAME_WON) | (draw & GAME_DRAW);
+        winner = (p & win) | (winner & ~win);
+        turn = ((1 - p) & ok) | (turn & ~ok);
+
+        memcpy(b->bits[0] + i, &o, sizeof(o));
+        memcpy(b->bits[1] + i, &x, sizeof(x));
+        for (int w = 0; w < 3; w++)
+            memcpy(b->history[w] + i, &history[w], sizeof(history[w]));
+        STORE8(b->turn + i, turn);
+        STORE8(b->moves + i, count);
+        STORE8(b->last_move + i, last);
+        STORE8(b->status + i, status);
+        STORE8(b->winner + i, winner);
+        STORE8(results + i, (MOVE_INVALID & ~valid) | (MOVE_OK & ok) | (MOVE_WIN & win) | (MOVE_DRAW & draw));
+    }
+}
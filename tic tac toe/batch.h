@@ -0,0 +1,57 @@
+/****************************************************************************
+*       Many games played at once, stored by field rather than by game.
+*
+*       A batch keeps every field of its games in an array of its own:
+*       the cells of each player as a 9 bit bitboard, bit i for position
+*       i, and the turn, move count, last move, status, winner and
+*       history of struct game. batchPlay takes at most one move per game
+*       and validates it, plays it and checks for a win or a draw in all
+*       of the games together, BATCH_LANES games at a time in vector
+*       registers and without a branch per game; the caller then deals
+*       with the results. The rules are those of gamePlay, which gives
+*       the same result for the same move. Built for baseline x86-64 a
+*       vector holds 8 games; with -march that has AVX2, 16.
+*
+*****************************************************************************/
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdint.h>
+
+#include "game.h"
+
+/* Games per vector of 16 bit lanes, one register wide: wider vectors
+ * than the target has are compared a lane at a time. Batches are rounded
+ * up to a multiple. */
+#ifdef __AVX2__
+#define BATCH_LANES 16
+#else
+#define BATCH_LANES 8
+#endif
+#define BATCH_IDLE  -1      /* In players: no move for this game. */
+
+struct game_batch {
+    int n;                  /* Games, a multiple of BATCH_LANES. */
+    uint16_t *bits[2];      /* Cells of player 0 ('O') and player 1 ('X'). */
+    int8_t *turn, *moves, *last_move, *status, *winner;
+    uint16_t *history[3];   /* The 36 bits of struct game, low word first. */
+};
+
+/* Allocates room for at least n games, all new. Returns -1 if out of
+ * memory. */
+int batchInit(struct game_batch *b, int n);
+void batchFree(struct game_batch *b);
+
+/* Starts game i over, as gameInit. */
+void batchReset(struct game_batch *b, int i);
+
+/* Copies game i out, to send its board or hand it to the bots. */
+void batchGet(const struct game_batch *b, int i, struct game *g);
+
+/* Plays moves[i] for players[i] in every game i whose player is not
+ * BATCH_IDLE, and sets results[i] to what gamePlay would return. Idle
+ * games are left alone and get MOVE_INVALID. */
+void batchPlay(struct game_batch *b, const int8_t *players, const int8_t *moves, int8_t *results);
+
+#endif
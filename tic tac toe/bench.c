@@ -0,0 +1,583 @@
+/****************************************************************************
+*       Microbenchmarks for the game core and the protocol codec.
+*
+*       Usage : ./bench.out [name filter]
+*
+*       Prints one tab separated line per benchmark after a header:
+*       name, iterations, ns/op and ops/sec. Each benchmark is run for
+*       several rounds and the fastest round is reported. The transport
+*       benchmarks time a turn round trip (move out, board back) over TCP
+*       loopback, a UNIX socket and the shared memory ring. The rooms
+*       benchmarks use the lobby index filled with ROOMS open rooms; the
+*       _mt ones split the work over ROOM_THREADS threads (at least,
+*       one per core) and report the time per operation of all of them
+*       together. The mcts benchmarks run one search on an empty 15x15
+*       board, five in a row, with 1 to 8 threads; an operation is a
+*       playout, so ops/sec is playouts a second and shows how the search
+*       scales with cores. The active benchmarks keep ACTIVE_GAMES games
+*       going, replaying random games, and play one move in every one of
+*       them per pass as a server tick would: active/per_game through
+*       gamePlay one game at a time, active/batch through one batchPlay
+*       pass over the games stored by field (see batch.h). An operation
+*       is a move, so ops/sec is moves a second on one core.
+*
+*****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "game.h"
+#include "batch.h"
+#include "proto.h"
+#include "bot.h"
+#include "conn.h"
+#include "rooms.h"
+#include "mcts.h"
+
+#define ROUNDS 5
+#define MIN_ROUND_NS 50000000.0  /* Grow the iteration count up to 50ms rounds. */
+#define GAMES 1024
+#define ROOMS 500000
+#define ROOM_CAPACITY (1 << 19)     /* As in the server. */
+#define ROOM_THREADS 4
+#define MCTS_SIDE 15
+#define MCTS_K 5
+#define MCTS_NODES (1 << 20)
+#define ACTIVE_GAMES 100000
+
+/* Keeps the compiler from dropping work whose result is unused. */
+#define KEEP(x) __asm__ volatile("" : : "g"(x) : "memory")
+
+struct bench {
+    const char *name;
+    void (*run)(long iterations);
+    void (*setup)(void);        /* Optional, called before and after */
+    void (*teardown)(void);     /* the timed rounds. */
+};
+
+static char board[3][3];
+static char frames[MSG_TYPES][MSG_MAX_LEN];
+static int frame_len[MSG_TYPES];
+static signed char game_moves[GAMES][BOARD_CELLS + 1];  /* -1 terminated. */
+
+/* Connection pair for the turn round trip benchmarks. */
+static struct conn rtt_client, rtt_server;
+static pthread_t rtt_thread;
+static int rtt_shm;
+
+static struct room_index room_index;
+static uint32_t room_keys[ROOMS];
+static int room_threads;
+
+static struct mcts *engine;
+static struct mcts_board mcts_board;
+
+/* The active games, both ways, and which of game_moves each replays. */
+static struct game *active;
+static struct game_batch batch;
+static int *replaying;
+static int8_t *tick_players, *tick_moves, *tick_results;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void benchCheckMove(long iterations) {
+    for (long i = 0; i < iterations; i++)
+        KEEP(checkMove(board, i % BOARD_CELLS, i & 1));
+}
+
+static void benchUpdateBoard(long iterations) {
+    char b[3][3];
+
+    resetBoard(b);
+    for (long i = 0; i < iterations; i++) {
+        updateBoard(b, i % BOARD_CELLS, i & 1);
+        KEEP(b);
+    }
+}
+
+static void benchCheckBoard(long iterations) {
+    for (long i = 0; i < iterations; i++)
+        KEEP(checkBoard(board, i % BOARD_CELLS));
+}
+
+static void benchResetBoard(long iterations) {
+    char b[3][3];
+
+    for (long i = 0; i < iterations; i++) {
+        resetBoard(b);
+        KEEP(b);
+    }
+}
+
+/* A message of the given type describing the mid game position. */
+static void sample(int type, struct msg *m) {
+    memset(m, 0, sizeof(*m));
+    m->type = type;
+    memcpy(m->board, board, 9);
+    m->seq = 3;
+    m->player_id = 1;
+    m->move = 8;
+}
+
+static void encode(int type, long iterations) {
+    struct msg m;
+    char buf[MSG_MAX_LEN];
+
+    sample(type, &m);
+    for (long i = 0; i < iterations; i++) {
+        KEEP(protoEncode(&m, buf));
+        KEEP(buf);
+    }
+}
+
+static void decode(int type, long iterations) {
+    struct msg m;
+
+    for (long i = 0; i < iterations; i++) {
+        KEEP(protoDecode(frames[type], frame_len[type], &m));
+        KEEP(&m);
+    }
+}
+
+#define CODEC(t) \
+    static void benchEncode##t(long iterations) { encode(MSG_##t, iterations); } \
+    static void benchDecode##t(long iterations) { decode(MSG_##t, iterations); }
+CODEC(TRN) CODEC(INV) CODEC(UPD) CODEC(BRD) CODEC(WAT) CODEC(WIN) CODEC(LSE) CODEC(DRW) CODEC(SNP) CODEC(DLT)
+CODEC(ROM) CODEC(NRM) CODEC(BSY) CODEC(PLY)
+CODEC(TOK) CODEC(AWY) CODEC(BAK)
+
+static void benchEncodeMove(long iterations) {
+    char buf[sizeof(int)];
+
+    for (long i = 0; i < iterations; i++) {
+        KEEP(protoEncodeMove(i % BOARD_CELLS, buf));
+        KEEP(buf);
+    }
+}
+
+static void benchDecodeMove(long iterations) {
+    char buf[sizeof(int)];
+    int move;
+
+    protoEncodeMove(4, buf);
+    for (long i = 0; i < iterations; i++) {
+        KEEP(protoDecodeMove(buf, sizeof(buf), &move));
+        KEEP(move);
+    }
+}
+
+/* Replays recorded random games through gamePlay and the codec, the way
+ * the server handles a turn: decode the move, apply it, encode the board. */
+static void benchGameLoop(long iterations) {
+    struct game g;
+    struct msg m = { MSG_UPD };
+    char buf[MSG_MAX_LEN];
+    int move;
+
+    for (long i = 0; i < iterations; i++) {
+        signed char *moves = game_moves[i % GAMES];
+
+        gameInit(&g);
+        for (int n = 0; moves[n] >= 0; n++) {
+            protoEncodeMove(moves[n], buf);
+            protoDecodeMove(buf, sizeof(int), &move);
+            gamePlay(&g, g.turn, move);
+            memcpy(m.board, g.board, 9);
+            protoEncode(&m, buf);
+            KEEP(buf);
+        }
+        KEEP(g.status);
+    }
+}
+
+static void setupActive(void) {
+    active = calloc(ACTIVE_GAMES, sizeof(*active));
+    replaying = calloc(ACTIVE_GAMES, sizeof(*replaying));
+    if (active == NULL || replaying == NULL || batchInit(&batch, ACTIVE_GAMES) < 0)
+        exit(EXIT_FAILURE);
+    tick_players = calloc(batch.n, 1);
+    tick_moves = calloc(batch.n, 1);
+    tick_results = calloc(batch.n, 1);
+    if (tick_players == NULL || tick_moves == NULL || tick_results == NULL)
+        exit(EXIT_FAILURE);
+    for (int i = 0; i < ACTIVE_GAMES; i++) {
+        gameInit(&active[i]);
+        replaying[i] = i % GAMES;
+    }
+    memset(tick_players, BATCH_IDLE, batch.n);
+}
+
+static void teardownActive(void) {
+    batchFree(&batch);
+    free(active);
+    free(replaying);
+    free(tick_players);
+    free(tick_moves);
+    free(tick_results);
+}
+
+/* A game that ended starts over with the next of game_moves. */
+static void replayNext(int i) {
+    replaying[i] = (replaying[i] + 1) % GAMES;
+}
+
+static void benchActivePerGame(long iterations) {
+    for (long left = iterations; left > 0; left -= ACTIVE_GAMES) {
+        int n = left < ACTIVE_GAMES ? left : ACTIVE_GAMES;
+
+        for (int i = 0; i < n; i++) {
+            struct game *g = &active[i];
+
+            if (gamePlay(g, g->turn, game_moves[replaying[i]][g->moves]) > MOVE_OK) {
+                gameInit(g);
+                replayNext(i);
+            }
+        }
+    }
+}
+
+static void benchActiveBatch(long iterations) {
+    for (long left = iterations; left > 0; left -= ACTIVE_GAMES) {
+        int n = left < ACTIVE_GAMES ? left : ACTIVE_GAMES;
+
+        /* Collect the moves, play them all, then deal with the results. */
+        for (int i = 0; i < n; i++) {
+            tick_players[i] = batch.turn[i];
+            tick_moves[i] = game_moves[replaying[i]][batch.moves[i]];
+        }
+        memset(tick_players + n, BATCH_IDLE, batch.n - n);
+        batchPlay(&batch, tick_players, tick_moves, tick_results);
+        for (int i = 0; i < n; i++) {
+            if (tick_results[i] > MOVE_OK) {
+                batchReset(&batch, i);
+                replayNext(i);
+            }
+        }
+    }
+}
+
+/* Plays the server's side of a turn: reads a move, answers with a board. */
+static void *rttServer(void *arg) {
+    struct msg m = { MSG_UPD };
+    char buf[MSG_MAX_LEN];
+    int len, move;
+
+    if (rtt_shm && connNegotiate(&rtt_server, 0) < 0)
+        return NULL;
+    memcpy(m.board, board, 9);
+    len = protoEncode(&m, buf);
+    while (connRead(&rtt_server, &move, sizeof(move)) == sizeof(move))
+        if (connWrite(&rtt_server, buf, len) != len)
+            break;
+    return NULL;
+}
+
+static void startRtt(int client_fd, int server_fd, int shm) {
+    connInit(&rtt_client, client_fd);
+    connInit(&rtt_server, server_fd);
+    rtt_shm = shm;
+    pthread_create(&rtt_thread, NULL, rttServer, NULL);
+    if (shm && (connHello(&rtt_client, 1, 0) < 0 || rtt_client.shm == NULL)) {
+        fprintf(stderr, "shared memory ring not available\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void setupTcp(void) {
+    struct sockaddr_in addr = { 0 };
+    socklen_t addrlen = sizeof(addr);
+    int option = 1;
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    int client = socket(AF_INET, SOCK_STREAM, 0);
+
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listener, 1) < 0 ||
+        getsockname(listener, (struct sockaddr *)&addr, &addrlen) < 0 ||
+        connect(client, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("ERROR setting up loopback connection");
+        exit(EXIT_FAILURE);
+    }
+    int server = accept(listener, NULL, NULL);
+    close(listener);
+    setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &option, sizeof(option));
+    setsockopt(server, IPPROTO_TCP, TCP_NODELAY, &option, sizeof(option));
+    startRtt(client, server, 0);
+}
+
+static void setupUnix(int shm) {
+    int fds[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        perror("ERROR creating socket pair");
+        exit(EXIT_FAILURE);
+    }
+    startRtt(fds[0], fds[1], shm);
+}
+
+static void setupUnixSocket(void) {
+    setupUnix(0);
+}
+
+static void setupShm(void) {
+    setupUnix(1);
+}
+
+static void teardownRtt(void) {
+    connClose(&rtt_client);
+    pthread_join(rtt_thread, NULL);
+    connClose(&rtt_server);
+}
+
+/* One turn: the client sends a move and waits for the board. */
+static void benchRtt(long iterations) {
+    char buf[MSG_MAX_LEN];
+    int move = 4;
+
+    for (long i = 0; i < iterations; i++) {
+        if (connWrite(&rtt_client, &move, sizeof(move)) != sizeof(move) ||
+            connRead(&rtt_client, buf, TAG_LEN + 9) != TAG_LEN + 9) {
+            fprintf(stderr, "ERROR in round trip\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+static void setupRooms(void) {
+    unsigned rng = 7;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+    room_threads = cores > ROOM_THREADS ? cores : ROOM_THREADS;
+    if (roomIndexInit(&room_index, ROOM_CAPACITY) < 0) {
+        perror("ERROR creating room index");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < ROOMS; i++) {
+        do
+            room_keys[i] = botRand(&rng) & ((1u << 30) - 1);
+        while (room_keys[i] == 0 || roomIndexInsert(&room_index, room_keys[i], i) != ROOM_OK);
+    }
+}
+
+static void teardownRooms(void) {
+    roomIndexFree(&room_index);
+}
+
+static void findRooms(long from, long to) {
+    uint32_t value;
+
+    for (long i = from; i < to; i++)
+        KEEP(roomIndexFind(&room_index, room_keys[(i * 7919) % ROOMS], &value));
+}
+
+/* A room is opened and joined: the key goes in and is taken out again.
+ * Keys of thread t are t mod room_threads, so no two threads insert
+ * the same key. */
+static void churnRooms(long from, long to, unsigned t) {
+    uint32_t value;
+
+    for (long i = from; i < to; i++) {
+        uint32_t key = (1u << 30) + (uint32_t)(i % 4096) * room_threads + t;
+        roomIndexInsert(&room_index, key, t);
+        KEEP(roomIndexFind(&room_index, room_keys[(i * 7919) % ROOMS], &value));
+        KEEP(roomIndexTake(&room_index, key, &value));
+    }
+}
+
+static void benchRoomFind(long iterations) {
+    findRooms(0, iterations);
+}
+
+static void benchRoomChurn(long iterations) {
+    churnRooms(0, iterations, 0);
+}
+
+struct room_job {
+    pthread_t thread;
+    long from, to;
+    unsigned t;
+    int churn;
+};
+
+static void *roomWorker(void *arg) {
+    struct room_job *job = arg;
+
+    if (job->churn)
+        churnRooms(job->from, job->to, job->t);
+    else
+        findRooms(job->from, job->to);
+    return NULL;
+}
+
+static void roomsParallel(long iterations, int churn) {
+    struct room_job jobs[room_threads];
+
+    for (int t = 0; t < room_threads; t++) {
+        jobs[t].from = iterations * t / room_threads;
+        jobs[t].to = iterations * (t + 1) / room_threads;
+        jobs[t].t = t;
+        jobs[t].churn = churn;
+        pthread_create(&jobs[t].thread, NULL, roomWorker, &jobs[t]);
+    }
+    for (int t = 0; t < room_threads; t++)
+        pthread_join(jobs[t].thread, NULL);
+}
+
+static void benchRoomFindMt(long iterations) {
+    roomsParallel(iterations, 0);
+}
+
+static void benchRoomChurnMt(long iterations) {
+    roomsParallel(iterations, 1);
+}
+
+static void setupMcts(int threads) {
+    mcts_board.side = MCTS_SIDE;
+    mcts_board.k = MCTS_K;
+    mcts_board.to_move = 0;
+    memset(mcts_board.cells, MCTS_EMPTY, sizeof(mcts_board.cells));
+    if ((engine = mctsCreate(threads, MCTS_NODES)) == NULL) {
+        perror("ERROR starting the search threads");
+        exit(1);
+    }
+}
+
+static void setupMcts1(void) { setupMcts(1); }
+static void setupMcts2(void) { setupMcts(2); }
+static void setupMcts4(void) { setupMcts(4); }
+static void setupMcts8(void) { setupMcts(8); }
+
+static void teardownMcts(void) {
+    mctsDestroy(engine);
+}
+
+/* One search, cut off by the number of playouts alone. */
+static void benchMcts(long iterations) {
+    struct mcts_result r;
+
+    mctsSearch(engine, &mcts_board, 1 << 30, iterations, &r);
+    KEEP(r.move);
+}
+
+static const struct bench benches[] = {
+    { "core/checkMove",   benchCheckMove },
+    { "core/updateBoard", benchUpdateBoard },
+    { "core/checkBoard",  benchCheckBoard },
+    { "core/resetBoard",  benchResetBoard },
+    { "encode/TRN", benchEncodeTRN }, { "decode/TRN", benchDecodeTRN },
+    { "encode/INV", benchEncodeINV }, { "decode/INV", benchDecodeINV },
+    { "encode/UPD", benchEncodeUPD }, { "decode/UPD", benchDecodeUPD },
+    { "encode/BRD", benchEncodeBRD }, { "decode/BRD", benchDecodeBRD },
+    { "encode/WAT", benchEncodeWAT }, { "decode/WAT", benchDecodeWAT },
+    { "encode/WIN", benchEncodeWIN }, { "decode/WIN", benchDecodeWIN },
+    { "encode/LSE", benchEncodeLSE }, { "decode/LSE", benchDecodeLSE },
+    { "encode/DRW", benchEncodeDRW }, { "decode/DRW", benchDecodeDRW },
+    { "encode/SNP", benchEncodeSNP }, { "decode/SNP", benchDecodeSNP },
+    { "encode/DLT", benchEncodeDLT }, { "decode/DLT", benchDecodeDLT },
+    { "encode/ROM", benchEncodeROM }, { "decode/ROM", benchDecodeROM },
+    { "encode/NRM", benchEncodeNRM }, { "decode/NRM", benchDecodeNRM },
+    { "encode/BSY", benchEncodeBSY }, { "decode/BSY", benchDecodeBSY },
+    { "encode/PLY", benchEncodePLY }, { "decode/PLY", benchDecodePLY },
+    { "encode/TOK", benchEncodeTOK }, { "decode/TOK", benchDecodeTOK },
+    { "encode/AWY", benchEncodeAWY }, { "decode/AWY", benchDecodeAWY },
+    { "encode/BAK", benchEncodeBAK }, { "decode/BAK", benchDecodeBAK },
+    { "encode/move", benchEncodeMove }, { "decode/move", benchDecodeMove },
+    { "game/loop", benchGameLoop },
+    { "active/per_game", benchActivePerGame, setupActive, teardownActive },
+    { "active/batch",    benchActiveBatch,   setupActive, teardownActive },
+    { "transport/tcp_rtt",  benchRtt, setupTcp,        teardownRtt },
+    { "transport/unix_rtt", benchRtt, setupUnixSocket, teardownRtt },
+    { "transport/shm_rtt",  benchRtt, setupShm,        teardownRtt },
+    { "rooms/find",         benchRoomFind,    setupRooms, teardownRooms },
+    { "rooms/churn",        benchRoomChurn,   setupRooms, teardownRooms },
+    { "rooms/find_mt",      benchRoomFindMt,  setupRooms, teardownRooms },
+    { "rooms/churn_mt",     benchRoomChurnMt, setupRooms, teardownRooms },
+    { "mcts/15x15_1t", benchMcts, setupMcts1, teardownMcts },
+    { "mcts/15x15_2t", benchMcts, setupMcts2, teardownMcts },
+    { "mcts/15x15_4t", benchMcts, setupMcts4, teardownMcts },
+    { "mcts/15x15_8t", benchMcts, setupMcts8, teardownMcts },
+};
+
+static void setup(void) {
+    unsigned rng = 1;
+
+    /* A mid game position. */
+    resetBoard(board);
+    updateBoard(board, 4, 1);
+    updateBoard(board, 0, 0);
+    updateBoard(board, 8, 1);
+
+    for (int type = 0; type < MSG_TYPES; type++) {
+        struct msg m;
+        sample(type, &m);
+        frame_len[type] = protoEncode(&m, frames[type]);
+    }
+
+    for (int i = 0; i < GAMES; i++) {
+        struct game g;
+        int n = 0;
+
+        gameInit(&g);
+        while (g.status == GAME_RUNNING) {
+            int move = botMove(BOT_RANDOM, &g, &rng);
+            gamePlay(&g, g.turn, move);
+            game_moves[i][n++] = move;
+        }
+        game_moves[i][n] = -1;
+    }
+}
+
+static void runBench(const struct bench *b) {
+    long iterations = 1;
+    double best = 0;
+
+    if (b->setup)
+        b->setup();
+
+    /* Find an iteration count that takes long enough to time. */
+    for (;;) {
+        double start = now();
+        b->run(iterations);
+        double elapsed = now() - start;
+        if (elapsed >= MIN_ROUND_NS / 10 || iterations >= (1L << 40))
+            break;
+        iterations *= 10;
+    }
+    iterations *= 10;
+
+    for (int round = 0; round < ROUNDS; round++) {
+        double start = now();
+        b->run(iterations);
+        double ns = (now() - start) / iterations;
+        if (round == 0 || ns < best)
+            best = ns;
+    }
+    if (b->teardown)
+        b->teardown();
+
+    printf("%s\t%ld\t%.3f\t%.0f\n", b->name, iterations, best, best > 0 ? 1e9 / best : 0);
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[]) {
+    const char *filter = argc > 1 ? argv[1] : NULL;
+
+    setup();
+    printf("name\titerations\tns_per_op\tops_per_sec\n");
+    for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++)
+        if (filter == NULL || strstr(benches[i].name, filter))
+            runBench(&benches[i]);
+    return 0;
+}
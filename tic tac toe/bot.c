@@ -0,0 +1,137 @@
+/****************************************************************************
+*       Computer players used by the self-play simulator.
+*
+*****************************************************************************/
+
+#include <string.h>
+
+#include "bot.h"
+
+#define STATES 19683    /* 3^9 boards. */
+
+static const char *bot_names[BOT_KINDS] = { "random", "greedy", "perfect" };
+
+/* Minimax value of each board for the player to move: 1 win, 0 draw, -1 loss. */
+static signed char perfect[STATES];
+static char perfect_known[STATES];
+
+static int boardIndex(char board[][3]) {
+    int index = 0;
+    for (int i = BOARD_CELLS - 1; i >= 0; i--) {
+        char c = board[i/3][i%3];
+        index = index * 3 + (c == 'O' ? 1 : c == 'X' ? 2 : 0);
+    }
+    return index;
+}
+
+static int negamax(char board[][3], int player_id) {
+    int index = boardIndex(board);
+    int best = -2;
+
+    if (perfect_known[index])
+        return perfect[index];
+
+    for (int move = 0; move < BOARD_CELLS; move++) {
+        int score;
+        if (!checkMove(board, move, player_id))
+            continue;
+        updateBoard(board, move, player_id);
+        score = checkBoard(board, move) ? 1 : -negamax(board, !player_id);
+        board[move/3][move%3] = ' ';
+        if (score > best)
+            best = score;
+    }
+    if (best == -2) /* Board is full. */
+        best = 0;
+
+    perfect[index] = best;
+    perfect_known[index] = 1;
+    return best;
+}
+
+void botInit(void) {
+    char board[3][3];
+
+    resetBoard(board);
+    negamax(board, 1);
+}
+
+static int randomMove(const struct game *g, unsigned *rng) {
+    int free_cells[BOARD_CELLS];
+    int n = 0;
+
+    for (int move = 0; move < BOARD_CELLS; move++)
+        if (g->board[move/3][move%3] == ' ')
+            free_cells[n++] = move;
+    return n ? free_cells[botRand(rng) % n] : -1;
+}
+
+/* Returns a position that completes a line for player_id, or -1. */
+static int winningMove(const struct game *g, int player_id) {
+    char board[3][3];
+
+    memcpy(board, g->board, sizeof(board));
+    for (int move = 0; move < BOARD_CELLS; move++) {
+        if (!checkMove(board, move, player_id))
+            continue;
+        updateBoard(board, move, player_id);
+        if (checkBoard(board, move))
+            return move;
+        board[move/3][move%3] = ' ';
+    }
+    return -1;
+}
+
+static int greedyMove(const struct game *g, unsigned *rng) {
+    int move = winningMove(g, g->turn);
+
+    if (move < 0)
+        move = winningMove(g, !g->turn);
+    if (move < 0)
+        move = randomMove(g, rng);
+    return move;
+}
+
+static int perfectMove(const struct game *g, unsigned *rng) {
+    char board[3][3];
+    int best_moves[BOARD_CELLS];
+    int n = 0, best = -2;
+
+    memcpy(board, g->board, sizeof(board));
+    for (int move = 0; move < BOARD_CELLS; move++) {
+        int score;
+        if (!checkMove(board, move, g->turn))
+            continue;
+        updateBoard(board, move, g->turn);
+        score = checkBoard(board, move) ? 1 : -perfect[boardIndex(board)];
+        board[move/3][move%3] = ' ';
+
+        if (score > best)
+            best = score, n = 0;
+        if (score == best)
+            best_moves[n++] = move;
+    }
+    return n ? best_moves[botRand(rng) % n] : -1;
+}
+
+int botMove(int kind, const struct game *g, unsigned *rng) {
+    switch (kind) {
+    case BOT_GREEDY:
+        return greedyMove(g, rng);
+    case BOT_PERFECT:
+        return perfectMove(g, rng);
+    default:
+        return randomMove(g, rng);
+    }
+}
+
+int botParse(const char *name) {
+    for (int kind = 0; kind < BOT_KINDS; kind++)
+        if (!strcmp(name, bot_names[kind]))
+            return kind;
+    return -1;
+}
+
+const char *botName(int kind) {
+    return kind >= 0 && kind < BOT_KINDS ? bot_names[kind] : "unknown";
+}
@@ -0,0 +1,35 @@
+/****************************************************************************
+*       Computer players used by the self-play simulator.
+*
+*****************************************************************************/
+
+#ifndef BOT_H
+#define BOT_H
+
+#include "game.h"
+
+#define BOT_RANDOM  0   /* Any free position. */
+#define BOT_GREEDY  1   /* Win if possible, else block, else random. */
+#define BOT_PERFECT 2   /* Minimax, random among the best moves. */
+#define BOT_KINDS   3
+
+/* Builds the perfect play table. Call once before starting threads. */
+void botInit(void);
+
+/* Returns the bot's choice of position for the player to move in g. */
+int botMove(int kind, const struct game *g, unsigned *rng);
+
+/* Maps between bot kinds and their command line names, -1 if unknown. */
+int botParse(const char *name);
+const char *botName(int kind);
+
+/* xorshift32, seeds must be non zero. */
+static inline unsigned botRand(unsigned *state) {
+    unsigned x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+#endif
@@ -0,0 +1,440 @@
+/****************************************************************************
+*       Connections between the server and a client: sockets and the
+*       shared memory ring.
+*
+*****************************************************************************/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include "conn.h"
+
+#define RING_SIZE 4096  /* Power of two. */
+#define SPIN 2000       /* Polls of the ring before sleeping, on SMP only. */
+
+struct ring {
+    alignas(64) atomic_uint head;   /* Advanced by the producer. */
+    alignas(64) atomic_uint tail;   /* Advanced by the consumer. */
+    alignas(64) char data[RING_SIZE];
+};
+
+struct shm_area {
+    struct ring ring[2];            /* ring[side] is read by side. */
+    alignas(64) atomic_int asleep[2];
+};
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpuRelax() __builtin_ia32_pause()
+#else
+#define cpuRelax() __asm__ volatile("" ::: "memory")
+#endif
+
+static int spin_limit = -1;
+
+void connInit(struct conn *c, int fd) {
+    c->fd = fd;
+    c->shm = NULL;
+    c->side = SIDE_SERVER;
+    c->efd[0] = c->efd[1] = -1;
+    c->memfd = -1;
+    c->features = 0;
+}
+
+void connClose(struct conn *c) {
+    if (c->shm) {
+        munmap(c->shm, sizeof(struct shm_area));
+        close(c->efd[0]);
+        close(c->efd[1]);
+        c->shm = NULL;
+    }
+    if (c->memfd >= 0)
+        close(c->memfd);
+    close(c->fd);
+    c->fd = -1;     /* The number may be reused before the client goes. */
+}
+
+/* Copies out up to len bytes that are in the ring. */
+static int ringRead(struct ring *r, char *buf, int len) {
+    unsigned tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    unsigned avail = atomic_load(&r->head) - tail;
+    int n = 0;
+
+    for (; n < len && avail; n++, avail--, tail++)
+        buf[n] = r->data[tail & (RING_SIZE - 1)];
+    if (n)
+        atomic_store(&r->tail, tail);
+    return n;
+}
+
+/* Copies in up to len bytes that fit in the ring. */
+static int ringWrite(struct ring *r, const char *buf, int len) {
+    unsigned head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    unsigned room = RING_SIZE - (head - atomic_load(&r->tail));
+    int n = 0;
+
+    for (; n < len && room; n++, room--, head++)
+        r->data[head & (RING_SIZE - 1)] = buf[n];
+    if (n)
+        atomic_store(&r->head, head);
+    return n;
+}
+
+static int ringReadable(struct conn *c) {
+    struct ring *r = &c->shm->ring[c->side];
+    return atomic_load(&r->head) != atomic_load(&r->tail);
+}
+
+static int ringWritable(struct conn *c) {
+    struct ring *r = &c->shm->ring[!c->side];
+    return atomic_load(&r->head) - atomic_load(&r->tail) < RING_SIZE;
+}
+
+/* Wakes the other side if it went to sleep. */
+static void wakePeer(struct conn *c) {
+    uint64_t one = 1;
+
+    /* A failed write means the counter is already non zero. */
+    if (atomic_load(&c->shm->asleep[!c->side]) && atomic_exchange(&c->shm->asleep[!c->side], 0))
+        (void)!write(c->efd[!c->side], &one, sizeof(one));
+}
+
+/* Waits until ready(c) holds. Returns -1 if the peer closed its socket. */
+static int ringWait(struct conn *c, int (*ready)(struct conn *)) {
+    if (spin_limit < 0)
+        spin_limit = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SPIN : 0;
+
+    for (int i = 0; i < spin_limit; i++) {
+        if (ready(c))
+            return 0;
+        cpuRelax();
+    }
+
+    for (;;) {
+        struct pollfd fds[2] = { { c->efd[c->side], POLLIN, 0 }, { c->fd, POLLIN, 0 } };
+        uint64_t count;
+        char b;
+        int n;
+
+        atomic_store(&c->shm->asleep[c->side], 1);
+        if (ready(c)) {
+            atomic_store(&c->shm->asleep[c->side], 0);
+            return 0;
+        }
+        if (poll(fds, 2, -1) < 0 && errno != EINTR)
+            return -1;
+        atomic_store(&c->shm->asleep[c->side], 0);
+
+        if (fds[0].revents & POLLIN)
+            (void)!read(c->efd[c->side], &count, sizeof(count));
+        /* The peer may have written its last frames and closed. */
+        if (ready(c))
+            return 0;
+        /* Nothing but EOF arrives on the socket once the ring is up. */
+        if (fds[1].revents) {
+            n = recv(c->fd, &b, 1, MSG_PEEK | MSG_DONTWAIT);
+            if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+                return -1;
+        }
+    }
+}
+
+/* Blocks until a non blocking socket is ready. */
+static int waitFd(int fd, int events) {
+    struct pollfd pfd = { fd, events, 0 };
+    return poll(&pfd, 1, -1) < 0 && errno != EINTR ? -1 : 0;
+}
+
+int connRead(struct conn *c, void *buf, int len) {
+    int done = 0;
+
+    while (done < len) {
+        int n;
+        if (c->shm) {
+            n = ringRead(&c->shm->ring[c->side], (char *)buf + done, len - done);
+            if (n > 0)
+                wakePeer(c);
+            else if (ringWait(c, ringReadable) < 0)
+                return -1;
+        } else {
+            n = read(c->fd, (char *)buf + done, len - done);
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && waitFd(c->fd, POLLIN) == 0)
+                continue;
+            if (n <= 0)
+                return -1;
+        }
+        done += n;
+    }
+    return done;
+}
+
+int connWrite(struct conn *c, const void *buf, int len) {
+    int done = 0;
+
+    while (done < len) {
+        int n;
+        if (c->shm) {
+            n = ringWrite(&c->shm->ring[!c->side], (const char *)buf + done, len - done);
+            if (n > 0)
+                wakePeer(c);
+            else if (ringWait(c, ringWritable) < 0)
+                return -1;
+        } else {
+            n = write(c->fd, (const char *)buf + done, len - done);
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && waitFd(c->fd, POLLOUT) == 0)
+                continue;
+            if (n < 0)
+                return -1;
+        }
+        done += n;
+    }
+    return done;
+}
+
+int connReadSome(struct conn *c, void *buf, int len) {
+    struct ring *r;
+    uint64_t count;
+    char b;
+    int n;
+
+    if (!c->shm) {
+        n = read(c->fd, buf, len);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            return 0;
+        return n > 0 ? n : -1;
+    }
+
+    r = &c->shm->ring[c->side];
+    (void)!read(c->efd[c->side], &count, sizeof(count));
+    n = ringRead(r, buf, len);
+    if (n == 0) {
+        /* Ask to be woken, then look once more. */
+        atomic_store(&c->shm->asleep[c->side], 1);
+        n = ringRead(r, buf, len);
+        if (n > 0)
+            atomic_store(&c->shm->asleep[c->side], 0);
+    }
+    if (n > 0) {
+        wakePeer(c);
+        return n;
+    }
+
+    /* Nothing but EOF arrives on the socket once the ring is up. */
+    n = recv(c->fd, &b, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+        return -1;
+    return 0;
+}
+
+int connWriteSome(struct conn *c, const void *buf, int len) {
+    struct ring *r;
+    int n;
+
+    if (!c->shm) {
+        n = send(c->fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            return 0;
+        return n;
+    }
+
+    /* The eventfd is left alone: connReadSome drains it, so a wakeup
+     * for input that arrives meanwhile is not lost. */
+    r = &c->shm->ring[!c->side];
+    n = ringWrite(r, buf, len);
+    if (n < len) {
+        /* Ask to be woken when the peer makes room, then try once more. */
+        atomic_store(&c->shm->asleep[c->side], 1);
+        n += ringWrite(r, (const char *)buf + n, len - n);
+    }
+    if (n > 0)
+        wakePeer(c);
+    return n;
+}
+
+int connEventFd(struct conn *c) {
+    return c->shm ? c->efd[c->side] : -1;
+}
+
+/* Maps a shm_area from a memfd. */
+static struct shm_area *mapArea(int memfd) {
+    void *area = mmap(NULL, sizeof(struct shm_area), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    return area == MAP_FAILED ? NULL : area;
+}
+
+static int offerShm(struct conn *c, char *reply) {
+    int fds[3] = { -1, -1, -1 };
+    struct shm_area *area = NULL;
+
+    fds[0] = memfd_create("tictactoe", MFD_CLOEXEC);
+    if (fds[0] >= 0 && ftruncate(fds[0], sizeof(struct shm_area)) == 0)
+        area = mapArea(fds[0]);
+    fds[1] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    fds[2] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+    if (area == NULL || fds[1] < 0 || fds[2] < 0) { /* Stay on the socket. */
+        for (int i = 0; i < 3; i++)
+            if (fds[i] >= 0)
+                close(fds[i]);
+        if (area)
+            munmap(area, sizeof(struct shm_area));
+        memcpy(reply, HELLO_SCK, HELLO_TAG_LEN);
+        return sendFds(c->fd, reply, HELLO_LEN, NULL, 0) < 0 ? -1 : 0;
+    }
+
+    if (sendFds(c->fd, reply, HELLO_LEN, fds, 3) < 0) {
+        munmap(area, sizeof(struct shm_area));
+        for (int i = 0; i < 3; i++)
+            close(fds[i]);
+        return -1;
+    }
+    c->memfd = fds[0];     /* Kept for handing the ring to another process. */
+    c->shm = area;
+    c->side = SIDE_SERVER;
+    c->efd[0] = fds[1];
+    c->efd[1] = fds[2];
+    return 0;
+}
+
+int connNegotiate(struct conn *c, int features) {
+    char hello[HELLO_LEN];
+
+    if (recv(c->fd, hello, HELLO_LEN, MSG_WAITALL) != HELLO_LEN)
+        return -1;
+    return connAnswerHello(c, hello, features);
+}
+
+int connAnswerHello(struct conn *c, const char *hello, int features) {
+    char reply[HELLO_LEN];
+    int domain = 0;
+    socklen_t len = sizeof(domain);
+
+    c->features = hello[HELLO_TAG_LEN] & features;
+    reply[HELLO_TAG_LEN] = c->features;
+
+    getsockopt(c->fd, SOL_SOCKET, SO_DOMAIN, &domain, &len);
+    if (!memcmp(hello, HELLO_SHM, HELLO_TAG_LEN) && domain == AF_UNIX) {
+        memcpy(reply, HELLO_SHM, HELLO_TAG_LEN);
+        return offerShm(c, reply);
+    }
+    memcpy(reply, HELLO_SCK, HELLO_TAG_LEN);
+    return sendFds(c->fd, reply, HELLO_LEN, NULL, 0) < 0 ? -1 : 0;
+}
+
+int connHello(struct conn *c, int want_shm, int features) {
+    char hello[HELLO_LEN], reply[HELLO_LEN];
+    int fds[3], nfds = 3;
+
+    memcpy(hello, want_shm ? HELLO_SHM : HELLO_SCK, HELLO_TAG_LEN);
+    hello[HELLO_TAG_LEN] = features;
+    if (sendFds(c->fd, hello, HELLO_LEN, NULL, 0) < 0)
+        return -1;
+    if (recvFds(c->fd, reply, HELLO_LEN, fds, &nfds) < 0)
+        return -1;
+    if (!memcmp(reply, HELLO_BSY, HELLO_TAG_LEN))
+        return CONN_BUSY;
+    c->features = reply[HELLO_TAG_LEN] & features;
+    if (memcmp(reply, HELLO_SHM, HELLO_TAG_LEN) || nfds != 3) {
+        for (int i = 0; i < nfds; i++)
+            close(fds[i]);
+        return 0;
+    }
+
+    c->shm = mapArea(fds[0]);
+    close(fds[0]);
+    if (c->shm == NULL) {
+        close(fds[1]);
+        close(fds[2]);
+        return -1;
+    }
+    c->side = SIDE_CLIENT;
+    c->efd[0] = fds[1];
+    c->efd[1] = fds[2];
+    return 0;
+}
+
+int connExport(struct conn *c, int *fds) {
+    fds[0] = c->fd;
+    if (!c->shm)
+        return 1;
+    fds[1] = c->memfd;
+    fds[2] = c->efd[0];
+    fds[3] = c->efd[1];
+    return 4;
+}
+
+int connImport(struct conn *c, const int *fds, int nfds, int features) {
+    connInit(c, fds[0]);
+    c->features = features;
+    if (nfds == 1)
+        return 0;
+    if (nfds != 4 || (c->shm = mapArea(fds[1])) == NULL)
+        return -1;
+    c->memfd = fds[1];
+    c->efd[0] = fds[2];
+    c->efd[1] = fds[3];
+    return 0;
+}
+
+int sendFds(int sockfd, const void *data, int len, const int *fds, int nfds) {
+    struct iovec iov = { (void *)data, len };
+    struct msghdr mh = { 0 };
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int) * 253)];
+    } control;
+
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    if (nfds > 0) {
+        mh.msg_control = control.buf;
+        mh.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+        memcpy(CMSG_DATA(cm), fds, sizeof(int) * nfds);
+    }
+    return sendmsg(sockfd, &mh, MSG_NOSIGNAL) == len ? len : -1;
+}
+
+int recvFds(int sockfd, void *data, int len, int *fds, int *nfds) {
+    struct iovec iov = { data, len };
+    struct msghdr mh = { 0 };
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int) * 253)];
+    } control;
+    int max = *nfds, n;
+
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control.buf;
+    mh.msg_controllen = sizeof(control.buf);
+
+    *nfds = 0;
+    n = recvmsg(sockfd, &mh, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+    if (n != len)
+        return -1;
+
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm)) {
+        if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS)
+            continue;
+        int count = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        int *received = (int *)CMSG_DATA(cm);
+        for (int i = 0; i < count; i++) {
+            if (*nfds < max)
+                fds[(*nfds)++] = received[i];
+            else
+                close(received[i]);
+        }
+    }
+    return n;
+}
@@ -0,0 +1,93 @@
+/****************************************************************************
+*       Connections between the server and a client.
+*
+*       A connection is a TCP or UNIX domain socket. Clients on the same
+*       host may ask for a shared memory ring instead: the frames then go
+*       through two single producer single consumer rings in a memfd and
+*       the socket is only kept to notice the peer going away. A side
+*       that finds nothing to read (or no room to write) sleeps on its
+*       eventfd, which the other side only writes when it sees the
+*       sleeper's flag, so busy turns need no system calls at all.
+*
+*       Negotiation: right after connecting the client sends a hello,
+*       HELLO_SCK or HELLO_SHM followed by a byte of protocol features it
+*       supports. The server answers HELLO_SHM with the memfd and both
+*       eventfds attached, or HELLO_SCK to stay on the socket, followed by
+*       the features both sides support. The hello is required on the
+*       UNIX socket; on TCP clients that send nothing are treated as
+*       legacy clients without features. A server that turns the
+*       connection away sends HELLO_BSY and a zero byte instead of an
+*       answer, and closes it.
+*
+*****************************************************************************/
+
+#ifndef CONN_H
+#define CONN_H
+
+#define HELLO_SCK "SCK"
+#define HELLO_SHM "SHM"
+#define HELLO_BSY "BSY"     /* Same bytes as the BSY message. */
+#define HELLO_TAG_LEN 3
+#define HELLO_LEN 4
+
+#define SIDE_SERVER 0
+#define SIDE_CLIENT 1
+
+struct shm_area;
+
+struct conn {
+    int fd;                 /* Socket, the liveness channel in shm mode. */
+    struct shm_area *shm;   /* NULL unless the ring was negotiated. */
+    int side;               /* SIDE_SERVER or SIDE_CLIENT. */
+    int efd[2];             /* Wakeup eventfd of each side. */
+    int memfd;              /* Backing the ring, server side only. */
+    int features;           /* Protocol features agreed in the hello. */
+};
+
+void connInit(struct conn *c, int fd);
+void connClose(struct conn *c);
+
+/* Read or write exactly len bytes. Return len, or -1 on error or when the
+ * peer went away first. */
+int connRead(struct conn *c, void *buf, int len);
+int connWrite(struct conn *c, const void *buf, int len);
+
+/* Reads whatever is available, up to len bytes, without blocking.
+ * Returns the number of bytes read, 0 if there are none yet or -1 once
+ * the peer went away. With the ring, a 0 arms the wakeup: the eventfd
+ * from connEventFd() becomes readable when more data arrives. */
+int connReadSome(struct conn *c, void *buf, int len);
+
+/* Writes what fits, up to len bytes, without blocking. Returns the number
+ * of bytes written or -1 on error. With the ring, a short write arms the
+ * wakeup for when the peer makes room. */
+int connWriteSome(struct conn *c, const void *buf, int len);
+int connEventFd(struct conn *c);
+
+/* Server side of the negotiation: reads the hello, agrees on features
+ * and sets up the ring if a UNIX socket client asked for it. Returns -1
+ * on error. */
+int connNegotiate(struct conn *c, int features);
+
+/* Same, for a hello of HELLO_LEN bytes that was already read. */
+int connAnswerHello(struct conn *c, const char *hello, int features);
+
+/* Client side of the negotiation. Falls back to the socket if the
+ * server will not share memory. Returns -1 on error or CONN_BUSY if the
+ * server turned the connection away. */
+#define CONN_BUSY -2
+int connHello(struct conn *c, int want_shm, int features);
+
+/* Hands a server side connection to another process: connExport fills
+ * fds (room for CONN_MAX_FDS) and returns how many there are;
+ * connImport rebuilds the connection from them. */
+#define CONN_MAX_FDS 4
+int connExport(struct conn *c, int *fds);
+int connImport(struct conn *c, const int *fds, int nfds, int features);
+
+/* Sends or receives len bytes with up to nfds file descriptors attached
+ * over a UNIX domain socket. recvFds sets *nfds to the number received. */
+int sendFds(int sockfd, const void *data, int len, const int *fds, int nfds);
+int recvFds(int sockfd, void *data, int len, int *fds, int *nfds);
+
+#endif
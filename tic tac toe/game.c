@@ -0,0 +1,83 @@
+/****************************************************************************
+*       Tic Tac Toe rules shared by the server and the offline tools.
+*
+*****************************************************************************/
+
+#include "game.h"
+
+int checkMove(char board[][3], int move, int player_id) {
+    if (move < 0 || move >= BOARD_CELLS) /* Off the board. */
+        return 0;
+    if (board[move/3][move%3] == ' ')   /* Move is valid. */
+        return 1;
+    else /* Move is invalid. */
+        return 0;
+}
+
+void updateBoard(char board[][3], int move, int player_id) {
+    board[move/3][move%3] = player_id ? 'X' : 'O';
+}
+
+int checkBoard(char board[][3], int last_move) {
+    int row = last_move/3;
+    int col = last_move%3;
+
+    if ( board[row][0] == board[row][1] && board[row][1] == board[row][2] ) { /* Check the row for a win. */
+        return 1;
+    }
+    else if ( board[0][col] == board[1][col] && board[1][col] == board[2][col] ) { /* Check the column for a win. */
+        return 1;
+    }
+    else if (!(last_move % 2)) { /* If the last move was at an even numbered position we have to check the diagonal(s) as well. */
+        if ( (last_move == 0 || last_move == 4 || last_move == 8) && (board[1][1] == board[0][0] && board[1][1] == board[2][2]) ) {  /* Check backslash diagonal. */
+            return 1;
+        }
+        if ( (last_move == 2 || last_move == 4 || last_move == 6) && (board[1][1] == board[0][2] && board[1][1] == board[2][0]) ) { /* Check frontslash diagonal. */
+            return 1;
+        }
+    }
+    /* No winner, yet. */
+    return 0;
+}
+
+void resetBoard(char board[][3]) {
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            board[i][j] = ' ';
+        }
+    }
+}
+
+void gameInit(struct game *g) {
+    resetBoard(g->board);
+    g->turn = 1;
+    g->moves = 0;
+    g->last_move = -1;
+    g->status = GAME_RUNNING;
+    g->winner = -1;
+    g->history = 0;
+}
+
+int gamePlay(struct game *g, int player_id, int move) {
+    if (g->status != GAME_RUNNING || player_id != g->turn)
+        return MOVE_INVALID;
+    if (!checkMove(g->board, move, player_id))
+        return MOVE_INVALID;
+
+    updateBoard(g->board, move, player_id);
+    g->history |= (unsigned long long)move << (4 * g->moves);
+    g->moves++;
+    g->last_move = move;
+
+    if (checkBoard(g->board, move)) { /* We have a winner. */
+        g->status = GAME_WON;
+        g->winner = player_id;
+        return MOVE_WIN;
+    }
+    if (g->moves == BOARD_CELLS) { /* Nine valid moves and no winner. */
+        g->status = GAME_DRAW;
+        return MOVE_DRAW;
+    }
+    g->turn = !player_id;
+    return MOVE_OK;
+}
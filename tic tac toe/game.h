@@ -0,0 +1,48 @@
+/****************************************************************************
+*       Transport independent Tic Tac Toe rules and turn state machine.
+*
+*       The server, the self-play simulator and the benchmarks all drive
+*       games through these functions so the rules live in one place.
+*
+*****************************************************************************/
+
+#ifndef GAME_H
+#define GAME_H
+
+#define BOARD_CELLS 9
+
+/* Game status. */
+#define GAME_RUNNING 0
+#define GAME_WON     1
+#define GAME_DRAW    2
+
+/* Results of gamePlay(). */
+#define MOVE_INVALID -1
+#define MOVE_OK       0
+#define MOVE_WIN      1
+#define MOVE_DRAW     2
+
+struct game {
+    char board[3][3];   /* ' ', 'O' (player 0) or 'X' (player 1) */
+    int turn;           /* Id of the player to move. */
+    int moves;          /* Valid moves played so far. */
+    int last_move;      /* Position of the last valid move, -1 before the first. */
+    int status;         /* GAME_RUNNING, GAME_WON or GAME_DRAW. */
+    int winner;         /* Id of the winner when status is GAME_WON. */
+    unsigned long long history; /* Moves so far, 4 bits each, the first in the low bits. */
+};
+
+int checkMove(char board[][3], int move, int player_id);
+void updateBoard(char board[][3], int move, int player_id);
+int checkBoard(char board[][3], int last_move);
+void resetBoard(char board[][3]);
+
+/* Starts a new game. Player 2 (id 1, 'X') always opens. */
+void gameInit(struct game *g);
+
+/* Plays a move for player_id. Returns MOVE_INVALID if it is not that
+ * player's turn, the game is over or the position is taken; otherwise
+ * applies the move and returns MOVE_OK, MOVE_WIN or MOVE_DRAW. */
+int gamePlay(struct game *g, int player_id, int move);
+
+#endif
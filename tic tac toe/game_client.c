@@ -2,7 +2,34 @@
 *       Tic Tac Toe client program which uses simple TCP to 
 *       connect to Game Server.
 *
-*       Usage : ./client.out <any port number>
+*       Usage : ./client.out [-l] [-r | -j room code | -a | -R token] <any port number>
+*               ./client.out -u <unix socket path> [-m] [-r | -j room code | -a | -R token]
+*
+*       -m asks a server on the same host for a shared memory ring.
+*       -r creates a room and prints its code, for the other player to
+*       join with -j. -a plays the computer. Without any of them the
+*       server pairs whoever comes next.
+*
+*       A server with FEATURE_RESUME gives out a resume token when the
+*       game starts, which the client prints. If the connection is lost,
+*       -R with the token takes the seat in the game back, as long as
+*       the server is still waiting for it. Meanwhile the client sends a
+*       heartbeat whenever it has sent nothing for HEARTBEAT_MS, so the
+*       server can tell a player thinking from one that is gone.
+*
+*       A move is drawn as soon as it is typed, without waiting for the
+*       server to send the board back. The board the server sends next
+*       confirms it, or replaces it if the server saw things differently;
+*       INV takes the move back off the board. The client waits on the
+*       server and the keyboard together, so messages from the server
+*       are dealt with while the player thinks, and moves typed ahead
+*       wait for their turn.
+*
+*       Unless -l is given the client asks for FEATURE_TURN, and a server
+*       that has it sends every turn as one PLY frame with the board and
+*       the turn or the result; a turn is then a single round trip. Older
+*       servers leave the feature out of their answer and the client
+*       carries on with the messages they know.
 *       
 *       GROUP NO :  17
 *       Roll no 15/CS/16 : Amit Sharma.
@@ -10,43 +37,166 @@
 *
 *****************************************************************************/
 
+#include <errno.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 
+#include "game.h"
+#include "proto.h"
+#include "conn.h"
+
+#define INBOX_LEN 256
+#define LINE_LEN 64
+
+/* Bytes from the server not decoded yet. */
+struct inbox {
+    char buf[INBOX_LEN];
+    int len;
+};
+
+/* Lines typed ahead of their turn. */
+struct keys {
+    char buf[LINE_LEN];
+    int len;
+    int eof;
+};
+
+static long sent_ms;         /* When the client last sent something. */
+
 void error(const char *msg) {
     perror(msg);
     exit(0);
 }
 
-void recvMsg(int sockfd, char * msg) {
-    /* All messages are 3 bytes. */
-    memset(msg, 0, 4);
-    int n = read(sockfd, msg, 3);
+long nowMs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
 
-    if (n < 0 || n != 3) 
-        error("ERROR reading message from server socket.");
+/* Takes the next whole message out of the inbox. Returns 0 if there is
+ * none yet. */
+int nextMsg(struct inbox *in, struct msg *m) {
+    int n = protoDecode(in->buf, in->len, m);
+
+    if (n < 0)
+        error("Unknown message.");
+    if (n > 0) {
+        in->len -= n;
+        memmove(in->buf, in->buf + n, in->len);
+    }
+    return n > 0;
+}
+
+/* Reads what the server has sent so far. Returns the number of bytes, 0
+ * if there were none or -1 once the server went away. */
+int fillInbox(struct conn *server, struct inbox *in) {
+    int n = connReadSome(server, in->buf + in->len, INBOX_LEN - in->len);
+
+    if (n > 0)
+        in->len += n;
+    return n;
+}
+
+/* Takes the next line typed into line, which holds LINE_LEN bytes.
+ * Returns 0 if there is no whole line yet. */
+int nextLine(struct keys *k, char *line) {
+    char *end = memchr(k->buf, '\n', k->len);
+    int n;
+
+    if (end == NULL && k->len == LINE_LEN - 1)
+        end = k->buf + k->len - 1;   /* Too long, take it in pieces. */
+    if (end == NULL && !(k->eof && k->len))
+        return 0;
+    n = end ? end - k->buf + 1 : k->len;
+    memcpy(line, k->buf, n);
+    line[n] = '\0';
+    k->len -= n;
+    memmove(k->buf, k->buf + n, k->len);
+    return 1;
 }
 
-int recvInt(int sockfd) {
+void writeServerInt(struct conn *server, int msg);
+
+/* Waits until the server sends something, or the player types something
+ * if keyboard is set. A server with FEATURE_RESUME gets a heartbeat if
+ * the wait gets long. Returns -1 once the server went away. */
+int waitInput(struct conn *server, struct inbox *in, struct keys *keyboard) {
+    struct pollfd fds[3];
+    int nfds = 0, n, timeout = -1;
+
+    /* Reading the ring arms its wakeup, so look before sleeping. */
+    if (server->shm && (n = fillInbox(server, in)) != 0)
+        return n < 0 ? -1 : 0;
+
+    fds[nfds++] = (struct pollfd){ .fd = server->fd, .events = POLLIN };
+    if (server->shm)
+        fds[nfds++] = (struct pollfd){ .fd = connEventFd(server), .events = POLLIN };
+    if (keyboard)
+        fds[nfds++] = (struct pollfd){ .fd = STDIN_FILENO, .events = POLLIN };
+
+    if (server->features & FEATURE_RESUME) {
+        long left = sent_ms + HEARTBEAT_MS - nowMs();
+        if (left <= 0) {
+            writeServerInt(server, HEARTBEAT);
+            left = HEARTBEAT_MS;
+        }
+        timeout = left;
+    }
+
+    fflush(stdout);
+    if ((n = poll(fds, nfds, timeout)) < 0)
+        return errno == EINTR ? 0 : -1;
+    if (n == 0)
+        return 0;
+
+    if (keyboard && fds[nfds - 1].revents) {
+        n = read(STDIN_FILENO, keyboard->buf + keyboard->len, LINE_LEN - 1 - keyboard->len);
+        if (n > 0)
+            keyboard->len += n;
+        else if (n == 0 || errno != EINTR)
+            keyboard->eof = 1;
+    }
+    for (int i = 0; i < (server->shm ? 2 : 1); i++)
+        if (fds[i].revents)
+            return fillInbox(server, in) < 0 ? -1 : 0;
+    return 0;
+}
+
+int recvInt(struct conn *server) {
     int msg = 0;
-    int n = read(sockfd, &msg, sizeof(int));
+    int n = connRead(server, &msg, sizeof(int));
 
-    if (n < 0 || n != sizeof(int))
+    if (n != sizeof(int))
         error("ERROR reading int from server socket");
 
     return msg;
 }
 
-void writeServerInt(int sockfd, int msg) {
-    int n = write(sockfd, &msg, sizeof(int));
+void writeServerInt(struct conn *server, int msg) {
+    char buf[sizeof(int)];
+    int n = connWrite(server, buf, protoEncodeMove(msg, buf));
     if (n < 0)
         error("ERROR writing int to server socket");
+    sent_ms = nowMs();
+}
+
+void writeServerResume(struct conn *server, unsigned long long token) {
+    char buf[RESUME_LEN];
+
+    if (connWrite(server, buf, protoEncodeResume(token, buf)) < 0)
+        error("ERROR writing to server socket");
+    sent_ms = nowMs();
 }
 
 int connectToServer(char * hostname, int portno) {
@@ -79,6 +229,31 @@ int connectToServer(char * hostname, int portno) {
     if (connect(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0)
         error("ERROR connecting to server");
 
+    /* Moves are tiny and each one waits for an answer. */
+    int option = 1;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &option, sizeof(option));
+
+    return sockfd;
+}
+
+int connectToUnix(const char *path) {
+    struct sockaddr_un serv_addr;
+    int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (sockfd < 0)
+        error("ERROR opening socket for server.");
+    if (strlen(path) >= sizeof(serv_addr.sun_path)) {
+        fprintf(stderr, "ERROR, unix socket path too long\n");
+        exit(0);
+    }
+
+    memset(&serv_addr, 0, sizeof(serv_addr));
+    serv_addr.sun_family = AF_UNIX;
+    strcpy(serv_addr.sun_path, path);
+
+    if (connect(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0)
+        error("ERROR connecting to server");
+
     return sockfd;
 }
 
@@ -90,82 +265,243 @@ void drawBoard(char board[][3]) {
     printf(" %c | %c | %c \n", board[2][0], board[2][1], board[2][2]);
 }
 
-void takeTurn(int sockfd) {
-    char buffer[10];
+/* Draws the board if it differs from the one on screen. */
+void showBoard(char shown[][3], char board[][3]) {
+    if (memcmp(shown, board, 9)) {
+        memcpy(shown, board, 9);
+        drawBoard(shown);
+    }
+}
+
+/* Plays a line typed on our turn. The move goes on the board on screen
+ * right away, unless it is clearly invalid, and to the server. Returns
+ * the move, or -1 if the line is not one and the player has to try again. */
+int takeTurn(struct conn *server, const char *line, char board[][3], char shown[][3]) {
+    int move = line[0] - '0';
+    int stones = 0;
 
-    while (1) { /* Ask until we receive. */
+    if (move > 9 || move < 0) {
+        printf("\nInvalid input. Try again.\n");
         printf("Enter 0-8 to make a move : ");
-	    fgets(buffer, 10, stdin);
-	    int move = buffer[0] - '0';
-        if (move <= 9 && move >= 0){
-            printf("\n");
-            /* Send players move to the server. */
-            writeServerInt(sockfd, move);
-            break;
-        }
-        else
-            printf("\nInvalid input. Try again.\n");
+        return -1;
+    }
+    printf("\n");
+
+    /* X opens, so an even number of stones means we are X. */
+    for (int i = 0; i < BOARD_CELLS; i++)
+        stones += board[i/3][i%3] != ' ';
+    if (move < BOARD_CELLS && board[move/3][move%3] == ' ') {
+        char next[3][3];
+        memcpy(next, board, 9);
+        next[move/3][move%3] = stones % 2 ? 'O' : 'X';
+        showBoard(shown, next);
     }
+    /* Send players move to the server. */
+    writeServerInt(server, move);
+    return move;
 }
 
-void getUpdate(int sockfd, char board[][3]) {
-    /* Get the update. */
-    int player_id = recvInt(sockfd);
-    int move = recvInt(sockfd);
+/* Applies a one move update. Returns 0 if an update was missed, in which
+ * case the board is left alone until a snapshot arrives. */
+int getUpdate(struct msg *m, char board[][3], int *seq) {
+    if (m->seq != *seq + 1)
+        return 0;
 
     /* Update the game board. */
-    board[move/3][move%3] = player_id ? 'X' : 'O';
+    board[m->move/3][m->move%3] = m->player_id ? 'X' : 'O';
+    *seq = m->seq;
+    return 1;
 }
 
-void getBoard(int sockfd, char board[][3]) {
-  int n = read(sockfd, board, sizeof(char)*9);
-  
-  if (n < 0 || n != 9*sizeof(char))
-      error("ERROR reading int from server socket");
-}
+int main(int argc, char *argv[]) {
+  const char *unix_path = NULL;
+  int want_shm = 0, legacy = 0, create = 0, computer = 0, opt;
+  unsigned join = 0;
+  unsigned long long resume = 0;
+  char *end;
+  struct conn server;
 
-int main(int argc, char const *argv[]) {
+  while ((opt = getopt(argc, argv, "u:mlrj:aR:")) != -1) {
+    if (opt == 'u')
+      unix_path = optarg;
+    else if (opt == 'm')
+      want_shm = 1;
+    else if (opt == 'l')
+      legacy = 1;
+    else if (opt == 'r')
+      create = 1;
+    else if (opt == 'a')
+      computer = 1;
+    else if (opt == 'R' && ((resume = strtoull(optarg, &end, 16)) == 0 || *end)) {
+      fprintf(stderr, "ERROR, %s is not a resume token\n", optarg);
+      exit(0);
+    } else if (opt == 'j' && (join = protoParseCode(optarg)) == 0) {
+      fprintf(stderr, "ERROR, %s is not a room code\n", optarg);
+      exit(0);
+    } else if (opt != 'j' && opt != 'R')
+      error("Usage : ./client.out [-l] [-r | -j code | -a | -R token] <port> | -u <unix socket path> [-m] [-r | -j code | -a | -R token]");
+  }
+  int lobby = create || join || computer || resume;
+  if (legacy && lobby)
+    error("ERROR rooms need the hello, drop -l");
 
-  if(argc < 2) {
-      error("ERROR PORT required");
+  if (unix_path) {
+    connInit(&server, connectToUnix(unix_path));
+  } else {
+    if(optind >= argc) {
+        error("ERROR PORT required");
+    }
+    connInit(&server, connectToServer("localhost", strtol(argv[optind], NULL, 10)));
+  }
+  /* Legacy TCP clients skip the hello and get full boards. */
+  if (unix_path || !legacy) {
+    int r = connHello(&server, want_shm, FEATURE_DELTA | FEATURE_TURN | FEATURE_RESUME | (lobby ? FEATURE_LOBBY : 0));
+    if (r == CONN_BUSY) {
+      printf("Server busy, try again later.\n");
+      exit(0);
+    }
+    if (r < 0)
+      error("ERROR negotiating with server");
+  }
+  sent_ms = nowMs();
+  if (lobby) {
+    if (!(server.features & FEATURE_LOBBY))
+      error("ERROR server has no lobby");
+    if (resume && !(server.features & FEATURE_RESUME))
+      error("ERROR server cannot resume games");
+    if (resume)
+      writeServerResume(&server, resume);
+    else
+      writeServerInt(&server, create ? ROOM_CREATE : computer ? ROOM_BOT : (int)join);
   }
-  int sockfd = connectToServer("localhost", strtol(argv[1], NULL, 10));
 
-  char msg[4];
-  char board[3][3] = { {' ', ' ', ' '}, /* Game board */
+  struct msg msg;
+  struct inbox in = { .len = 0 };
+  struct keys keys = { .len = 0 };
+  char line[LINE_LEN];
+  char board[3][3] = { {' ', ' ', ' '}, /* Game board, as the server has it. */
                        {' ', ' ', ' '},
                        {' ', ' ', ' '} };
+  char shown[3][3];         /* On screen: the board and our move in flight. */
+  int game_over = 0;
+  int seq = -1;             /* Moves seen, from SNP and DLT. */
+  int resyncing = 0;        /* Asked for a snapshot, not received yet. */
+  int turn_pending = 0;     /* Our turn came while resyncing. */
+  int my_turn = 0;          /* Waiting for the player to type a move. */
 
-  printf("Waiting for player 2\n");
-  while (1) {
-    recvMsg(sockfd, msg);
+  memset(shown, 0, sizeof(shown));   /* Nothing on screen yet. */
+  if (!resume)
+    printf("Waiting for player 2\n");
+  while (!game_over) {
+    if (!nextMsg(&in, &msg)) {
+      if (my_turn && nextLine(&keys, line)) {
+        my_turn = takeTurn(&server, line, board, shown) < 0;
+      } else if (my_turn && keys.eof) {
+        printf("\nNo more moves.\n");
+        break;
+      } else if (waitInput(&server, &in, my_turn ? &keys : NULL) < 0) {
+        error("ERROR reading message from server socket.");
+      }
+      continue;
+    }
 
-    if (!strcmp(msg, "TRN")) {
-      printf("Your move...\n");
-      takeTurn(sockfd);
-    } else if (!strcmp(msg, "INV")) {
-      printf("That position has already been played. Try again.\n");
-    } else if (!strcmp(msg, "UPD")) { /* Server is sending a game board update. */
-            getBoard(sockfd, board);
-            drawBoard(board);
-    } else if(!strcmp(msg, "BRD")) {
-            getBoard(sockfd, board);
-    } else if (!strcmp(msg, "WAT")) { /* Wait for other player to take a turn. */
-            printf("Waiting for other players move...\n");
-    } else if (!strcmp(msg, "WIN")) { /* Winner. */
-            printf("You win!\n");
-            break;
+    if (msg.type == MSG_PLY) { /* The board, then what it carries. */
+      memcpy(board, msg.board, sizeof(board));
+      seq = msg.seq;
+      showBoard(shown, board);
+      if (msg.next == MSG_INV) /* And our turn again. */
+        printf("That position has already been played. Try again.\n");
+      msg.type = msg.next == MSG_INV ? MSG_TRN : msg.next;
     }
-    else if (!strcmp(msg, "LSE")) { /* Loser. */
-        printf("You lost.\n");
+
+    switch (msg.type) {
+    case MSG_TRN:
+      if (resyncing) { /* Don't move on a stale board. */
+        turn_pending = 1;
         break;
-    } else if (!strcmp(msg, "DRW")) { /* Game is a draw. */
-        printf("Draw.\n");
+      }
+      printf("Your move...\n");
+      printf("Enter 0-8 to make a move : ");
+      my_turn = 1;
+      break;
+    case MSG_INV: /* Take our move back off the screen. */
+      showBoard(shown, board);
+      printf("That position has already been played. Try again.\n");
+      break;
+    case MSG_UPD: /* Server is sending a game board update. */
+      memcpy(board, msg.board, sizeof(board));
+      showBoard(shown, board);
+      break;
+    case MSG_BRD:
+      memcpy(board, msg.board, sizeof(board));
+      memcpy(shown, board, sizeof(shown));
+      break;
+    case MSG_SNP: /* Whole board, on joining or after a resync. */
+      memcpy(board, msg.board, sizeof(board));
+      seq = msg.seq;
+      resyncing = 0;
+      showBoard(shown, board);
+      if (turn_pending) {
+        turn_pending = 0;
+        printf("Your move...\n");
+        printf("Enter 0-8 to make a move : ");
+        my_turn = 1;
+      }
+      break;
+    case MSG_DLT: /* One move. */
+      if (resyncing)
         break;
-    } else /* Weird... */
-        error("Unknown message.");
+      if (getUpdate(&msg, board, &seq)) {
+        showBoard(shown, board);
+      } else {
+        writeServerInt(&server, RESYNC_REQUEST);
+        resyncing = 1;
+      }
+      break;
+    case MSG_WAT: /* Wait for other player to take a turn. */
+      printf("Waiting for other players move...\n");
+      break;
+    case MSG_WIN: /* Winner. */
+      printf("You win!\n");
+      game_over = 1;
+      break;
+    case MSG_LSE: /* Loser. */
+      printf("You lost.\n");
+      game_over = 1;
+      break;
+    case MSG_DRW: /* Game is a draw. */
+      printf("Draw.\n");
+      game_over = 1;
+      break;
+    case MSG_ROM: { /* Our room is open. */
+      char code[ROOM_CODE_LEN + 1];
+      protoFormatCode(msg.code, code);
+      printf("Room code: %s\n", code);
+      fflush(stdout);
+      break;
+    }
+    case MSG_TOK:
+      printf("Resume token: %016llx\n", msg.token);
+      fflush(stdout);
+      break;
+    case MSG_AWY:
+      printf("\nOpponent lost its connection, waiting for it to come back...\n");
+      break;
+    case MSG_BAK:
+      printf("Opponent is back.\n");
+      break;
+    case MSG_NRM:
+      printf(resume ? "No game to resume.\n" : create ? "Room expired.\n" :
+             computer ? "No computer to play.\n" : "No such room.\n");
+      game_over = 1;
+      break;
+    case MSG_BSY: /* Turned away, legacy clients only. */
+      printf("Server busy, try again later.\n");
+      game_over = 1;
+      break;
+    }
   }
 
-
-    return 0;
+  connClose(&server);
+  return 0;
 }
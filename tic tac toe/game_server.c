@@ -1,9 +1,80 @@
 /****************************************************************************
-*       Simple Tic Tac Toe Game server built using shared 
-*       memory and semaphores for synchronisation of multiple
-*       processes.
+*       Simple Tic Tac Toe Game server. A single process runs every game
+*       from one epoll event loop.
 *
-*       Usage : ./server.out <any port number>
+*       Usage : ./server.out [-u unix socket path] [-c control path]
+*                            [-p forfeit|disconnect] [-r trace file]
+*                            [-R per address rate] [-G global rate]
+*                            [-g max games] [-a admin port]
+*                            [-A ms per move] [-t AI threads]
+*                            [-H history dir] [-P sample one in]
+*                            <any port number>
+*               ./server.out -T <control path of the running server>
+*                            [-c control path]
+*
+*       Clients on the same host can connect to the UNIX socket and ask
+*       for a shared memory ring instead of going through the socket.
+*
+*       With -c the server accepts takeover requests on a control socket.
+*       -T starts a new binary that takes the listening sockets, every
+*       connection and every game over from the running server, which
+*       then exits (see handover.c).
+*
+*       Writes never block: what a client does not take right away waits
+*       in its output queue. A client whose queue stays past the high
+*       water mark for too long, or overflows it, forfeits its game (-p
+*       forfeit, the default) or is disconnected with its opponent (-p
+*       disconnect).
+*
+*       Clients that ask for FEATURE_TURN in their hello get each turn
+*       as one PLY frame with the last move, the board and the turn or
+*       the result (see proto.h), instead of a board update followed by
+*       TRN, and nothing at all in answer to a valid move that does not
+*       end the game.
+*
+*       A connection that reaches EOF or fails is gone at once, and so
+*       is a TCP connection whose keepalive probes go unanswered. Its
+*       opponent wins, unless the player asked for FEATURE_RESUME: such
+*       clients send heartbeats and are gone once they miss a few, get a
+*       resume token when their game starts, and the game waits
+*       RESUME_GRACE_MS for them to come back with it before they
+*       forfeit. Their opponent is told in the meantime.
+*
+*       Clients that ask for the lobby in their hello create a room and
+*       get its code, or join a room by its code, instead of playing
+*       whoever comes next. Rooms nobody joins expire.
+*
+*       New connections are admitted right after accept through a token
+*       bucket for all of them (-G connections a second) and one per
+*       source address (-R). A client that asks for a new game is turned
+*       away past a cap on the number of games (-g), and while a pass of
+*       the event loop takes longer than LAG_SHED_MS on average; players
+*       resuming their game never are. Clients turned away get BSY and
+*       are closed. Games in progress are served before new connections
+*       are accepted.
+*
+*       Lobby clients can also play the computer, which picks its moves
+*       by Monte Carlo tree search (see mcts.h) with -A milliseconds per
+*       move, in threads of its own (-t) so the event loop never waits
+*       for it.
+*
+*       -a opens an admin port that answers every connection with one
+*       line of status and closes it: OK, or BUSY while new connections
+*       are being shed, then the number of games, waiting players and
+*       rooms and the loop lag. The router (router.c) checks the health
+*       and load of its backends there.
+*
+*       -H appends every finished game to the history store in the
+*       given directory (see history.h), for query.out. A new binary
+*       taking over carries on appending to the same store.
+*
+*       -P profiles the phases of a turn with hardware counters (see
+*       prof.h), sampling one run of each phase in the given number. The
+*       averages are printed on SIGUSR1, and on SIGINT or SIGTERM before
+*       the server exits, or when it hands over to a new binary.
+*
+*       -r captures what every new connection sends, with timestamps, to
+*       a trace file for the replay tool (see trace.h and replay.c).
 *       
 *       GROUP NO :  17
 *       Roll no 15/CS/16 : Amit Sharma.
@@ -11,62 +82,64 @@
 *
 *****************************************************************************/
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <stdlib.h>
-#include <sys/ipc.h>
-#include <sys/shm.h>
-#include <sys/sem.h>
+#include <sys/random.h>
+
+#include "game.h"
+#include "proto.h"
+#include "conn.h"
+#include "server.h"
 
-#define WAIT(s)  semop(s,&pop,1)
-#define SIGNAL(s)  semop(s,&vop,1)
 #define BUFF_SIZE 256
+#define HELLO_WAIT_MS 100   /* Time a TCP client gets to send its hello. */
+#define MAX_EVENTS 256
+#define SLOW_CLIENT_MS 5000 /* Time a client may stay over the high water mark. */
+#define LISTEN_BACKLOG SOMAXCONN
+#define ACCEPT_BATCH 64     /* Connections accepted per listener and pass. */
+#define LAG_SHED_MS 50      /* Average pass of the loop that sheds new connections. */
+#define REPORT_MS 1000      /* Time between reports of shed connections. */
+#define HISTORY_WAIT_MS 2000   /* For the old server to let go of the history store. */
 
-void error(const char *msg) {
-    perror(msg);
-    exit(EXIT_FAILURE);
-}
+/* TCP keepalive: probes after KEEPALIVE_IDLE s of silence, every
+ * KEEPALIVE_INTERVAL s, KEEPALIVE_COUNT unanswered ones and it is gone. */
+#define KEEPALIVE_IDLE     10
+#define KEEPALIVE_INTERVAL 5
+#define KEEPALIVE_COUNT    3
 
-/* Reads an int from a client socket. */
-int recvInt(int cli_sockfd) {
-    int msg = 0;
-    int n = read(cli_sockfd, &msg, sizeof(int));
+#define AI_MOVE_MS 200
+#define AI_NODES (1 << 20)
+#define AI_MAX_PLAYOUTS 50000   /* Plenty for 3x3; the rest of the budget is left. */
 
-    if (n < 0 || n != sizeof(int)) /* Not what we were expecting. Client likely disconnected. */
-        return -1;
+/* Admission defaults; the bursts are twice the rates. */
+#define ADDR_RATE   50
+#define GLOBAL_RATE 5000
+#define MAX_GAMES   50000
 
-    return msg;
-}
+static struct server srv;
 
-/* Writes a message to a client socket. */
-void writeClientMsg(int cli_sockfd, char * msg) {
-    int n = write(cli_sockfd, msg, strlen(msg));
-    if (n < 0)
-        error("ERROR writing msg to client socket");
-}
-
-/* Writes an int to a client socket. */
-void writeClientInt(int cli_sockfd, int msg) {
-    int n = write(cli_sockfd, &msg, sizeof(int));
-    if (n < 0)
-        error("ERROR writing int to client socket");
-}
-
-/* Writes a message to both client sockets. */
-void writeClientsMsg(int *cli_sockfd, char * msg) {
-    writeClientMsg(cli_sockfd[0], msg);
-    writeClientMsg(cli_sockfd[1], msg);
+void error(const char *msg) {
+    perror(msg);
+    exit(EXIT_FAILURE);
 }
 
-/* Writes an int to both client sockets. */
-void writeClientsInt(int * cli_sockfd, int msg) {
-    writeClientInt(cli_sockfd[0], msg);
-    writeClientInt(cli_sockfd[1], msg);
+/* Writes a message to a client socket. */
+void writeClientMsg(struct client *cli, char * msg) {
+    serverSend(&srv, cli, msg, strlen(msg));
 }
 
 int setupListener(int portno) {
@@ -92,28 +165,31 @@ int setupListener(int portno) {
         error("ERROR binding listener socket.");
 
 
-    listen(sockfd, 2);
+    listen(sockfd, LISTEN_BACKLOG);
     /* Return the socket number. */
     return sockfd;
 }
 
-int getPlayerMove(int cli_sockfd) {
-    /* Tell player to make a move. */
-    writeClientMsg(cli_sockfd, "TRN");
+int setupUnixListener(const char *path) {
+    struct sockaddr_un serv_addr;
+    int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
 
-    /* Get players move. */
-    return recvInt(cli_sockfd);
-}
+    if (sockfd < 0)
+        error("ERROR opening unix listener socket.");
+    if (strlen(path) >= sizeof(serv_addr.sun_path))
+        error("ERROR unix socket path too long");
 
-int checkMove(char board[][3], int move, int player_id) {
-    if ((move == 9) || (board[move/3][move%3] == ' '))   /* Move is valid. */
-        return 1;
-   else /* Move is invalid. */
-       return 0;
-}
+    memset(&serv_addr, 0, sizeof(serv_addr));
+    serv_addr.sun_family = AF_UNIX;
+    strcpy(serv_addr.sun_path, path);
+
+    /* Replace the socket file left behind by an earlier run. */
+    unlink(path);
+    if (bind(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0)
+        error("ERROR binding unix listener socket.");
 
-void updateBoard(char board[][3], int move, int player_id) {
-    board[move/3][move%3] = player_id ? 'X' : 'O';
+    listen(sockfd, LISTEN_BACKLOG);
+    return sockfd;
 }
 
 void drawBoard(char board[][3]) {
@@ -124,184 +200,1423 @@ void drawBoard(char board[][3]) {
     printf(" %c | %c | %c \n", board[2][0], board[2][1], board[2][2]);
 }
 
-void sendBoard(int cli_sockfd, char board[][3]) {
-  writeClientMsg(cli_sockfd, "UPD");
-  int n = write(cli_sockfd, board, 9*sizeof(char));
-  if (n < 0)
-      error("ERROR writing int to client socket");
+void sendMsg(struct client *cli, const struct msg *m) {
+  char buf[MSG_MAX_LEN];
 
+  serverSend(&srv, cli, buf, protoEncode(m, buf));
 }
 
-void sendUpdate(int cli_sockfd, int move, int player_id) {
-    /* Signal an update */
-    writeClientMsg(cli_sockfd, "UPD");
+void sendBoard(struct client *cli, char board[][3]) {
+  struct msg m = { MSG_UPD };
+
+  memcpy(m.board, board, 9);
+  sendMsg(cli, &m);
+}
 
-    /* Send the id of the player that made the move. */
-    writeClientInt(cli_sockfd, player_id);
+void sendSnapshot(struct client *cli, struct game *g) {
+  struct msg m = { MSG_SNP };
 
-    /* Send the move. */
-    writeClientInt(cli_sockfd, move);
+  memcpy(m.board, g->board, 9);
+  m.seq = cli->seq = g->moves;
+  sendMsg(cli, &m);
 }
 
-int checkBoard(char board[][3], int last_move) {
-    int row = last_move/3;
-    int col = last_move%3;
+/* The last move, the board and next, one of MSG_TRN, MSG_INV, MSG_WIN,
+ * MSG_LSE or MSG_DRW, for FEATURE_TURN clients. */
+void sendPly(struct client *cli, struct game *g, int next) {
+  struct msg m = { MSG_PLY };
 
-    if ( board[row][0] == board[row][1] && board[row][1] == board[row][2] ) { /* Check the row for a win. */
-        return 1;
+  m.seq = cli->seq = g->moves;
+  m.move = g->last_move;
+  m.player_id = m.move >= 0 && g->board[m.move/3][m.move%3] == 'X';
+  memcpy(m.board, g->board, 9);
+  m.next = next;
+  sendMsg(cli, &m);
+}
+
+/* Brings the client's board up to date. Legacy clients get the whole
+ * board every time. Delta clients get the last move if they are one move
+ * behind and a snapshot otherwise; cli->seq counts the moves they have seen.
+ * FEATURE_TURN clients get the board with their turn or result instead. */
+void sendState(struct client *cli, struct game *g) {
+  struct msg m = { MSG_DLT };
+
+  if (cli->conn.features & FEATURE_TURN) {
+    return;
+  } else if (!(cli->conn.features & FEATURE_DELTA)) {
+    sendBoard(cli, g->board);
+  } else if (cli->seq == g->moves - 1 && g->last_move >= 0) {
+    m.seq = cli->seq = g->moves;
+    m.move = g->last_move;
+    m.player_id = g->board[m.move/3][m.move%3] == 'X';
+    sendMsg(cli, &m);
+  } else if (cli->seq != g->moves) {
+    sendSnapshot(cli, g);
+  }
+}
+
+long nowMs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+static volatile sig_atomic_t prof_signal;
+
+static void onProfSignal(int sig) {
+    prof_signal = sig;
+}
+
+static long wallMs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+static void watch(struct server *s, int fd, void *source) {
+    struct epoll_event ev = { EPOLLIN, { .ptr = source } };
+
+    if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        error("ERROR adding to epoll");
+}
+
+void serverAddListener(struct server *s, int fd, int type) {
+    struct listener *l = type == LISTENER_ADMIN ? &s->admin : &s->listeners[s->nlisteners++];
+
+    l->kind = type == LISTENER_ADMIN ? SOURCE_ADMIN : SOURCE_LISTENER;
+    l->fd = fd;
+    l->is_unix = type == LISTENER_UNIX;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    watch(s, fd, l);
+}
+
+/* Matches by resume token. Each player has a token of its own, so
+ * knowing one tells nothing about the other. */
+static struct match **tokenBucket(struct server *s, unsigned long long token) {
+    return &s->tokens[token & 1][(token >> 1) * 0x9e3779b97f4a7c15ull >> (64 - TOKEN_BITS)];
+}
+
+static struct match *findToken(struct server *s, unsigned long long token) {
+    struct match *m = *tokenBucket(s, token);
+
+    while (m && m->secret[token & 1] != token)
+        m = m->token_next[token & 1];
+    return m;
+}
+
+static void removeToken(struct server *s, struct match *m) {
+    for (int i = 0; i < 2; i++) {
+        struct match **p = tokenBucket(s, m->secret[i]);
+
+        while (*p != m)
+            p = &(*p)->token_next[i];
+        *p = m->token_next[i];
     }
-    else if ( board[0][col] == board[1][col] && board[1][col] == board[2][col] ) { /* Check the column for a win. */
-        return 1;
+}
+
+/* A NULL secret gets new random tokens. */
+struct match *serverAddMatch(struct server *s, int id, const struct game *g, const unsigned long long *secret) {
+    struct match *m = calloc(1, sizeof(*m));
+
+    if (m == NULL)
+        error("ERROR allocating match");
+    for (int i = 0; i < 2; i++) {
+        struct match **bucket;
+        unsigned long long token = secret ? secret[i] : 0;
+
+        while (token == 0 || findToken(s, token)) {
+            if (getrandom(&token, sizeof(token), 0) != sizeof(token))
+                error("ERROR making a resume token");
+            token = (token & ~1ull) | i;    /* The player id goes there. */
+        }
+        m->secret[i] = token;
+        bucket = tokenBucket(s, token);
+        m->token_next[i] = *bucket;
+        *bucket = m;
+    }
+    m->id = id;
+    m->g = *g;
+    m->started = wallMs();
+    m->away = -1;
+    m->next = s->matches;
+    if (s->matches)
+        s->matches->prev = m;
+    s->matches = m;
+    if (id >= s->next_match_id)
+        s->next_match_id = id + 1;
+    s->nmatches++;
+    return m;
+}
+
+static void queueHello(struct server *s, struct client *c) {
+    c->hello_prev = s->hello_tail;
+    c->hello_next = NULL;
+    if (s->hello_tail)
+        s->hello_tail->hello_next = c;
+    else
+        s->hello_head = c;
+    s->hello_tail = c;
+}
+
+static void unqueueHello(struct server *s, struct client *c) {
+    if (c->hello_deadline < 0)
+        return;
+    if (c->hello_prev)
+        c->hello_prev->hello_next = c->hello_next;
+    else
+        s->hello_head = c->hello_next;
+    if (c->hello_next)
+        c->hello_next->hello_prev = c->hello_prev;
+    else
+        s->hello_tail = c->hello_prev;
+    c->hello_deadline = -1;
+}
+
+static void unqueueLive(struct server *s, struct client *c) {
+    if (c->live_deadline < 0)
+        return;
+    if (c->live_prev)
+        c->live_prev->live_next = c->live_next;
+    else
+        s->live_head = c->live_next;
+    if (c->live_next)
+        c->live_next->live_prev = c->live_prev;
+    else
+        s->live_tail = c->live_prev;
+    c->live_deadline = -1;
+}
+
+/* A FEATURE_RESUME client was heard from; it goes to the back of the
+ * live list. */
+static void touchClient(struct server *s, struct client *c) {
+    if (!(c->conn.features & FEATURE_RESUME) || c->bot)
+        return;
+    unqueueLive(s, c);
+    c->live_deadline = nowMs() + HEARTBEAT_TIMEOUT_MS;
+    c->live_prev = s->live_tail;
+    c->live_next = NULL;
+    if (s->live_tail)
+        s->live_tail->live_next = c;
+    else
+        s->live_head = c;
+    s->live_tail = c;
+}
+
+struct client *serverAddClient(struct server *s, struct conn *conn, int state, long hello_deadline) {
+    struct client *c = calloc(1, sizeof(*c));
+
+    if (c == NULL)
+        error("ERROR allocating client");
+    c->kind = SOURCE_CLIENT;
+    c->conn = *conn;
+    c->state = state;
+    c->seq = -1;
+    c->hello_deadline = hello_deadline;
+    c->slow_deadline = -1;
+    c->live_deadline = -1;
+    c->next = s->clients;
+    if (s->clients)
+        s->clients->prev = c;
+    s->clients = c;
+
+    if (state == CLIENT_HELLO && hello_deadline >= 0)
+        queueHello(s, c);
+    if (state == CLIENT_WAITING)
+        s->waiting = c;
+    watch(s, c->conn.fd, c);
+    if (connEventFd(&c->conn) >= 0)
+        watch(s, connEventFd(&c->conn), c);
+    touchClient(s, c);
+    return c;
+}
+
+/* Sockets get EPOLLOUT while there is a backlog; with the ring the
+ * eventfd is watched anyway and the reader wakes it once it makes room. */
+static void watchOutput(struct server *s, struct client *c, int on) {
+    struct epoll_event ev = { EPOLLIN | (on ? EPOLLOUT : 0), { .ptr = c } };
+
+    if (!c->conn.shm && epoll_ctl(s->epfd, EPOLL_CTL_MOD, c->conn.fd, &ev) < 0)
+        error("ERROR changing epoll events");
+}
+
+static void addBacklog(struct server *s, struct client *c) {
+    if (c->backlogged)
+        return;
+    c->out_prev = NULL;
+    c->out_next = s->backlog;
+    if (s->backlog)
+        s->backlog->out_prev = c;
+    s->backlog = c;
+    c->backlogged = 1;
+}
+
+static void removeBacklog(struct server *s, struct client *c) {
+    if (!c->backlogged)
+        return;
+    if (c->out_prev)
+        c->out_prev->out_next = c->out_next;
+    else
+        s->backlog = c->out_next;
+    if (c->out_next)
+        c->out_next->out_prev = c->out_prev;
+    c->backlogged = 0;
+}
+
+/* Marks the client to be dealt with once the current events are handled;
+ * the caller may be in the middle of a move. */
+static void failClient(struct server *s, struct client *c) {
+    c->failed = 1;
+    addBacklog(s, c);
+}
+
+static void consumeOutput(struct client *c, int n) {
+    c->out_len -= n;
+    memmove(c->out, c->out + n, c->out_len);
+}
+
+void serverQueue(struct server *s, struct client *c, const void *buf, int len) {
+    if (c->out_len + len > OUT_LIMIT) {
+        printf("Output queue of a client overflowed.\n");
+        failClient(s, c);
+        return;
     }
-    else if (!(last_move % 2)) { /* If the last move was at an even numbered position we have to check the diagonal(s) as well. */
-        if ( (last_move == 0 || last_move == 4 || last_move == 8) && (board[1][1] == board[0][0] && board[1][1] == board[2][2]) ) {  /* Check backslash diagonal. */
-            return 1;
+    if (c->out == NULL && (c->out = malloc(OUT_LIMIT)) == NULL)
+        error("ERROR allocating output queue");
+    memcpy(c->out + c->out_len, buf, len);
+    if (c->out_len == 0) {
+        addBacklog(s, c);
+        watchOutput(s, c, 1);
+    }
+    c->out_len += len;
+    if (c->out_len > OUT_HIGH_WATER && c->slow_deadline < 0)
+        c->slow_deadline = nowMs() + SLOW_CLIENT_MS;
+}
+
+void serverSend(struct server *s, struct client *c, const void *buf, int len) {
+    int n = 0;
+
+    if (c->state == CLIENT_CLOSED || c->failed || c->bot)
+        return;
+    profBegin(&s->prof, PROF_SEND);
+    /* Bytes only skip the queue while it is empty. */
+    if (c->out_len == 0 && (n = connWriteSome(&c->conn, buf, len)) < 0)
+        failClient(s, c);
+    else if (n < len)
+        serverQueue(s, c, (const char *)buf + n, len - n);
+    profEnd(&s->prof, PROF_SEND);
+}
+
+static void closeClient(struct server *s, struct client *c);
+
+/* Sends as much of the backlog as the client takes. */
+static void flushOutput(struct server *s, struct client *c) {
+    int n;
+
+    /* A closed client may still have events in hand, and a backlog. */
+    if (c->state == CLIENT_CLOSED || c->out_len == 0 || c->failed)
+        return;
+    n = connWriteSome(&c->conn, c->out, c->out_len);
+    if (n < 0) {
+        failClient(s, c);
+        return;
+    }
+    consumeOutput(c, n);
+    /* Draining clients keep their deadline. */
+    if (c->out_len < OUT_LOW_WATER && c->state != CLIENT_DRAINING)
+        c->slow_deadline = -1;
+    if (c->out_len == 0) {
+        watchOutput(s, c, 0);
+        removeBacklog(s, c);
+        if (c->state == CLIENT_DRAINING)
+            closeClient(s, c);
+    }
+}
+
+static int initRooms(struct server *s) {
+    if (s->rooms)
+        return 0;
+    if (roomIndexInit(&s->room_index, ROOMS_MAX) < 0)
+        return -1;
+    /* Untouched until used, like the index. */
+    s->rooms = calloc(ROOMS_MAX, sizeof(*s->rooms));
+    if (s->rooms == NULL)
+        error("ERROR allocating rooms");
+    return 0;
+}
+
+int serverAddRoom(struct server *s, struct client *c, unsigned code, long deadline) {
+    struct room *r, *after;
+
+    if (initRooms(s) < 0)
+        return -1;
+    if (s->free_rooms)
+        r = s->free_rooms;
+    else if (s->rooms_used < ROOMS_MAX)
+        r = &s->rooms[s->rooms_used];
+    else
+        return -1;
+    if (roomIndexInsert(&s->room_index, code, r - s->rooms) != ROOM_OK)
+        return -1;
+    if (r == s->free_rooms)
+        s->free_rooms = r->next;
+    else
+        s->rooms_used++;
+
+    s->nrooms++;
+    r->code = code;
+    r->host = c;
+    r->deadline = deadline;
+    c->room = r;
+
+    /* Rooms normally go last; ones taken over from another server may not. */
+    for (after = s->rooms_tail; after && after->deadline > deadline; after = after->prev)
+        ;
+    r->prev = after;
+    r->next = after ? after->next : s->rooms_head;
+    if (r->next)
+        r->next->prev = r;
+    else
+        s->rooms_tail = r;
+    if (after)
+        after->next = r;
+    else
+        s->rooms_head = r;
+    return 0;
+}
+
+/* Puts a room that is out of the index back on the free list. */
+static void freeRoom(struct server *s, struct room *r) {
+    if (r->prev)
+        r->prev->next = r->next;
+    else
+        s->rooms_head = r->next;
+    if (r->next)
+        r->next->prev = r->prev;
+    else
+        s->rooms_tail = r->prev;
+    r->host->room = NULL;
+    s->nrooms--;
+    r->next = s->free_rooms;
+    s->free_rooms = r;
+}
+
+static void closeRoom(struct server *s, struct room *r) {
+    uint32_t index;
+
+    roomIndexTake(&s->room_index, r->code, &index);
+    freeRoom(s, r);
+}
+
+/* Closes the connection now; the memory goes once the events in hand
+ * are handled, since some of them may still point at the client. */
+static void closeClient(struct server *s, struct client *c) {
+    if (c->state == CLIENT_CLOSED)
+        return;
+    if (c->bot) {
+        /* One that is thinking goes once the engine is done with it. */
+        c->state = CLIENT_CLOSED;
+        if (!c->thinking) {
+            c->next = s->closed;
+            s->closed = c;
         }
-        if ( (last_move == 2 || last_move == 4 || last_move == 6) && (board[1][1] == board[0][2] && board[1][1] == board[2][0]) ) { /* Check frontslash diagonal. */
-            return 1;
+        return;
+    }
+    if (c->state == CLIENT_HELLO)
+        unqueueHello(s, c);
+    if (s->waiting == c)
+        s->waiting = NULL;
+    if (c->room)
+        closeRoom(s, c->room);
+    removeBacklog(s, c);
+    unqueueLive(s, c);
+
+    if (c->prev)
+        c->prev->next = c->next;
+    else
+        s->clients = c->next;
+    if (c->next)
+        c->next->prev = c->prev;
+
+    connClose(&c->conn);   /* Also takes the fds out of epoll. */
+    if (c->trace_id)
+        traceWrite(&s->trace, TRACE_CLOSE, c->trace_id, 0, NULL, 0);
+    c->state = CLIENT_CLOSED;
+    c->next = s->closed;
+    s->closed = c;
+}
+
+/* Closes a client that is done, once the last messages are out. */
+static void lingerClient(struct server *s, struct client *c) {
+    if (c->state == CLIENT_CLOSED)
+        return;
+    if (c->out_len == 0 || c->failed) {
+        closeClient(s, c);
+        return;
+    }
+    c->state = CLIENT_DRAINING;
+    c->match = NULL;
+    c->awaiting_move = 0;
+    if (c->slow_deadline < 0)
+        c->slow_deadline = nowMs() + SLOW_CLIENT_MS;
+}
+
+/* Appends the game to the history store, if there is one. A store that
+ * fails is closed rather than taking the server down with it. */
+static void recordMatch(struct server *s, struct match *m) {
+    struct history_game h;
+
+    if (s->history.dir == NULL)
+        return;
+    h.id = m->id;
+    h.start = m->started / 1000;
+    h.duration = wallMs() - m->started;
+    h.moves = m->g.history;
+    h.length = m->g.moves;
+    if (m->g.status == GAME_WON)
+        h.result = m->g.winner ? HIST_X_WON : HIST_O_WON;
+    else
+        h.result = m->g.status == GAME_DRAW ? HIST_DRAW : HIST_ABANDONED;
+    h.player_x = m->players[1] && m->players[1]->bot ? HIST_COMPUTER : HIST_HUMAN;
+    h.player_o = m->players[0] && m->players[0]->bot ? HIST_COMPUTER : HIST_HUMAN;
+    if (historyAppend(&s->history, &h) < 0) {
+        perror("ERROR appending to history");
+        historyClose(&s->history);
+    }
+}
+
+static void unqueueAway(struct server *s, struct match *m) {
+    if (m->away < 0)
+        return;
+    if (m->away_prev)
+        m->away_prev->away_next = m->away_next;
+    else
+        s->away_head = m->away_next;
+    if (m->away_next)
+        m->away_next->away_prev = m->away_prev;
+    else
+        s->away_tail = m->away_prev;
+    m->away = -1;
+}
+
+void serverAwayMatch(struct server *s, struct match *m, int player_id, long deadline) {
+    struct match *after;
+
+    m->players[player_id] = NULL;
+    m->away = player_id;
+    m->away_deadline = deadline;
+    /* Normally last; ones taken over from another server may not be. */
+    for (after = s->away_tail; after && after->away_deadline > deadline; after = after->away_prev)
+        ;
+    m->away_prev = after;
+    m->away_next = after ? after->away_next : s->away_head;
+    if (m->away_next)
+        m->away_next->away_prev = m;
+    else
+        s->away_tail = m;
+    if (after)
+        after->away_next = m;
+    else
+        s->away_head = m;
+}
+
+static void endMatch(struct server *s, struct match *m) {
+    recordMatch(s, m);
+    removeToken(s, m);
+    unqueueAway(s, m);
+    for (int i = 0; i < 2; i++) {
+        if (m->players[i]) {
+            printf("Player %d Game Over!\n", i+1);
+            lingerClient(s, m->players[i]);
+            m->players[i]->match = NULL;
         }
     }
-    /* No winner, yet. */
+    if (m->prev)
+        m->prev->next = m->next;
+    else
+        s->matches = m->next;
+    if (m->next)
+        m->next->prev = m->prev;
+    s->nmatches--;
+    free(m);
+}
+
+static int startAi(struct server *s) {
+    int threads = s->ai.threads;
+
+    if (s->ai.engine)
+        return 0;
+    if (threads <= 0) {
+        threads = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+        threads = threads > 0 ? threads : 1;
+    }
+    s->ai.kind = SOURCE_AI;
+    if ((s->ai.engine = mctsCreate(threads, AI_NODES)) == NULL)
+        return -1;
+    watch(s, mctsEventFd(s->ai.engine), &s->ai);
+    printf("Computer player started, %d threads.\n", threads);
     return 0;
 }
-void runGame(int cli_sockfd, int player_id, int sem[], char board[][3]) {
-  struct sembuf pop = {0, 0, -1},
-                vop = {0, 0, 1};
-
-//   pop.sem_num=0;
-//   vop.sem_num=0;
-//   pop.sem_flg=0;
-//   vop.sem_flg=0;
-//   pop.sem_op=-1;
-//   vop.sem_op=1;
-
-  int game_over = 0;
-  int turn_count = 0;
-  int looser = 0;
-  while (!game_over) {
-    int valid = 0;
-    int move = 0;
-    WAIT(sem[player_id]);
-
-    sendBoard(cli_sockfd, board);
-    if (board[3][0] == 1)
-      game_over = 2, valid = 1;
-    else if(board[3][0] == 2)
-      valid = 1, turn_count = 4;
-    while (!valid) {
-
-        move = getPlayerMove(cli_sockfd);
-      if (move == -1)
-        break;
-
-      printf("Player %d played position %d\n", player_id+1, move);
-
-      valid = checkMove(board, move, player_id);
-
-      if (!valid) { /* Move was invalid. */
-          printf("Move was invalid. Let's try this again...\n");
-          writeClientMsg(cli_sockfd, "INV");
-      }
-    }
-    if (move == -1) { /* Error reading from client. */
-          printf("Player disconnected.\n");
-          break;
-    } else if(game_over == 2) {
-      writeClientMsg(cli_sockfd, "LSE");
-    } else if (turn_count == 4) { /* There have been nine valid moves and no winner, game is a draw. */
+
+/* Hands the position to the engine; the move comes back in handleAi. */
+static void thinkBot(struct server *s, struct client *bot) {
+    const struct game *g = &bot->match->g;
+    struct mcts_board b;
+
+    b.side = b.k = 3;
+    b.to_move = g->turn;
+    for (int i = 0; i < BOARD_CELLS; i++) {
+        char cell = g->board[i / 3][i % 3];
+        b.cells[i] = cell == 'O' ? 0 : cell == 'X' ? 1 : MCTS_EMPTY;
+    }
+    if (mctsSubmit(s->ai.engine, &b, s->ai.move_ms, AI_MAX_PLAYOUTS, bot) < 0)
+        error("ERROR submitting a search");
+    bot->thinking = 1;
+}
+
+static void sendTurn(struct server *s, struct client *c) {
+    if (c->bot) {
+        c->awaiting_move = 1;
+        thinkBot(s, c);
+        return;
+    }
+    if (c->conn.features & FEATURE_TURN)
+        sendPly(c, &c->match->g, MSG_TRN);
+    else
+        writeClientMsg(c, "TRN");
+    c->awaiting_move = 1;
+    if (c->trace_id)
+        traceWrite(&s->trace, TRACE_TURN, c->trace_id, 0, NULL, 0);
+}
+
+/* Sends WIN, LSE or DRW. */
+static void sendResult(struct server *s, struct client *c, int type) {
+    if (c->conn.features & FEATURE_TURN)
+        sendPly(c, &c->match->g, type);
+    else
+        writeClientMsg(c, (char *)protoTag(type));
+    if (c->trace_id)
+        traceWrite(&s->trace, TRACE_RESULT, c->trace_id, type, NULL, 0);
+}
+
+/* Sends the board and asks the player to move. A player that is away
+ * gets both when it is back. */
+static void startTurn(struct server *s, struct match *m) {
+    struct client *p = m->players[m->g.turn];
+
+    if (p == NULL)
+        return;
+    sendState(p, &m->g);
+    sendTurn(s, p);
+}
+
+static void playMove(struct server *s, struct client *c, int move) {
+    struct match *m = c->match;
+    struct client *other = m->players[!c->player_id];
+    int result, valid;
+
+    printf("Player %d played position %d\n", c->player_id+1, move);
+    profBegin(&s->prof, PROF_VALIDATE);
+    valid = m->g.status == GAME_RUNNING && m->g.turn == c->player_id &&
+            checkMove(m->g.board, move, c->player_id);
+    profEnd(&s->prof, PROF_VALIDATE);
+    profBegin(&s->prof, PROF_APPLY);
+    result = valid ? gamePlay(&m->g, c->player_id, move) : MOVE_INVALID;
+    profEnd(&s->prof, PROF_APPLY);
+    if (result == MOVE_INVALID) { /* Move was invalid. */
+        printf("Move was invalid. Let's try this again...\n");
+        if (c->conn.features & FEATURE_TURN) {
+            /* The turn goes with it. */
+            sendPly(c, &m->g, MSG_INV);
+            c->awaiting_move = 1;
+            if (c->trace_id)
+                traceWrite(&s->trace, TRACE_TURN, c->trace_id, 0, NULL, 0);
+            return;
+        }
+        writeClientMsg(c, "INV");
+        sendTurn(s, c);
+        return;
+    }
+    c->awaiting_move = 0;
+
+    sendState(c, &m->g);
+    drawBoard(m->g.board);
+
+    if (result == MOVE_WIN) { /* We have a winner. */
+        sendResult(s, c, MSG_WIN);
+        printf("Player %d won.\n", c->player_id+1);
+        if (other) {
+            sendState(other, &m->g);
+            sendResult(s, other, MSG_LSE);
+        }
+        endMatch(s, m);
+    } else if (result == MOVE_DRAW) { /* Nine valid moves and no winner, game is a draw. */
         printf("Draw.\n");
-        writeClientMsg(cli_sockfd, "DRW");
-        board[3][0] = 2;
-        game_over = 1;
+        sendResult(s, c, MSG_DRW);
+        if (other) {
+            sendState(other, &m->g);
+            sendResult(s, other, MSG_DRW);
+        }
+        endMatch(s, m);
     } else {
-      updateBoard(board, move, player_id);
-      sendBoard( cli_sockfd, board);
-       drawBoard(board);
-       printf("checking board player %d count %d\n", player_id+1, turn_count);
-       game_over = checkBoard(board, move);
-
-        if (game_over == 1) { /* We have a winner. */
-            board[3][0] = 1;
-            writeClientMsg(cli_sockfd, "WIN");
-            printf("Player %d won.\n", player_id+1);
+        startTurn(s, m);
+    }
+}
+
+/* The client that waited is player 1, the other one player 2. */
+static void startMatch(struct server *s, struct client *first, struct client *second) {
+    struct match *m;
+    struct game g;
+
+    gameInit(&g);
+    m = serverAddMatch(s, s->next_match_id, &g, NULL);
+    m->players[0] = first;
+    m->players[1] = second;
+    for (int i = 0; i < 2; i++) {
+        struct msg tok = { MSG_TOK };
+
+        m->players[i]->state = CLIENT_PLAYING;
+        m->players[i]->match = m;
+        m->players[i]->player_id = i;
+        tok.token = m->secret[i];
+        if (m->players[i]->conn.features & FEATURE_RESUME) {
+            sendMsg(m->players[i], &tok);
+            if (m->players[i]->trace_id)
+                traceWriteValue(&s->trace, TRACE_TOKEN, m->players[i]->trace_id, tok.token);
         }
+    }
+    /* Player 2 opens every game. */
+    startTurn(s, m);
+}
+
+static struct client *newBot(void) {
+    struct client *bot = calloc(1, sizeof(*bot));
 
+    if (bot == NULL)
+        error("ERROR allocating client");
+    bot->kind = SOURCE_CLIENT;
+    bot->bot = 1;
+    connInit(&bot->conn, -1);
+    bot->seq = -1;
+    bot->hello_deadline = -1;
+    bot->slow_deadline = -1;
+    bot->live_deadline = -1;
+    return bot;
+}
+
+void serverAddBot(struct server *s, struct match *m, int player_id) {
+    struct client *bot = newBot();
+
+    if (startAi(s) < 0)
+        error("ERROR starting the computer player");
+    bot->state = CLIENT_PLAYING;
+    bot->match = m;
+    bot->player_id = player_id;
+    m->players[player_id] = bot;
+    if (m->g.status == GAME_RUNNING && m->g.turn == player_id)
+        sendTurn(s, bot);
+}
+
+/* The client opens, the computer is player 1. */
+static void playComputer(struct server *s, struct client *c) {
+    if (startAi(s) < 0) {
+        writeClientMsg(c, "NRM");
+        return;
     }
-    turn_count++;
-    SIGNAL(sem[!player_id]);
+    printf("Player is playing the computer.\n");
+    startMatch(s, newBot(), c);
 }
+
+/* Moves the engine came up with. */
+static void handleAi(struct server *s) {
+    struct mcts_result r;
+
+    while (mctsPoll(s->ai.engine, &r)) {
+        struct client *bot = r.tag;
+
+        bot->thinking = 0;
+        if (bot->state == CLIENT_CLOSED) {
+            /* Its game ended while it was thinking. */
+            bot->next = s->closed;
+            s->closed = bot;
+            continue;
+        }
+        printf("Computer thought %ld ms, %ld playouts.\n", r.elapsed_us / 1000, r.playouts);
+        bot->awaiting_move = 0;
+        playMove(s, bot, r.move);
+    }
 }
 
-void resetBoard(char board[][3]) {
-  for (size_t i = 0; i < 3; i++) {
-    for (size_t j = 0; j < 3; j++) {
-      board[i][j] = ' ';
+/* Pairs a client with the one waiting, or makes it wait. */
+static void matchmake(struct server *s, struct client *c) {
+    struct client *waiting = s->waiting;
+
+    if (waiting == NULL) {
+        c->state = CLIENT_WAITING;
+        s->waiting = c;
+        printf("Waiting for player2...\n");
+        return;
     }
-  }
-  board[3][0] = 0;
+    s->waiting = NULL;
+    startMatch(s, waiting, c);
 }
 
-int main(int argc, char *argv[]) {
+/* Random, so that a code cannot be guessed from the ones before it. */
+static unsigned roomCode(void) {
+    unsigned code;
 
-  if(argc < 2) {
-      error("ERROR PORT required");
-  }
+    if (getrandom(&code, sizeof(code), 0) != sizeof(code))
+        error("ERROR making a room code");
+    return code & ((1u << ROOM_CODE_BITS) - 1);
+}
+
+static void createRoom(struct server *s, struct client *c) {
+    struct msg m = { MSG_ROM };
+    char text[ROOM_CODE_LEN + 1];
+
+    /* A few tries in case the code is taken or its window is full. */
+    for (int tries = 0; tries < 16; tries++) {
+        unsigned code = roomCode();
+        if (code && serverAddRoom(s, c, code, nowMs() + ROOM_TTL_MS) == 0) {
+            c->state = CLIENT_HOSTING;
+            m.code = code;
+            sendMsg(c, &m);
+            if (c->trace_id)
+                traceWriteValue(&s->trace, TRACE_ROOM, c->trace_id, code);
+            protoFormatCode(code, text);
+            printf("Room %s created.\n", text);
+            return;
+        }
+    }
+    printf("No room left.\n");
+    writeClientMsg(c, "NRM");
+}
 
-  int server_sockfd = setupListener(strtol(argv[1], NULL, 10));
-  struct sockaddr_in address;
-  int addrlen = sizeof(address);
-  int sem[2];
-  sem[0] = semget(IPC_PRIVATE,1,0777|IPC_CREAT);
-  sem[1] = semget(IPC_PRIVATE,1,0777|IPC_CREAT);
+static void joinRoom(struct server *s, struct client *c, unsigned code) {
+    struct client *host;
+    uint32_t index;
 
-  semctl(sem[0],0,SETVAL,0);
-  semctl(sem[1],0,SETVAL,1);
+    if (s->rooms == NULL || !roomIndexTake(&s->room_index, code, &index)) {
+        writeClientMsg(c, "NRM");
+        return;
+    }
+    host = s->rooms[index].host;
+    freeRoom(s, &s->rooms[index]);
+    printf("Player joined a room.\n");
+    startMatch(s, host, c);
+}
 
-  // char (*board)[3];
-  int shmid = shmget(IPC_PRIVATE, 12*sizeof(char), 0777|IPC_CREAT);
-  char (*board)[3] = shmat(shmid, 0, 0);
+/* Rooms nobody joined in time; their hosts are back in the lobby. */
+static void expireRooms(struct server *s) {
+    long now = nowMs();
 
+    while (s->rooms_head && s->rooms_head->deadline <= now) {
+        struct client *host = s->rooms_head->host;
 
+        closeRoom(s, s->rooms_head);
+        host->state = CLIENT_LOBBY;
+        writeClientMsg(host, "NRM");
+        printf("Room expired.\n");
+    }
+}
 
+/* The player is gone for good: the opponent, if it is still there, wins
+ * and keeps its connection until it has the result. */
+static void forfeit(struct server *s, struct match *m, int loser) {
+    struct client *other = m->players[!loser];
 
-  while (1) {
-    resetBoard(board);
-    printf("Waiting for Player 1\n");
-    int player_1 = accept(server_sockfd, (struct sockaddr *)&address, (socklen_t*)&addrlen);
+    printf("Player %d forfeits.\n", loser+1);
+    if (other) {
+        other->awaiting_move = 0;
+        sendState(other, &m->g);
+        sendResult(s, other, MSG_WIN);
+    }
+    endMatch(s, m);
+}
 
-    if (player_1 < 0)
-      error("Player1 Accept Error");
+/* A player whose connection is gone. One that can resume is waited for,
+ * and the opponent told; otherwise, or if both are gone, the game ends. */
+static void leaveMatch(struct server *s, struct client *c) {
+    struct match *m = c->match;
+    struct client *other = m->players[!c->player_id];
 
+    printf("Player disconnected.\n");
+    if (m->away >= 0) {
+        endMatch(s, m);
+    } else if (!(c->conn.features & FEATURE_RESUME) || m->g.status != GAME_RUNNING) {
+        forfeit(s, m, c->player_id);
+    } else {
+        printf("Waiting for player %d to come back.\n", c->player_id+1);
+        serverAwayMatch(s, m, c->player_id, nowMs() + RESUME_GRACE_MS);
+        if (other && other->conn.features & FEATURE_RESUME)
+            writeClientMsg(other, "AWY");
+    }
+}
 
-    if (fork() == 0) {
-      close(server_sockfd);
+/* A lobby client with a resume token takes its seat back. A connection
+ * still in the seat is taken for a dead one the server has not noticed
+ * yet, unless it was heard from within HEARTBEAT_TIMEOUT_MS. */
+static void resumeMatch(struct server *s, struct client *c, unsigned long long token) {
+    struct match *m = findToken(s, token);
+    int id = token & 1;
+    struct client *old = m ? m->players[id] : NULL, *other;
 
-      printf("Player1 connected at port: %d\n", ntohs(address.sin_port));
-      // printf("client address: %s\n", inet_ntoa(address.sin_addr));
-      if (1) {
-        printf("Waiting for player2...\n");
-      }
+    if (m == NULL || m->g.status != GAME_RUNNING ||
+        (old && (old->bot || old->live_deadline < 0 || old->live_deadline > nowMs()))) {
+        writeClientMsg(c, "NRM");
+        return;
+    }
+    other = m->players[!id];
+    if (old) {
+        /* Its seat and what was queued for it are no longer its own. */
+        old->match = NULL;
+        old->out_len = 0;
+        closeClient(s, old);
+    } else
+        unqueueAway(s, m);
+    m->players[id] = c;
+    c->state = CLIENT_PLAYING;
+    c->match = m;
+    c->player_id = id;
+    c->seq = -1;
+    printf("Player %d is back.\n", id+1);
+    if (!old && other && other->conn.features & FEATURE_RESUME)
+        writeClientMsg(other, "BAK");
+    if (m->g.turn == id)
+        startTurn(s, m);
+    else if (c->conn.features & FEATURE_TURN)
+        sendPly(c, &m->g, MSG_WAT);
+    else
+        sendState(c, &m->g);
+}
+
+static void dropClient(struct server *s, struct client *c) {
+    closeClient(s, c);
+    if (c->match)
+        leaveMatch(s, c);
+    c->match = NULL;
+}
+
+/* FEATURE_RESUME clients that went quiet. */
+static void expireLive(struct server *s) {
+    long now = nowMs();
+
+    while (s->live_head && s->live_head->live_deadline <= now) {
+        printf("Player missed its heartbeats.\n");
+        dropClient(s, s->live_head);
+    }
+}
+
+/* Players that did not come back in time. */
+static void expireAway(struct server *s) {
+    long now = nowMs();
+
+    while (s->away_head && s->away_head->away_deadline <= now)
+        forfeit(s, s->away_head, s->away_head->away);
+}
+
+/* Whether a client may start a new game: not past the cap on games, nor
+ * while the loop lags. One that may not gets BSY and is closed. Players
+ * coming back to their game are not asked. */
+static int admitGame(struct server *s, struct client *c) {
+    struct admission *a = &s->admit;
+    int reason = -1;
+
+    if (a->lag_ms > LAG_SHED_MS)
+        reason = SHED_LAG;
+    else if (a->max_games && s->nmatches >= a->max_games)
+        reason = SHED_GAMES;
+    if (reason < 0)
+        return 1;
+    a->shed[reason]++;
+    writeClientMsg(c, "BSY");
+    lingerClient(s, c);
+    return 0;
+}
+
+static void helloDone(struct server *s, struct client *c) {
+    unqueueHello(s, c);
+    touchClient(s, c);
+    if (connEventFd(&c->conn) >= 0)
+        watch(s, connEventFd(&c->conn), c);
+    if (c->conn.features & FEATURE_LOBBY)
+        c->state = CLIENT_LOBBY;
+    else if (admitGame(s, c))
+        matchmake(s, c);
+}
+
+static void consume(struct client *c, int n) {
+    c->in_len -= n;
+    memmove(c->in, c->in + n, c->in_len);
+}
+
+/* Handles the complete frames in the input buffer. Returns -1 if the
+ * client has to go. */
+static int processInput(struct server *s, struct client *c) {
+    int move;
+
+    while (c->state != CLIENT_CLOSED) {
+        if (c->state == CLIENT_HELLO) {
+            if (c->in_len < HELLO_LEN)
+                return 0;
+            if (connAnswerHello(&c->conn, c->in, FEATURES_ALL) < 0)
+                return -1;
+            consume(c, HELLO_LEN);
+            helloDone(s, c);
+            continue;
+        }
+
+        if (protoDecodeMove(c->in, c->in_len, &move) == 0)
+            return 0;
+        if (move == HEARTBEAT) {
+            consume(c, sizeof(int));
+            continue;
+        }
+        if (c->state == CLIENT_LOBBY && move == ROOM_RESUME) {
+            unsigned long long token;
 
-      runGame(player_1, 0, sem, board);
+            if (protoDecodeResume(c->in, c->in_len, &token) == 0)
+                return 0;
+            consume(c, RESUME_LEN);
+            resumeMatch(s, c, token);
+            continue;
+        }
+        if (c->state == CLIENT_LOBBY) {
+            consume(c, sizeof(int));
+            if ((move == ROOM_CREATE || move == ROOM_ANY || move == ROOM_BOT || move > 0) && !admitGame(s, c))
+                return 0;
+            if (move == ROOM_CREATE)
+                createRoom(s, c);
+            else if (move == ROOM_ANY)
+                matchmake(s, c);
+            else if (move == ROOM_BOT)
+                playComputer(s, c);
+            else if (move > 0)
+                joinRoom(s, c, move);
+            else if (move != RESYNC_REQUEST)
+                return -1;
+            continue;
+        }
+        if (move == RESYNC_REQUEST) { /* The client missed an update. */
+            if (c->match)
+                sendSnapshot(c, &c->match->g);
+            consume(c, sizeof(int));
+            continue;
+        }
+        if (!c->awaiting_move) /* Keep it for its turn, unless it floods us. */
+            return c->in_len == CLIENT_IN_LEN ? -1 : 0;
+
+        consume(c, sizeof(int));
+        playMove(s, c, move);
+    }
+    return 0;
+}
+
+/* A client that failed or stayed slow too long: it forfeits or takes
+ * its opponent down with it, by the slow client policy. */
+static void dropSlowClient(struct server *s, struct client *c) {
+    struct match *m = c->match;
 
-      printf("Player 1 Game Over!\n");
-      close(player_1);
-      exit(0);
+    if (!c->failed)
+        printf("Client too slow to read.\n");
+    closeClient(s, c);
+    if (m == NULL)
+        return;
+    if (s->slow_policy == SLOW_DISCONNECT) {
+        printf("Player disconnected.\n");
+        endMatch(s, m);
     } else {
-        resetBoard(board);
-        int player_2 = accept(server_sockfd, (struct sockaddr *)&address, (socklen_t*)&addrlen);
+        forfeit(s, m, c->player_id);
+    }
+}
+
+/* Deals with write failures and clients past their deadline. */
+static void checkBacklog(struct server *s) {
+    long now = nowMs();
+    struct client *c;
+
+again:
+    for (c = s->backlog; c; c = c->out_next) {
+        if (c->failed || (c->slow_deadline >= 0 && c->slow_deadline <= now)) {
+            /* Takes c, maybe its opponent too, off the list. */
+            dropSlowClient(s, c);
+            goto again;
+        }
+    }
+}
+
+static void handleClient(struct server *s, struct client *c) {
+    if (c->state == CLIENT_CLOSED)
+        return;
+    flushOutput(s, c);
+    while (c->state != CLIENT_CLOSED) {
+        int room = CLIENT_IN_LEN - c->in_len;
+        int n;
+
+        profBegin(&s->prof, PROF_PARSE);
+        n = connReadSome(&c->conn, c->in + c->in_len, room);
+        profEnd(&s->prof, PROF_PARSE);
+
+        if (n < 0 || (n == 0 && room == 0)) {
+            dropClient(s, c);
+            return;
+        }
+        if (n == 0)
+            return;
+        touchClient(s, c);
+        if (c->trace_id)
+            traceWrite(&s->trace, TRACE_DATA, c->trace_id, 0, c->in + c->in_len, n);
+        c->in_len += n;
+        if (processInput(s, c) < 0) {
+            dropClient(s, c);
+            return;
+        }
+        if (!c->conn.shm && n < room) /* Drained the socket. */
+            return;
+    }
+}
+
+/* Returns the SHED_ reason to turn a new connection away, or -1. */
+static int admit(struct server *s, struct listener *l, const struct sockaddr_in *address, long now) {
+    struct admission *a = &s->admit;
+
+    /* Everybody's bucket first, so a connection it turns away does not
+     * cost its address a token as well. */
+    if (!bucketTake(&a->global, now, a->global_rate, 2 * a->global_rate))
+        return SHED_GLOBAL;
+    if (!l->is_unix && !addrTake(&a->addrs, address->sin_addr.s_addr, now, a->addr_rate, 2 * a->addr_rate))
+        return SHED_ADDR;
+    return -1;
+}
+
+/* Turns a connection away. Hello clients read BSY as the answer to their
+ * hello, legacy ones as a message. */
+static void shed(struct server *s, int fd, int reason) {
+    char reply[HELLO_LEN] = HELLO_BSY;
+
+    (void)!send(fd, reply, sizeof(reply), MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(fd);
+    s->admit.shed[reason]++;
+}
+
+static long shedCount(struct admission *a) {
+    return a->shed[SHED_LAG] + a->shed[SHED_GAMES] + a->shed[SHED_ADDR] + a->shed[SHED_GLOBAL];
+}
+
+/* Sums up what was shed since the last time, at most every REPORT_MS. */
+static void reportShed(struct server *s) {
+    struct admission *a = &s->admit;
+    long now = nowMs();
+
+    if (now < a->report_at)
+        return;
+    a->report_at = now + REPORT_MS;
+    if (shedCount(a) == 0)
+        return;
+    printf("Turned away: %ld lagging, %ld too many games, %ld per address, %ld global (loop %.1f ms).\n",
+           a->shed[SHED_LAG], a->shed[SHED_GAMES], a->shed[SHED_ADDR], a->shed[SHED_GLOBAL], a->lag_ms);
+    memset(a->shed, 0, sizeof(a->shed));
+}
+
+static void acceptClients(struct server *s, struct listener *l) {
+    struct sockaddr_in address;
+    socklen_t addrlen = sizeof(address);
+    struct conn conn;
+    struct client *c;
+    long now = nowMs();
+    int fd, count = 0, reason;
+
+    /* What is left waits for the next pass, after the games. */
+    while (count++ < ACCEPT_BATCH &&
+           (fd = accept4(l->fd, (struct sockaddr *)&address, &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        addrlen = sizeof(address);
+        if ((reason = admit(s, l, &address, now)) >= 0) {
+            shed(s, fd, reason);
+            continue;
+        }
+        connInit(&conn, fd);
+        if (l->is_unix) {
+            printf("Player connected on the unix socket\n");
+            c = serverAddClient(s, &conn, CLIENT_HELLO, -1);
+        } else {
+            /* A turn is one small frame each way; don't hold it back. */
+            int option = 1, idle = KEEPALIVE_IDLE, interval = KEEPALIVE_INTERVAL, probes = KEEPALIVE_COUNT;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &option, sizeof(option));
+            /* Hosts that vanish without a FIN or RST. */
+            setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &option, sizeof(option));
+            setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+            setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+            setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &probes, sizeof(probes));
+            /* Legacy clients send nothing until asked for a move. */
+            printf("Player connected at port: %d\n", ntohs(address.sin_port));
+            c = serverAddClient(s, &conn, CLIENT_HELLO, nowMs() + HELLO_WAIT_MS);
+        }
+        if (s->trace.f) {
+            c->trace_id = ++s->next_trace_id;
+            traceWrite(&s->trace, TRACE_OPEN, c->trace_id, l->is_unix ? TRACE_UNIX : 0, NULL, 0);
+        }
+    }
+    if (count > ACCEPT_BATCH)
+        return;
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED && errno != EINTR)
+        perror("ERROR accepting player");
+}
+
+/* TCP clients that sent no hello in time are legacy clients. */
+static void expireHellos(struct server *s) {
+    long now = nowMs();
+
+    while (s->hello_head && s->hello_head->hello_deadline <= now)
+        helloDone(s, s->hello_head);
+}
+
+static void setupControl(struct server *s, const char *path) {
+    struct sockaddr_un addr = { 0 };
+
+    s->control.kind = SOURCE_CONTROL;
+    s->control.path = path;
+    s->control.fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (s->control.fd < 0)
+        error("ERROR opening control socket");
+    if (strlen(path) >= sizeof(addr.sun_path))
+        error("ERROR control socket path too long");
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if (bind(s->control.fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(s->control.fd, 1) < 0)
+        error("ERROR binding control socket");
+    watch(s, s->control.fd, &s->control);
+}
+
+/* Serves a takeover request. Only returns if the handover failed. */
+static void handleControl(struct server *s) {
+    int fd = accept4(s->control.fd, NULL, NULL, SOCK_CLOEXEC);
+
+    if (fd < 0)
+        return;
+    printf("Handing over to a new server...\n");
+    fflush(stdout);
+    if (s->trace.f)
+        traceFlush(&s->trace);
+    if (handoverSend(s, fd) == 0) {
+        profReport(&s->prof, stdout);
+        fflush(stdout);
+        _exit(0);
+    }
+    close(fd);
+}
+
+/* Answers admin connections with a line of status. The line fits in any
+ * socket buffer, so the connection is closed right away. */
+static void handleAdmin(struct server *s) {
+    struct admission *a = &s->admit;
+    char line[128];
+    int fd, len;
+    int busy = a->lag_ms > LAG_SHED_MS || (a->max_games && s->nmatches >= a->max_games);
+
+    len = snprintf(line, sizeof(line), "%s games %d waiting %d rooms %d lag %.1f\n",
+                   busy ? "BUSY" : "OK", s->nmatches, s->waiting != NULL,
+                   s->nrooms, a->lag_ms);
+    while ((fd = accept4(s->admin.fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        (void)!send(fd, line, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        close(fd);
+    }
+}
 
-        if (player_2 < 0)
-          error("Player2 Accept Error");
-        printf("Player2 connected at port: %d\n", ntohs(address.sin_port));
-        runGame(player_2, 1, sem, board);
-        printf("Player 2 Game Over!\n");
-        close(player_2);
+static void freeClosed(struct server *s) {
+    while (s->closed) {
+        struct client *c = s->closed;
+        s->closed = c->next;
+        free(c->out);
+        free(c);
     }
+}
+
+int main(int argc, char *argv[]) {
+  struct server *s = &srv;
+  struct epoll_event events[MAX_EVENTS];
+  const char *unix_path = NULL, *control_path = NULL, *takeover_path = NULL;
+  const char *trace_path = NULL, *history_path = NULL;
+  int opt, admin_port = 0, prof_every = 0;
 
+  s->ai.move_ms = AI_MOVE_MS;
+
+  s->admit.addr_rate = ADDR_RATE;
+  s->admit.global_rate = GLOBAL_RATE;
+  s->admit.max_games = MAX_GAMES;
+  while ((opt = getopt(argc, argv, "u:c:T:p:r:R:G:g:a:A:t:H:P:")) != -1) {
+    if (opt == 'u')
+      unix_path = optarg;
+    else if (opt == 'A')
+      s->ai.move_ms = strtol(optarg, NULL, 10);
+    else if (opt == 't')
+      s->ai.threads = strtol(optarg, NULL, 10);
+    else if (opt == 'a')
+      admin_port = strtol(optarg, NULL, 10);
+    else if (opt == 'R')
+      s->admit.addr_rate = strtol(optarg, NULL, 10);
+    else if (opt == 'G')
+      s->admit.global_rate = strtol(optarg, NULL, 10);
+    else if (opt == 'g')
+      s->admit.max_games = strtol(optarg, NULL, 10);
+    else if (opt == 'p' && !strcmp(optarg, "forfeit"))
+      s->slow_policy = SLOW_FORFEIT;
+    else if (opt == 'p' && !strcmp(optarg, "disconnect"))
+      s->slow_policy = SLOW_DISCONNECT;
+    else if (opt == 'c')
+      control_path = optarg;
+    else if (opt == 'r')
+      trace_path = optarg;
+    else if (opt == 'H')
+      history_path = optarg;
+    else if (opt == 'P')
+      prof_every = strtol(optarg, NULL, 10);
+    else if (opt == 'T')
+      takeover_path = optarg;
+    else
+      error("Usage : ./server.out [-u unix socket path] [-c control path] [-p forfeit|disconnect] [-r trace file] [-R rate] [-G rate] [-g games] [-a admin port] [-A ms] [-t threads] [-H history dir] [-P n] <port> | -T <control path>");
+  }
+  if(optind >= argc && !takeover_path) {
+      error("ERROR PORT required");
+  }
+
+  /* Write errors are handled where they happen. */
+  signal(SIGPIPE, SIG_IGN);
+  sigset_t wait_mask;
+  sigprocmask(SIG_SETMASK, NULL, &wait_mask);
+  if (prof_every) {
+    /* Only let through while waiting for events, so none is missed. */
+    struct sigaction sa = { .sa_handler = onProfSignal };
+    sigset_t mask = wait_mask;
+    if (profOpen(&s->prof, prof_every) < 0)
+      error("ERROR opening performance counters");
+    sigaction(SIGUSR1, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaddset(&mask, SIGUSR1);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+  }
+  s->epfd = epoll_create1(EPOLL_CLOEXEC);
+  s->control.fd = -1;
+  s->admin.fd = -1;
+  if (s->epfd < 0)
+    error("ERROR creating epoll instance");
+
+  if (takeover_path) {
+    if (handoverReceive(s, takeover_path) < 0)
+      error("ERROR taking over from the running server");
+  } else {
+    serverAddListener(s, setupListener(strtol(argv[optind], NULL, 10)), LISTENER_TCP);
+    if (unix_path)
+      serverAddListener(s, setupUnixListener(unix_path), LISTENER_UNIX);
+  }
+  /* A new binary keeps the admin port of the old one. */
+  if (admin_port && s->admin.fd < 0)
+    serverAddListener(s, setupListener(admin_port), LISTENER_ADMIN);
+  if (control_path)
+    setupControl(s, control_path);
+  /* Connections taken over from another server are not traced. */
+  if (trace_path && traceOpen(&s->trace, trace_path) < 0)
+    error("ERROR creating trace file");
+  /* The old server holds the store until it exits, right after the
+   * handover. */
+  for (int tries = 0; history_path && historyOpen(&s->history, history_path) < 0; tries++) {
+    if (!takeover_path || tries == HISTORY_WAIT_MS / 10)
+      error("ERROR opening history");
+    usleep(10000);
+  }
+
+  /* Pick up where the old server left off: frames it had read already
+   * and whatever arrived during the handover. */
+  int nclients = 0, i = 0;
+  for (struct client *c = s->clients; c; c = c->next)
+    nclients++;
+  struct client **resumed = malloc((nclients + 1) * sizeof(*resumed));
+  if (resumed == NULL)
+    error("ERROR allocating client list");
+  for (struct client *c = s->clients; c; c = c->next)
+    resumed[i++] = c;
+  for (i = 0; i < nclients; i++) {
+    if (resumed[i]->failed)
+      failClient(s, resumed[i]);
+    if (resumed[i]->state == CLIENT_DRAINING && resumed[i]->out_len == 0)
+      closeClient(s, resumed[i]);
+    if (resumed[i]->state != CLIENT_CLOSED && processInput(s, resumed[i]) < 0)
+      dropClient(s, resumed[i]);
+    if (resumed[i]->state != CLIENT_CLOSED)
+      handleClient(s, resumed[i]);
+  }
+  free(resumed);
+  checkBacklog(s);
+  freeClosed(s);
+
+  while (1) {
+    int timeout = -1;
+
+    fflush(stdout);
+    if (s->trace.f)
+      traceFlush(&s->trace);
+    long next = s->hello_head ? s->hello_head->hello_deadline : -1;
+    if (s->rooms_head && (next < 0 || s->rooms_head->deadline < next))
+      next = s->rooms_head->deadline;
+    if (s->live_head && (next < 0 || s->live_head->live_deadline < next))
+      next = s->live_head->live_deadline;
+    if (s->away_head && (next < 0 || s->away_head->away_deadline < next))
+      next = s->away_head->away_deadline;
+    for (struct client *c = s->backlog; c; c = c->out_next)
+      if (c->slow_deadline >= 0 && (next < 0 || c->slow_deadline < next))
+        next = c->slow_deadline;
+    if (shedCount(&s->admit) && (next < 0 || s->admit.report_at < next))
+      next = s->admit.report_at;
+    if (next >= 0) {
+      long left = next - nowMs();
+      timeout = left > 0 ? left : 0;
+    }
+
+    int n = epoll_pwait(s->epfd, events, MAX_EVENTS, timeout, &wait_mask);
+    if (n < 0 && errno != EINTR)
+      error("ERROR waiting for events");
+    if (prof_signal) {
+      profReport(&s->prof, stdout);
+      if (prof_signal != SIGUSR1)
+        exit(0);
+      prof_signal = 0;
+    }
+    long start = nowMs();
+    struct listener *ready[MAX_LISTENERS];
+    int nready = 0;
+
+    for (int i = 0; i < n; i++) {
+      int kind = *(int *)events[i].data.ptr;
+
+      if (kind == SOURCE_LISTENER)
+        ready[nready++] = events[i].data.ptr;
+      else if (kind == SOURCE_CLIENT)
+        handleClient(s, events[i].data.ptr);
+      else if (kind == SOURCE_CONTROL)
+        handleControl(s);
+      else if (kind == SOURCE_ADMIN)
+        handleAdmin(s);
+      else if (kind == SOURCE_AI)
+        handleAi(s);
+    }
+    /* New connections only once the games had their turn. */
+    for (int i = 0; i < nready; i++) {
+      profBegin(&s->prof, PROF_ACCEPT);
+      acceptClients(s, ready[i]);
+      profEnd(&s->prof, PROF_ACCEPT);
+    }
+    expireHellos(s);
+    expireRooms(s);
+    expireLive(s);
+    expireAway(s);
+    checkBacklog(s);
+    freeClosed(s);
 
+    /* Moving average over about eight passes. */
+    s->admit.lag_ms += (nowMs() - start - s->admit.lag_ms) / 8;
+    reportShed(s);
   }
-  shmdt(board);
-  shmctl(shmid, IPC_RMID, 0);
   return 0;
 }
@@ -0,0 +1,349 @@
+/****************************************************************************
+*       Hot restart: hands the listening sockets, every live connection
+*       and the state of every game to a new server process.
+*
+*       The running server listens on a SOCK_SEQPACKET control socket
+*       (-c). A new binary started with -T connects to it and sends
+*       "TKO" and the snapshot version. The old server stops handling
+*       events and sends a snapshot: records for the listeners, the
+*       matches and the clients, with their file descriptors attached
+*       (SCM_RIGHTS), packed into as few messages as the fd limit allows.
+*       The admin listener goes along with the others.
+*       Connections and any bytes still in the kernel are untouched, and
+*       so are the shared memory rings; output still queued for a client
+*       goes along with it, so games resume mid turn. Lobby rooms keep
+*       their codes. Games against the computer go along too; a move it
+*       was thinking about is thought about again, and resume tokens
+*       and games waiting for a player to come back stay valid; the
+*       heartbeat clock of each client starts over. The history store
+*       (-H) is not handed over: the new server opens it once the old
+*       one has exited. The old
+*       server exits once the new one acknowledges; if it never does,
+*       the old server keeps serving as if nothing happened.
+*
+*****************************************************************************/
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "server.h"
+
+#define HANDOVER_VERSION 8
+#define HANDOVER_ACK_MS  5000
+#define BATCH_LEN        65536
+#define BATCH_FDS        252    /* SCM_MAX_FD is 253. */
+
+#define REC_LISTENER 'L'
+#define REC_MATCH    'M'
+#define REC_CLIENT   'C'
+#define REC_END      'E'
+
+struct batch {
+    int fd;
+    unsigned char buf[BATCH_LEN];
+    int len;
+    int fds[BATCH_FDS];
+    int nfds;
+};
+
+static int flush(struct batch *b) {
+    int n = b->len ? sendFds(b->fd, b->buf, b->len, b->fds, b->nfds) : 0;
+    b->len = b->nfds = 0;
+    return n < 0 ? -1 : 0;
+}
+
+/* Makes room for a record of len bytes and nfds descriptors. */
+static int reserve(struct batch *b, int len, int nfds) {
+    if (b->len + len > BATCH_LEN || b->nfds + nfds > BATCH_FDS)
+        return flush(b);
+    return 0;
+}
+
+static void put8(struct batch *b, int v) {
+    b->buf[b->len++] = v;
+}
+
+static void put16(struct batch *b, int v) {
+    put8(b, v >> 8);
+    put8(b, v);
+}
+
+static void put32(struct batch *b, int v) {
+    put16(b, v >> 16);
+    put16(b, v);
+}
+
+int handoverSend(struct server *s, int ctl_fd) {
+    static struct batch b;
+    char request[4], ack[4];
+    struct pollfd pfd = { ctl_fd, POLLIN, 0 };
+    long now = nowMs();
+    int index = 0, nmatches = 0, nclients = 0;
+
+    if (recv(ctl_fd, request, sizeof(request), 0) != sizeof(request) ||
+        memcmp(request, "TKO", 3) || request[3] != HANDOVER_VERSION) {
+        printf("Refusing takeover request.\n");
+        return -1;
+    }
+
+    b.fd = ctl_fd;
+    b.len = b.nfds = 0;
+
+    for (int i = 0; i < s->nlisteners; i++) {
+        if (reserve(&b, 2, 1) < 0)
+            return -1;
+        put8(&b, REC_LISTENER);
+        put8(&b, s->listeners[i].is_unix ? LISTENER_UNIX : LISTENER_TCP);
+        b.fds[b.nfds++] = s->listeners[i].fd;
+    }
+    if (s->admin.fd >= 0) {
+        if (reserve(&b, 2, 1) < 0)
+            return -1;
+        put8(&b, REC_LISTENER);
+        put8(&b, LISTENER_ADMIN);
+        b.fds[b.nfds++] = s->admin.fd;
+    }
+
+    /* Matches are numbered in the order they are sent. */
+    for (struct match *m = s->matches; m; m = m->next, nmatches++) {
+        int bot = m->players[0] && m->players[0]->bot ? 0 : m->players[1] && m->players[1]->bot ? 1 : -1;
+
+        /* Type, id, board, game, bot, history, started, secrets, away. */
+#define REC_MATCH_LEN (1 + 4 + 9 + 5 + 1 + 8 + 8 + 16 + 1 + 4)
+        if (reserve(&b, REC_MATCH_LEN, 0) < 0)
+            return -1;
+        put8(&b, REC_MATCH);
+        put32(&b, m->id);
+        memcpy(b.buf + b.len, m->g.board, 9);
+        b.len += 9;
+        put8(&b, m->g.turn);
+        put8(&b, m->g.moves);
+        put8(&b, m->g.last_move);
+        put8(&b, m->g.status);
+        put8(&b, m->g.winner);
+        put8(&b, bot);
+        put32(&b, m->g.history >> 32);
+        put32(&b, m->g.history);
+        put32(&b, (unsigned long long)m->started >> 32);
+        put32(&b, m->started);
+        for (int i = 0; i < 2; i++) {
+            put32(&b, m->secret[i] >> 32);
+            put32(&b, m->secret[i]);
+        }
+        put8(&b, m->away);
+        put32(&b, m->away < 0 ? 0 : m->away_deadline > now ? m->away_deadline - now : 0);
+        m->slot = index++;
+    }
+
+    for (struct client *c = s->clients; c; c = c->next, nclients++) {
+        int fds[CONN_MAX_FDS];
+        int nfds = connExport(&c->conn, fds);
+
+        if (reserve(&b, 32 + c->in_len + c->out_len, nfds) < 0)
+            return -1;
+        put8(&b, REC_CLIENT);
+        put8(&b, nfds);
+        put8(&b, c->conn.features);
+        put8(&b, c->state);
+        put32(&b, c->match ? c->match->slot : -1);
+        put8(&b, c->player_id);
+        put16(&b, c->seq);
+        put8(&b, c->awaiting_move);
+        put32(&b, c->hello_deadline < 0 ? -1 : c->hello_deadline > now ? c->hello_deadline - now : 0);
+        put8(&b, c->in_len);
+        memcpy(b.buf + b.len, c->in, c->in_len);
+        b.len += c->in_len;
+        put8(&b, c->failed);
+        put32(&b, c->slow_deadline < 0 ? -1 : c->slow_deadline > now ? c->slow_deadline - now : 0);
+        put16(&b, c->out_len);
+        if (c->out_len)     /* The queue is only allocated once used. */
+            memcpy(b.buf + b.len, c->out, c->out_len);
+        b.len += c->out_len;
+        put32(&b, c->room ? c->room->code : 0);
+        put32(&b, c->room ? (c->room->deadline > now ? c->room->deadline - now : 0) : 0);
+        memcpy(b.fds + b.nfds, fds, nfds * sizeof(int));
+        b.nfds += nfds;
+    }
+
+    if (reserve(&b, 1, 0) < 0)
+        return -1;
+    put8(&b, REC_END);
+    if (flush(&b) < 0)
+        return -1;
+
+    /* The new process has everything once it says so. */
+    if (poll(&pfd, 1, HANDOVER_ACK_MS) <= 0 || recv(ctl_fd, ack, sizeof(ack), 0) != 3 || memcmp(ack, "ACK", 3)) {
+        printf("Takeover failed, still serving.\n");
+        return -1;
+    }
+    printf("Handed over %d games and %d connections.\n", nmatches, nclients);
+    return 0;
+}
+
+struct reader {
+    unsigned char *p, *end;
+    int *fds;
+    int nfds, next_fd;
+};
+
+static int get8(struct reader *r) {
+    return r->p < r->end ? *r->p++ : -1;
+}
+
+static int get16(struct reader *r) {
+    int hi = get8(r);
+    return (short)(hi << 8 | get8(r));
+}
+
+static int get32(struct reader *r) {
+    unsigned hi = get16(r) & 0xffff;
+    return (int)(hi << 16 | (get16(r) & 0xffff));
+}
+
+static int takeFds(struct reader *r, int *fds, int n) {
+    if (r->next_fd + n > r->nfds)
+        return -1;
+    memcpy(fds, r->fds + r->next_fd, n * sizeof(int));
+    r->next_fd += n;
+    return 0;
+}
+
+int handoverReceive(struct server *s, const char *path) {
+    static unsigned char buf[BATCH_LEN];
+    struct sockaddr_un addr = { 0 };
+    struct match **matches = NULL;
+    int nmatches = 0, cap = 0, nclients = 0, done = 0;
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    char request[4] = { 'T', 'K', 'O', HANDOVER_VERSION };
+    long start = nowMs();
+
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        send(fd, request, sizeof(request), 0) != sizeof(request))
+        return -1;
+
+    while (!done) {
+        int fds[BATCH_FDS + 1], nfds = BATCH_FDS + 1;
+        struct reader r;
+        int n;
+
+        /* recvFds wants the exact length; take whatever this message is. */
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if (poll(&pfd, 1, HANDOVER_ACK_MS) <= 0)
+            return -1;
+        n = recv(fd, buf, sizeof(buf), MSG_PEEK);
+        if (n <= 0 || recvFds(fd, buf, n, fds, &nfds) != n)
+            return -1;
+
+        r.p = buf;
+        r.end = buf + n;
+        r.fds = fds;
+        r.nfds = nfds;
+        r.next_fd = 0;
+
+        while (r.p < r.end && !done) {
+            int type = get8(&r);
+
+            if (type == REC_LISTENER) {
+                int type = get8(&r), lfd;
+                if (takeFds(&r, &lfd, 1) < 0)
+                    return -1;
+                serverAddListener(s, lfd, type);
+            } else if (type == REC_MATCH) {
+                struct game g;
+                int id = get32(&r), bot, away, away_left;
+                unsigned long long secret[2];
+                long started;
+                memcpy(g.board, r.p, 9);
+                r.p += 9;
+                g.turn = get8(&r);
+                g.moves = get8(&r);
+                g.last_move = (signed char)get8(&r);
+                g.status = get8(&r);
+                g.winner = (signed char)get8(&r);
+                bot = (signed char)get8(&r);
+                g.history = (unsigned long long)(unsigned)get32(&r) << 32;
+                g.history |= (unsigned)get32(&r);
+                started = (unsigned long long)(unsigned)get32(&r) << 32;
+                started |= (unsigned)get32(&r);
+                for (int i = 0; i < 2; i++) {
+                    secret[i] = (unsigned long long)(unsigned)get32(&r) << 32;
+                    secret[i] |= (unsigned)get32(&r);
+                }
+                away = (signed char)get8(&r);
+                away_left = get32(&r);
+                if (nmatches == cap) {
+                    cap = cap ? cap * 2 : 64;
+                    matches = realloc(matches, cap * sizeof(*matches));
+                    if (matches == NULL)
+                        return -1;
+                }
+                matches[nmatches++] = serverAddMatch(s, id, &g, secret);
+                matches[nmatches - 1]->started = started;
+                if (away >= 0)
+                    serverAwayMatch(s, matches[nmatches - 1], away, nowMs() + away_left);
+                if (bot >= 0)
+                    serverAddBot(s, matches[nmatches - 1], bot);
+            } else if (type == REC_CLIENT) {
+                int cfds[CONN_MAX_FDS];
+                int count = get8(&r), features = get8(&r), state = get8(&r);
+                int index = get32(&r), player_id = get8(&r), seq = get16(&r);
+                int awaiting = get8(&r), hello_left = get32(&r), in_len = get8(&r);
+                int failed, slow_left, out_len, room_left;
+                unsigned room_code;
+                unsigned char *in = r.p;
+                struct conn conn;
+                struct client *c;
+
+                r.p += in_len;
+                failed = get8(&r);
+                slow_left = get32(&r);
+                out_len = get16(&r) & 0xffff;
+
+                if (count < 1 || count > CONN_MAX_FDS || takeFds(&r, cfds, count) < 0 ||
+                    in_len > CLIENT_IN_LEN || out_len > OUT_LIMIT || r.p + out_len > r.end ||
+                    index >= nmatches ||
+                    connImport(&conn, cfds, count, features) < 0)
+                    return -1;
+                c = serverAddClient(s, &conn, state, hello_left < 0 ? -1 : nowMs() + hello_left);
+                c->player_id = player_id;
+                c->seq = seq;
+                c->awaiting_move = awaiting;
+                memcpy(c->in, in, in_len);
+                c->in_len = in_len;
+                if (out_len)
+                    serverQueue(s, c, r.p, out_len);
+                r.p += out_len;
+                room_code = get32(&r);
+                room_left = get32(&r);
+                if (room_code && serverAddRoom(s, c, room_code, nowMs() + room_left) < 0)
+                    return -1;
+                c->slow_deadline = slow_left < 0 ? -1 : nowMs() + slow_left;
+                c->failed = failed;
+                if (index >= 0) {
+                    c->match = matches[index];
+                    c->match->players[player_id] = c;
+                }
+                nclients++;
+            } else if (type == REC_END) {
+                done = 1;
+            } else {
+                return -1;
+            }
+        }
+    }
+    free(matches);
+
+    if (send(fd, "ACK", 3, 0) != 3)
+        return -1;
+    close(fd);
+    printf("Took over %d games and %d connections in %ld ms.\n", nmatches, nclients, nowMs() - start);
+    return 0;
+}
@@ -0,0 +1,261 @@
+/****************************************************************************
+*       Append only store of finished games: segment files and their
+*       mappings.
+*
+*****************************************************************************/
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "history.h"
+
+#define COLUMNS 8
+
+struct history_header {
+    char magic[4];
+    uint32_t version;
+    uint32_t capacity;
+    uint32_t columns;
+    uint64_t offsets[COLUMNS];
+    _Atomic uint64_t count; /* Rows written; the last thing to change. */
+};
+
+/* Bytes per row of each column, in the order of the header. */
+static const int widths[COLUMNS] = { 8, 4, 4, 8, 1, 1, 1, 1 };
+
+static long layout(uint64_t *offsets) {
+    long off = HISTORY_PAGE;
+
+    for (int c = 0; c < COLUMNS; c++) {
+        offsets[c] = off;
+        off += ((long)SEGMENT_GAMES * widths[c] + HISTORY_PAGE - 1) / HISTORY_PAGE * HISTORY_PAGE;
+    }
+    return off;
+}
+
+static void segmentPath(char *buf, int len, const char *dir, int number) {
+    snprintf(buf, len, "%s/hist-%06d.tth", dir, number);
+}
+
+/* Maps a segment, creating or emptying the file first if create is set. */
+static int mapSegment(const char *path, int writable, int create, struct history_segment *seg) {
+    struct history_header *hdr;
+    uint64_t offsets[COLUMNS];
+    long size = layout(offsets);
+    struct stat st;
+    int fd;
+    char *base;
+
+    fd = open(path, (writable ? O_RDWR : O_RDONLY) | (create ? O_CREAT | O_TRUNC : 0) | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return -1;
+    if ((create && ftruncate(fd, size) < 0) || fstat(fd, &st) < 0 || st.st_size < size) {
+        close(fd);
+        return -1;
+    }
+    base = mmap(NULL, size, PROT_READ | (writable ? PROT_WRITE : 0), MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return -1;
+
+    hdr = (struct history_header *)base;
+    if (create) {
+        memcpy(hdr->magic, HISTORY_MAGIC, 4);
+        hdr->version = HISTORY_VERSION;
+        hdr->capacity = SEGMENT_GAMES;
+        hdr->columns = COLUMNS;
+        memcpy(hdr->offsets, offsets, sizeof(offsets));
+    } else if (memcmp(hdr->magic, HISTORY_MAGIC, 4) || hdr->version != HISTORY_VERSION ||
+               hdr->capacity != SEGMENT_GAMES || hdr->columns != COLUMNS ||
+               memcmp(hdr->offsets, offsets, sizeof(offsets))) {
+        munmap(base, size);
+        errno = EINVAL;
+        return -1;
+    }
+
+    seg->base = base;
+    seg->size = size;
+    seg->header = hdr;
+    seg->count = atomic_load_explicit(&hdr->count, memory_order_acquire);
+    seg->id = (uint64_t *)(base + offsets[0]);
+    seg->start = (uint32_t *)(base + offsets[1]);
+    seg->duration = (uint32_t *)(base + offsets[2]);
+    seg->moves = (uint64_t *)(base + offsets[3]);
+    seg->length = (uint8_t *)(base + offsets[4]);
+    seg->result = (uint8_t *)(base + offsets[5]);
+    seg->player_x = (uint8_t *)(base + offsets[6]);
+    seg->player_o = (uint8_t *)(base + offsets[7]);
+    return 0;
+}
+
+static void unmapSegment(struct history_segment *seg) {
+    if (seg->base)
+        munmap(seg->base, seg->size);
+    seg->base = NULL;
+}
+
+/* A new segment is made under a temporary name and only renamed into
+ * place once its header is written, so a crash cannot leave a segment
+ * behind that has none. */
+static int createSegment(const char *dir, int number, struct history_segment *seg) {
+    char tmp[4096], path[4096];
+
+    snprintf(tmp, sizeof(tmp), "%s/hist-%06d.tmp", dir, number);
+    segmentPath(path, sizeof(path), dir, number);
+    if (mapSegment(tmp, 1, 1, seg) < 0)
+        return -1;
+    if (renameat2(AT_FDCWD, tmp, AT_FDCWD, path, RENAME_NOREPLACE) < 0) {
+        unmapSegment(seg);
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/* Segment numbers in the store, sorted. Returns how many, -1 on error. */
+static int listSegments(const char *dir, int **numbers) {
+    DIR *d = opendir(dir);
+    struct dirent *ent;
+    int n = 0, cap = 0, number;
+    char tail;
+
+    *numbers = NULL;
+    if (d == NULL)
+        return -1;
+    while ((ent = readdir(d)) != NULL) {
+        if (sscanf(ent->d_name, "hist-%d.tt%c", &number, &tail) != 2 || tail != 'h')
+            continue;
+        if (n == cap) {
+            cap = cap ? cap * 2 : 16;
+            *numbers = realloc(*numbers, cap * sizeof(int));
+            if (*numbers == NULL) {
+                closedir(d);
+                return -1;
+            }
+        }
+        /* Insertion sort; there are few. */
+        int i = n++;
+        for (; i > 0 && (*numbers)[i - 1] > number; i--)
+            (*numbers)[i] = (*numbers)[i - 1];
+        (*numbers)[i] = number;
+    }
+    closedir(d);
+    return n;
+}
+
+int historyOpen(struct history *h, const char *dir) {
+    char path[4096];
+    int *numbers, n;
+
+    memset(h, 0, sizeof(*h));
+    h->lock_fd = -1;
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+        return -1;
+    snprintf(path, sizeof(path), "%s/lock", dir);
+    h->lock_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (h->lock_fd < 0 || flock(h->lock_fd, LOCK_EX | LOCK_NB) < 0)
+        goto fail;
+    if ((h->dir = strdup(dir)) == NULL || (n = listSegments(dir, &numbers)) < 0)
+        goto fail;
+
+    /* This run comes after the last one that left games in the store. */
+    for (int i = n - 1; i >= 0; i--) {
+        struct history_segment seg;
+
+        segmentPath(path, sizeof(path), dir, numbers[i]);
+        if (mapSegment(path, 0, 0, &seg) < 0) {
+            free(numbers);
+            goto fail;
+        }
+        if (seg.count)
+            h->run = (seg.id[seg.count - 1] >> 32) + 1;
+        unmapSegment(&seg);
+        if (h->run)
+            break;
+    }
+
+    /* Carry on in the last segment, or start the first. */
+    h->number = n ? numbers[n - 1] : 0;
+    free(numbers);
+    segmentPath(path, sizeof(path), dir, h->number);
+    if ((n ? mapSegment(path, 1, 0, &h->seg) : createSegment(dir, 0, &h->seg)) < 0)
+        goto fail;
+    return 0;
+
+fail:
+    historyClose(h);
+    return -1;
+}
+
+int historyAppend(struct history *h, const struct history_game *g) {
+    struct history_segment *seg = &h->seg;
+    long i = seg->count;
+
+    if (i == SEGMENT_GAMES) {
+        unmapSegment(seg);
+        if (createSegment(h->dir, ++h->number, seg) < 0)
+            return -1;
+        i = 0;
+    }
+    seg->id[i] = h->run << 32 | (uint32_t)g->id;
+    seg->start[i] = g->start;
+    seg->duration[i] = g->duration;
+    seg->moves[i] = g->moves;
+    seg->length[i] = g->length;
+    seg->result[i] = g->result;
+    seg->player_x[i] = g->player_x;
+    seg->player_o[i] = g->player_o;
+    /* Readers see the row once the count covers it. */
+    atomic_store_explicit(&seg->header->count, i + 1, memory_order_release);
+    seg->count = i + 1;
+    return 0;
+}
+
+void historyClose(struct history *h) {
+    unmapSegment(&h->seg);
+    if (h->lock_fd >= 0)
+        close(h->lock_fd);
+    h->lock_fd = -1;
+    free(h->dir);
+    h->dir = NULL;
+}
+
+int historyMap(const char *dir, struct history_segment **segs) {
+    char path[4096];
+    int *numbers, n = listSegments(dir, &numbers);
+
+    *segs = NULL;
+    if (n < 0)
+        return -1;
+    if ((*segs = calloc(n ? n : 1, sizeof(**segs))) == NULL) {
+        free(numbers);
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        segmentPath(path, sizeof(path), dir, numbers[i]);
+        if (mapSegment(path, 0, 0, &(*segs)[i]) < 0) {
+            historyUnmap(*segs, i);
+            free(numbers);
+            *segs = NULL;
+            return -1;
+        }
+    }
+    free(numbers);
+    return n;
+}
+
+void historyUnmap(struct history_segment *segs, int nsegs) {
+    for (int i = 0; i < nsegs; i++)
+        unmapSegment(&segs[i]);
+    free(segs);
+}
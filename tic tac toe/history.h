@@ -0,0 +1,102 @@
+/****************************************************************************
+*       Append only store of finished games, kept by column.
+*
+*       A store is a directory of segment files, hist-NNNNNN.tth, each
+*       with room for SEGMENT_GAMES games. A segment starts with a page
+*       of header and then one array per column, every array aligned to
+*       a page, so a query maps the file and scans just the columns it
+*       needs at memory speed. The file is sized to its full capacity up
+*       front and is sparse until written. Rows are written into the
+*       mapping and become visible once the header count covers them,
+*       which is the last thing an append updates; a store cut short by
+*       a crash is still consistent. A new segment is opened once the
+*       last one is full; it is set up as hist-NNNNNN.tmp and renamed
+*       once its header is written.
+*
+*       Columns, row i of each is game i of the segment:
+*
+*       id        uint64  run of the writer in the high 32 bits, its
+*                         own number for the game in the low 32; every
+*                         historyOpen starts a run after the last one
+*                         in the store, so ids never repeat
+*       start     uint32  unix time the game started, seconds
+*       duration  uint32  milliseconds
+*       moves     uint64  cells played, 4 bits each, the first in the
+*                         low bits (see struct game)
+*       length    uint8   number of moves
+*       result    uint8   HIST_X_WON, HIST_O_WON, HIST_DRAW, HIST_ABANDONED
+*       player_x  uint8   HIST_HUMAN, HIST_COMPUTER or HIST_BOT + bot kind
+*       player_o  uint8
+*
+*       One process appends to a store at a time; historyOpen takes a
+*       lock on the directory. Any number of readers can map it meanwhile.
+*
+*****************************************************************************/
+
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stdint.h>
+
+#define HISTORY_MAGIC "TTTH"
+#define HISTORY_VERSION 1
+#define SEGMENT_GAMES (1 << 22)
+#define HISTORY_PAGE 4096
+
+/* Results. X is player 2, who opens. */
+#define HIST_X_WON     0
+#define HIST_O_WON     1
+#define HIST_DRAW      2
+#define HIST_ABANDONED 3    /* Disconnected or forfeited. */
+#define HIST_RESULTS   4
+
+/* Players. */
+#define HIST_HUMAN     0
+#define HIST_COMPUTER  1    /* The server's MCTS player. */
+#define HIST_BOT       2    /* Plus the BOT_ kind of the self-play bot. */
+
+struct history_game {
+    uint64_t id;            /* The writer's own number; appends add the run. */
+    uint32_t start;
+    uint32_t duration;
+    uint64_t moves;
+    uint8_t length;
+    uint8_t result;
+    uint8_t player_x, player_o;
+};
+
+/* A mapped segment. The column pointers cover count rows. */
+struct history_segment {
+    void *base;
+    long size;
+    struct history_header *header;
+    long count;
+    uint64_t *id;
+    uint32_t *start;
+    uint32_t *duration;
+    uint64_t *moves;
+    uint8_t *length;
+    uint8_t *result;
+    uint8_t *player_x, *player_o;
+};
+
+/* Writing. historyOpen returns -1 if the directory cannot be created or
+ * another process is writing to it. */
+struct history {
+    char *dir;
+    int lock_fd;
+    int number;             /* Of the segment being written. */
+    uint64_t run;           /* High bits of the ids this writer appends. */
+    struct history_segment seg;
+};
+
+int historyOpen(struct history *h, const char *dir);
+int historyAppend(struct history *h, const struct history_game *g);
+void historyClose(struct history *h);
+
+/* Reading. historyMap maps every segment of the store read only, in
+ * order, and returns how many there are, or -1 on error. */
+int historyMap(const char *dir, struct history_segment **segs);
+void historyUnmap(struct history_segment *segs, int nsegs);
+
+#endif
@@ -0,0 +1,433 @@
+/****************************************************************************
+*       Monte Carlo tree search with a shared tree and a thread pool.
+*
+*****************************************************************************/
+
+#define _GNU_SOURCE
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "mcts.h"
+
+#define UCT_C 1.4
+#define VIRTUAL_LOSS 3      /* Visits without a point, while a thread is below. */
+#define CHECK_EVERY 16      /* Playouts between looks at the clock. */
+#define EXPAND_VISITS 2     /* Playouts through a leaf before it gets children. */
+
+/* Node states. */
+#define NODE_LEAF     0
+#define NODE_BUSY     1     /* Some thread is adding the children. */
+#define NODE_EXPANDED 2
+
+/* How the move into a node ended the game. */
+#define RESULT_NONE 0
+#define RESULT_WIN  1       /* For the player that made it. */
+#define RESULT_DRAW 2
+
+#define DRAW 2              /* Playout outcome besides the winner's id. */
+
+struct node {
+    atomic_int visits;      /* Virtual losses included. */
+    atomic_int score;       /* Half points of the player that moved here. */
+    atomic_int state;
+    int first;              /* Index of the first child. */
+    short nchildren;
+    short move;             /* Cell, -1 at the root. */
+    int result;
+};
+
+struct job {
+    struct mcts_board board;
+    long long deadline;     /* ns */
+    long long submitted;
+    long max_playouts;
+    struct mcts_result r;
+    struct job *next;
+};
+
+struct mcts {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t *threads;
+    int nthreads;
+    int quit;
+    unsigned seed;
+    struct job *queue, *queue_tail;     /* Not started yet. */
+    struct job *done, *done_tail;       /* Results not polled yet. */
+    struct job *job;        /* Being searched, NULL if none. */
+    int searching;          /* Threads still working on job. */
+    atomic_int stop;
+    atomic_long playouts;
+    struct node *nodes;
+    int max_nodes;
+    atomic_int used;
+    int efd;
+};
+
+static long long nowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* xorshift32, seeds must be non zero. */
+static unsigned nextRand(unsigned *state) {
+    unsigned x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+int mctsWins(const struct mcts_board *b, int cell) {
+    static const int dirs[4][2] = { { 0, 1 }, { 1, 0 }, { 1, 1 }, { 1, -1 } };
+    int row = cell / b->side, col = cell % b->side, who = b->cells[cell];
+
+    for (int d = 0; d < 4; d++) {
+        int count = 1;
+        for (int sign = -1; sign <= 1; sign += 2) {
+            int r = row + sign * dirs[d][0], c = col + sign * dirs[d][1];
+            while (r >= 0 && r < b->side && c >= 0 && c < b->side && b->cells[r * b->side + c] == who) {
+                count++;
+                r += sign * dirs[d][0];
+                c += sign * dirs[d][1];
+            }
+        }
+        if (count >= b->k)
+            return 1;
+    }
+    return 0;
+}
+
+/* Gives a leaf a child per free cell, if this thread gets to and the
+ * pool has room. */
+static void expand(struct mcts *e, struct node *n, struct mcts_board *b) {
+    int cells = b->side * b->side, count = 0, first, expected = NODE_LEAF;
+
+    if (!atomic_compare_exchange_strong(&n->state, &expected, NODE_BUSY))
+        return;
+    for (int c = 0; c < cells; c++)
+        count += b->cells[c] == MCTS_EMPTY;
+    first = atomic_fetch_add_explicit(&e->used, count, memory_order_relaxed);
+    if (count == 0 || first + count > e->max_nodes) {
+        atomic_store(&n->state, NODE_LEAF);
+        return;
+    }
+
+    for (int c = 0, i = first; c < cells; c++) {
+        struct node *child;
+
+        if (b->cells[c] != MCTS_EMPTY)
+            continue;
+        child = &e->nodes[i++];
+        atomic_store_explicit(&child->visits, 0, memory_order_relaxed);
+        atomic_store_explicit(&child->score, 0, memory_order_relaxed);
+        atomic_store_explicit(&child->state, NODE_LEAF, memory_order_relaxed);
+        child->move = c;
+        child->nchildren = 0;
+        b->cells[c] = b->to_move;
+        child->result = mctsWins(b, c) ? RESULT_WIN : count == 1 ? RESULT_DRAW : RESULT_NONE;
+        b->cells[c] = MCTS_EMPTY;
+    }
+    n->first = first;
+    n->nchildren = count;
+    /* Publishes the children. */
+    atomic_store_explicit(&n->state, NODE_EXPANDED, memory_order_release);
+}
+
+/* UCT; children nobody has visited yet come first. */
+static struct node *selectChild(struct mcts *e, struct node *n) {
+    struct node *best = NULL;
+    double best_value = -1, log_n = log(atomic_load_explicit(&n->visits, memory_order_relaxed) + 1);
+
+    for (int i = 0; i < n->nchildren; i++) {
+        struct node *child = &e->nodes[n->first + i];
+        int visits = atomic_load_explicit(&child->visits, memory_order_relaxed);
+        double value;
+
+        if (visits == 0)
+            return child;
+        value = atomic_load_explicit(&child->score, memory_order_relaxed) / (2.0 * visits) +
+                UCT_C * sqrt(log_n / visits);
+        if (value > best_value) {
+            best_value = value;
+            best = child;
+        }
+    }
+    return best;
+}
+
+/* Random moves to the end. Returns the winner's id or DRAW. */
+static int playout(struct mcts_board *b, unsigned *rng) {
+    int empties[MCTS_MAX_CELLS], count = 0, cells = b->side * b->side;
+
+    for (int c = 0; c < cells; c++)
+        if (b->cells[c] == MCTS_EMPTY)
+            empties[count++] = c;
+    while (count) {
+        int i = nextRand(rng) % count, c = empties[i];
+
+        empties[i] = empties[--count];
+        b->cells[c] = b->to_move;
+        if (mctsWins(b, c))
+            return b->to_move;
+        b->to_move ^= 1;
+    }
+    return DRAW;
+}
+
+/* One selection, expansion, playout and backup. */
+static void iterate(struct mcts *e, struct job *job, unsigned *rng) {
+    struct mcts_board b = job->board;
+    struct node *path[MCTS_MAX_CELLS + 1];
+    struct node *n = &e->nodes[0];
+    int depth = 0, winner;
+
+    path[depth++] = n;
+    atomic_fetch_add_explicit(&n->visits, VIRTUAL_LOSS, memory_order_relaxed);
+    while (n->result == RESULT_NONE &&
+           atomic_load_explicit(&n->state, memory_order_acquire) == NODE_EXPANDED) {
+        n = selectChild(e, n);
+        atomic_fetch_add_explicit(&n->visits, VIRTUAL_LOSS, memory_order_relaxed);
+        b.cells[n->move] = b.to_move;
+        b.to_move ^= 1;
+        path[depth++] = n;
+    }
+
+    if (n->result == RESULT_WIN) {
+        winner = !b.to_move;
+    } else if (n->result == RESULT_DRAW) {
+        winner = DRAW;
+    } else {
+        /* Its own virtual loss counts, the other threads' may too. */
+        if (atomic_load_explicit(&n->visits, memory_order_relaxed) >= EXPAND_VISITS + VIRTUAL_LOSS)
+            expand(e, n, &b);
+        winner = playout(&b, rng);
+    }
+
+    for (int i = 0; i < depth; i++) {
+        /* path[1] was played by the player to move at the root. */
+        int mover = job->board.to_move ^ !(i & 1);
+
+        atomic_fetch_add_explicit(&path[i]->visits, 1 - VIRTUAL_LOSS, memory_order_relaxed);
+        atomic_fetch_add_explicit(&path[i]->score, winner == mover ? 2 : winner == DRAW, memory_order_relaxed);
+    }
+}
+
+static void search(struct mcts *e, struct job *job, unsigned *rng) {
+    if (e->nodes[0].nchildren == 0)
+        return;
+    for (long i = 0; !atomic_load_explicit(&e->stop, memory_order_relaxed); i++) {
+        long done;
+
+        iterate(e, job, rng);
+        done = atomic_fetch_add_explicit(&e->playouts, 1, memory_order_relaxed) + 1;
+        if (job->max_playouts && done >= job->max_playouts)
+            break;
+        if (i % CHECK_EVERY == 0 && done >= MCTS_MIN_PLAYOUTS && nowNs() >= job->deadline)
+            break;
+    }
+    atomic_store(&e->stop, 1);
+}
+
+/* Takes the next search off the queue. Called with the lock held. */
+static void startJob(struct mcts *e) {
+    struct job *job = e->queue;
+    struct node *root = &e->nodes[0];
+
+    e->queue = job->next;
+    if (e->queue == NULL)
+        e->queue_tail = NULL;
+    e->job = job;
+    atomic_store(&e->used, 1);
+    atomic_store(&e->playouts, 0);
+    atomic_store(&e->stop, 0);
+    atomic_store(&root->visits, 0);
+    atomic_store(&root->score, 0);
+    atomic_store(&root->state, NODE_LEAF);
+    root->move = -1;
+    root->nchildren = 0;
+    root->result = RESULT_NONE;
+    expand(e, root, &job->board);
+    pthread_cond_broadcast(&e->wake);
+}
+
+/* The most visited move wins. Called with the lock held, once every
+ * thread is out of the tree. */
+static void finishJob(struct mcts *e) {
+    struct job *job = e->job;
+    struct node *root = &e->nodes[0];
+    int best = -1, used = atomic_load(&e->used);
+
+    for (int i = 0; i < root->nchildren; i++) {
+        struct node *child = &e->nodes[root->first + i];
+        if (best < 0 || child->visits > e->nodes[root->first + best].visits)
+            best = i;
+    }
+    job->r.move = best < 0 ? -1 : e->nodes[root->first + best].move;
+    job->r.playouts = atomic_load(&e->playouts);
+    job->r.nodes = used < e->max_nodes ? used : e->max_nodes;
+    job->r.elapsed_us = (nowNs() - job->submitted) / 1000;
+
+    job->next = NULL;
+    if (e->done_tail)
+        e->done_tail->next = job;
+    else
+        e->done = job;
+    e->done_tail = job;
+    e->job = NULL;
+    (void)!write(e->efd, &(uint64_t){ 1 }, sizeof(uint64_t));
+}
+
+static void *worker(void *arg) {
+    struct mcts *e = arg;
+    unsigned rng;
+
+    pthread_mutex_lock(&e->lock);
+    rng = e->seed = e->seed * 2654435761u + 1;
+    if (rng == 0)
+        rng = 1;
+    for (;;) {
+        struct job *job;
+
+        /* Join the search under way, or start the next one. */
+        while (!e->quit && !(e->job && !atomic_load(&e->stop)) && !(e->job == NULL && e->queue))
+            pthread_cond_wait(&e->wake, &e->lock);
+        if (e->quit)
+            break;
+        if (e->job == NULL)
+            startJob(e);
+        job = e->job;
+        e->searching++;
+        pthread_mutex_unlock(&e->lock);
+
+        search(e, job, &rng);
+
+        pthread_mutex_lock(&e->lock);
+        if (--e->searching == 0) {
+            finishJob(e);
+            pthread_cond_broadcast(&e->wake);
+        }
+    }
+    pthread_mutex_unlock(&e->lock);
+    return NULL;
+}
+
+struct mcts *mctsCreate(int threads, int nodes) {
+    struct mcts *e = calloc(1, sizeof(*e));
+
+    if (e == NULL)
+        return NULL;
+    e->nodes = calloc(nodes, sizeof(*e->nodes));
+    e->threads = calloc(threads, sizeof(*e->threads));
+    e->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    e->max_nodes = nodes;
+    e->seed = (unsigned)nowNs() | 1;
+    pthread_mutex_init(&e->lock, NULL);
+    pthread_cond_init(&e->wake, NULL);
+    if (e->nodes == NULL || e->threads == NULL || e->efd < 0) {
+        mctsDestroy(e);
+        return NULL;
+    }
+    for (; e->nthreads < threads; e->nthreads++) {
+        if (pthread_create(&e->threads[e->nthreads], NULL, worker, e) != 0) {
+            mctsDestroy(e);
+            return NULL;
+        }
+    }
+    return e;
+}
+
+static void freeJobs(struct job *job) {
+    while (job) {
+        struct job *next = job->next;
+        free(job);
+        job = next;
+    }
+}
+
+void mctsDestroy(struct mcts *e) {
+    pthread_mutex_lock(&e->lock);
+    e->quit = 1;
+    atomic_store(&e->stop, 1);
+    pthread_cond_broadcast(&e->wake);
+    pthread_mutex_unlock(&e->lock);
+    for (int i = 0; i < e->nthreads; i++)
+        pthread_join(e->threads[i], NULL);
+    /* A search cut short has no result. */
+    free(e->job);
+    freeJobs(e->queue);
+    freeJobs(e->done);
+    if (e->efd >= 0)
+        close(e->efd);
+    free(e->nodes);
+    free(e->threads);
+    pthread_mutex_destroy(&e->lock);
+    pthread_cond_destroy(&e->wake);
+    free(e);
+}
+
+int mctsSubmit(struct mcts *e, const struct mcts_board *b, int budget_ms, long max_playouts, void *tag) {
+    struct job *job = calloc(1, sizeof(*job));
+
+    if (job == NULL)
+        return -1;
+    job->board = *b;
+    job->submitted = nowNs();
+    job->deadline = job->submitted + budget_ms * 1000000LL;
+    job->max_playouts = max_playouts;
+    job->r.tag = tag;
+
+    pthread_mutex_lock(&e->lock);
+    if (e->queue_tail)
+        e->queue_tail->next = job;
+    else
+        e->queue = job;
+    e->queue_tail = job;
+    pthread_cond_broadcast(&e->wake);
+    pthread_mutex_unlock(&e->lock);
+    return 0;
+}
+
+int mctsPoll(struct mcts *e, struct mcts_result *r) {
+    struct job *job;
+    uint64_t count;
+
+    (void)!read(e->efd, &count, sizeof(count));
+    pthread_mutex_lock(&e->lock);
+    job = e->done;
+    if (job) {
+        e->done = job->next;
+        if (e->done == NULL)
+            e->done_tail = NULL;
+    }
+    pthread_mutex_unlock(&e->lock);
+    if (job == NULL)
+        return 0;
+    *r = job->r;
+    free(job);
+    return 1;
+}
+
+int mctsEventFd(struct mcts *e) {
+    return e->efd;
+}
+
+int mctsSearch(struct mcts *e, const struct mcts_board *b, int budget_ms, long max_playouts,
+               struct mcts_result *r) {
+    struct pollfd pfd = { e->efd, POLLIN, 0 };
+
+    if (mctsSubmit(e, b, budget_ms, max_playouts, NULL) < 0)
+        return -1;
+    while (!mctsPoll(e, r))
+        poll(&pfd, 1, -1);
+    return 0;
+}
@@ -0,0 +1,69 @@
+/****************************************************************************
+*       Monte Carlo tree search for k in a row games on square boards of
+*       any size up to MCTS_MAX_SIDE, 3x3 Tic Tac Toe included.
+*
+*       An engine owns a pool of threads that all work on the tree of one
+*       search at a time (tree parallelism). Node statistics are atomic
+*       counters and need no locks. A thread on its way down adds a
+*       virtual loss to every node it passes, which it takes back when
+*       the result comes up, so the other threads spread out over other
+*       branches in the meantime. A node is expanded by whichever thread
+*       wins a compare and swap on it; the others play out from it as a
+*       leaf instead of waiting.
+*
+*       Searches are queued and run in turn. Each has a time budget that
+*       starts when it is submitted, and an optional cap on playouts;
+*       one that waited out its whole budget in the queue still gets
+*       MCTS_MIN_PLAYOUTS. Results come back through mctsPoll, and the
+*       eventfd from mctsEventFd becomes readable when there are some, so
+*       an event loop never waits for the engine.
+*
+*****************************************************************************/
+
+#ifndef MCTS_H
+#define MCTS_H
+
+#define MCTS_MAX_SIDE  19
+#define MCTS_MAX_CELLS (MCTS_MAX_SIDE * MCTS_MAX_SIDE)
+#define MCTS_MIN_PLAYOUTS 256
+
+#define MCTS_EMPTY -1
+
+struct mcts_board {
+    int side;               /* Cells per row and column. */
+    int k;                  /* In a row to win. */
+    signed char cells[MCTS_MAX_CELLS];  /* Row by row, player id or MCTS_EMPTY. */
+    int to_move;            /* Player id, 0 or 1. */
+};
+
+struct mcts_result {
+    void *tag;              /* As submitted. */
+    int move;               /* Cell index, -1 if the board was full. */
+    long playouts;
+    long nodes;
+    long elapsed_us;
+};
+
+struct mcts;
+
+/* Starts threads threads with room for nodes tree nodes. Returns NULL if
+ * out of memory or threads. */
+struct mcts *mctsCreate(int threads, int nodes);
+void mctsDestroy(struct mcts *e);
+
+/* Queues a search for the player to move on b. A max_playouts of 0 means
+ * no cap. Returns -1 if out of memory. */
+int mctsSubmit(struct mcts *e, const struct mcts_board *b, int budget_ms, long max_playouts, void *tag);
+
+/* Returns 1 and fills r with a finished search, 0 if there is none. */
+int mctsPoll(struct mcts *e, struct mcts_result *r);
+int mctsEventFd(struct mcts *e);
+
+/* Submits and waits for the result. */
+int mctsSearch(struct mcts *e, const struct mcts_board *b, int budget_ms, long max_playouts,
+               struct mcts_result *r);
+
+/* Returns 1 if the stone on cell completes k in a row. */
+int mctsWins(const struct mcts_board *b, int cell);
+
+#endif
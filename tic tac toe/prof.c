@@ -0,0 +1,129 @@
+/****************************************************************************
+*       Hardware counter profile of the server's turn pipeline.
+*
+*****************************************************************************/
+
+#define _GNU_SOURCE
+#define CALIBRATE_RUNS 64
+
+#include <math.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+
+#include "prof.h"
+
+static const struct {
+    uint32_t type;
+    uint64_t config;
+    const char *name;
+} counters[PROF_COUNTERS] = {
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, "ns" },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cycles" },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "instructions" },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, "LLC misses" },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, "ctx switches" },
+};
+
+static const char *phases[PROF_PHASES] = { "accept", "parse", "validate", "apply", "send" };
+
+static int openCounter(int c, int group, int user_only) {
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = counters[c].type;
+    attr.config = counters[c].config;
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.exclude_kernel = user_only;
+    attr.exclude_hv = 1;
+    /* This thread, any CPU. */
+    return syscall(SYS_perf_event_open, &attr, 0, -1, group, PERF_FLAG_FD_CLOEXEC);
+}
+
+int profOpen(struct prof *p, int every) {
+    memset(p, 0, sizeof(*p));
+    p->fd = -1;
+    /* Kernel time matters here, most of a send is in the kernel. */
+    for (p->user_only = 0; p->user_only < 2 && p->nslots == 0; p->user_only++) {
+        for (int c = 0; c < PROF_COUNTERS; c++) {
+            p->fds[c] = openCounter(c, p->fd, p->user_only);
+            p->slot[c] = p->fds[c] < 0 ? -1 : p->nslots++;
+            if (p->fd < 0)
+                p->fd = p->fds[c];
+        }
+    }
+    p->user_only--;
+    if (p->nslots == 0)
+        return -1;
+    p->every = every > 0 ? every : 1;
+
+    /* An empty phase, to see what sampling counts by itself. */
+    for (int i = 0; i < CALIBRATE_RUNS; i++) {
+        profSample(p, PROF_ACCEPT);
+        profEnd(p, PROF_ACCEPT);
+    }
+    for (int c = 0; c < PROF_COUNTERS; c++)
+        p->bias[c] = p->samples[PROF_ACCEPT] ? (double)p->total[PROF_ACCEPT][c] / p->samples[PROF_ACCEPT] : 0;
+    p->samples[PROF_ACCEPT] = 0;
+    memset(p->total[PROF_ACCEPT], 0, sizeof(p->total[PROF_ACCEPT]));
+    return 0;
+}
+
+void profClose(struct prof *p) {
+    for (int c = 0; c < PROF_COUNTERS; c++)
+        if (p->every && p->fds[c] >= 0)
+            close(p->fds[c]);
+    p->every = 0;
+}
+
+/* Reads the group into values, by counter. */
+static int readCounters(struct prof *p, uint64_t *values) {
+    uint64_t buf[1 + PROF_COUNTERS];
+
+    if (read(p->fd, buf, sizeof(buf)) < (long)sizeof(uint64_t) * (1 + p->nslots))
+        return -1;
+    for (int c = 0; c < PROF_COUNTERS; c++)
+        values[c] = p->slot[c] < 0 ? 0 : buf[1 + p->slot[c]];
+    return 0;
+}
+
+void profSample(struct prof *p, int phase) {
+    p->active[phase] = readCounters(p, p->start[phase]) == 0;
+}
+
+void profStop(struct prof *p, int phase) {
+    uint64_t end[PROF_COUNTERS];
+
+    p->active[phase] = 0;
+    if (readCounters(p, end) < 0)
+        return;
+    for (int c = 0; c < PROF_COUNTERS; c++)
+        p->total[phase][c] += end[c] - p->start[phase][c];
+    p->samples[phase]++;
+}
+
+void profReport(struct prof *p, FILE *f) {
+    if (!p->every)
+        return;
+    fprintf(f, "Profile, one run in %d sampled%s, per sampled run less %.0f ns of sampling:\n",
+            p->every, p->user_only ? ", user only" : "", p->bias[PROF_TASK_CLOCK]);
+    fprintf(f, "%-10s %10s %10s", "phase", "runs", "samples");
+    for (int c = 0; c < PROF_COUNTERS; c++)
+        fprintf(f, " %13s", counters[c].name);
+    fprintf(f, "\n");
+    for (int ph = 0; ph < PROF_PHASES; ph++) {
+        long n = p->samples[ph];
+
+        fprintf(f, "%-10s %10ld %10ld", phases[ph], p->runs[ph], n);
+        for (int c = 0; c < PROF_COUNTERS; c++) {
+            if (p->slot[c] < 0 || n == 0)
+                fprintf(f, " %13s", "-");
+            else
+                fprintf(f, " %13.1f", fmax((double)p->total[ph][c] / n - p->bias[c], 0));
+        }
+        fprintf(f, "\n");
+    }
+    fflush(f);
+}
@@ -0,0 +1,79 @@
+/****************************************************************************
+*       Hardware counter profile of the server's turn pipeline.
+*
+*       The counters are opened once as a perf_event group on the server
+*       thread and left running; a phase reads the whole group with one
+*       read() when it starts and when it ends and adds the difference
+*       to its totals. Only one run in every `every` of each phase is
+*       sampled, which keeps the cost to two system calls per sample and
+*       nothing at all for the runs in between. What the reads cost
+*       themselves is measured on an empty phase when the counters are
+*       opened and taken off the averages.
+*
+*       Counters the machine or the kernel does not offer (hardware
+*       counters in most virtual machines) are left out and reported as
+*       missing; the task clock is a software counter and always there.
+*       Kernel time is counted too unless perf_event_paranoid forbids it,
+*       in which case the report says user only.
+*
+*****************************************************************************/
+
+#ifndef PROF_H
+#define PROF_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Phases. */
+#define PROF_ACCEPT   0     /* A pass of accepting and admitting connections. */
+#define PROF_PARSE    1     /* Reading frames off a client connection. */
+#define PROF_VALIDATE 2     /* Checking a move. */
+#define PROF_APPLY    3     /* Playing it on the board and checking for a win. */
+#define PROF_SEND     4     /* Writing a message to a client. */
+#define PROF_PHASES   5
+
+/* Counters. The task clock leads the group: as a member it is only
+ * brought up to date when the thread is switched out. */
+#define PROF_TASK_CLOCK   0 /* ns */
+#define PROF_CYCLES       1
+#define PROF_INSTRUCTIONS 2
+#define PROF_LLC_MISSES   3
+#define PROF_CTX_SWITCHES 4
+#define PROF_COUNTERS     5
+
+struct prof {
+    int every;              /* Sample one run in this many, 0 when off. */
+    int fd;                 /* Group leader. */
+    int fds[PROF_COUNTERS];
+    int slot[PROF_COUNTERS];    /* Position in a group read, -1 if missing. */
+    int nslots;
+    int user_only;
+    int active[PROF_PHASES];
+    uint64_t start[PROF_PHASES][PROF_COUNTERS];
+    long runs[PROF_PHASES];
+    long samples[PROF_PHASES];
+    uint64_t total[PROF_PHASES][PROF_COUNTERS];
+    double bias[PROF_COUNTERS]; /* What an empty sample counts, taken off. */
+};
+
+/* Opens the counters. Returns -1 if none of them can be opened. */
+int profOpen(struct prof *p, int every);
+void profClose(struct prof *p);
+
+void profSample(struct prof *p, int phase);
+void profStop(struct prof *p, int phase);
+
+static inline void profBegin(struct prof *p, int phase) {
+    if (p->every && p->runs[phase]++ % p->every == 0)
+        profSample(p, phase);
+}
+
+static inline void profEnd(struct prof *p, int phase) {
+    if (p->active[phase])
+        profStop(p, phase);
+}
+
+/* Prints the averages per sampled run of each phase. */
+void profReport(struct prof *p, FILE *f);
+
+#endif
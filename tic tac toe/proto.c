@@ -0,0 +1,191 @@
+/****************************************************************************
+*       Encoding and decoding of the messages exchanged by the server
+*       and its clients.
+*
+*****************************************************************************/
+
+#include <ctype.h>
+#include <string.h>
+
+#include "game.h"
+#include "proto.h"
+
+static const char tags[MSG_TYPES][TAG_LEN + 1] = {
+    "TRN", "INV", "UPD", "BRD", "WAT", "WIN", "LSE", "DRW", "SNP", "DLT", "ROM", "NRM", "BSY",
+    "PLY", "TOK", "AWY", "BAK"
+};
+
+static const char body_len[MSG_TYPES] = { 0, 0, 9, 9, 0, 0, 0, 0, 5, 3, 4, 0, 0, 7, 8, 0, 0 };
+
+/* Crockford's base 32: no I, L, O or U to misread. */
+static const char code_digits[] = "0123456789ABCDEFGHJKMNPQRSTVWXYZ";
+
+/* Cells packed 2 bits each, cell 0 in the low bits of the first byte. */
+static void packBoard(char board[][3], unsigned char *buf) {
+    unsigned bits = 0;
+
+    for (int i = BOARD_CELLS - 1; i >= 0; i--) {
+        char c = board[i/3][i%3];
+        bits = bits << 2 | (c == 'O' ? 1 : c == 'X' ? 2 : 0);
+    }
+    buf[0] = bits;
+    buf[1] = bits >> 8;
+    buf[2] = bits >> 16;
+}
+
+static void unpackBoard(const unsigned char *buf, char board[][3]) {
+    unsigned bits = buf[0] | buf[1] << 8 | buf[2] << 16;
+
+    for (int i = 0; i < BOARD_CELLS; i++, bits >>= 2)
+        board[i/3][i%3] = (bits & 3) == 1 ? 'O' : (bits & 3) == 2 ? 'X' : ' ';
+}
+
+int protoType(const char *tag) {
+    for (int type = 0; type < MSG_TYPES; type++)
+        if (!memcmp(tag, tags[type], TAG_LEN))
+            return type;
+    return -1;
+}
+
+const char *protoTag(int type) {
+    return type >= 0 && type < MSG_TYPES ? tags[type] : "???";
+}
+
+int protoBodyLen(int type) {
+    return body_len[type];
+}
+
+int protoEncode(const struct msg *m, char *buf) {
+    unsigned char *body = (unsigned char *)buf + TAG_LEN;
+
+    memcpy(buf, tags[m->type], TAG_LEN);
+    switch (m->type) {
+    case MSG_UPD:
+    case MSG_BRD:
+        memcpy(body, m->board, 9);
+        break;
+    case MSG_SNP:
+        body[0] = m->seq >> 8;
+        body[1] = m->seq;
+        packBoard((char (*)[3])m->board, body + 2);
+        break;
+    case MSG_DLT:
+        body[0] = m->seq >> 8;
+        body[1] = m->seq;
+        body[2] = m->player_id << 4 | m->move;
+        break;
+    case MSG_ROM:
+        body[0] = m->code >> 24;
+        body[1] = m->code >> 16;
+        body[2] = m->code >> 8;
+        body[3] = m->code;
+        break;
+    case MSG_PLY:
+        body[0] = m->seq >> 8;
+        body[1] = m->seq;
+        body[2] = m->move < 0 ? 0xff : m->player_id << 4 | m->move;
+        packBoard((char (*)[3])m->board, body + 3);
+        body[6] = m->next;
+        break;
+    case MSG_TOK:
+        for (int i = 0; i < 8; i++)
+            body[i] = m->token >> (56 - 8 * i);
+        break;
+    }
+    return TAG_LEN + body_len[m->type];
+}
+
+int protoDecode(const char *buf, int len, struct msg *m) {
+    if (len < TAG_LEN)
+        return 0;
+
+    m->type = protoType(buf);
+    if (m->type < 0)
+        return -1;
+    if (len < TAG_LEN + body_len[m->type])
+        return 0;
+
+    const unsigned char *body = (const unsigned char *)buf + TAG_LEN;
+    switch (m->type) {
+    case MSG_UPD:
+    case MSG_BRD:
+        memcpy(m->board, body, 9);
+        break;
+    case MSG_SNP:
+        m->seq = body[0] << 8 | body[1];
+        unpackBoard(body + 2, m->board);
+        break;
+    case MSG_DLT:
+        m->seq = body[0] << 8 | body[1];
+        m->player_id = body[2] >> 4;
+        m->move = body[2] & 0x0f;
+        break;
+    case MSG_ROM:
+        m->code = (unsigned)body[0] << 24 | body[1] << 16 | body[2] << 8 | body[3];
+        break;
+    case MSG_PLY:
+        m->seq = body[0] << 8 | body[1];
+        m->player_id = body[2] == 0xff ? -1 : body[2] >> 4;
+        m->move = body[2] == 0xff ? -1 : body[2] & 0x0f;
+        unpackBoard(body + 3, m->board);
+        m->next = body[6];
+        break;
+    case MSG_TOK:
+        m->token = 0;
+        for (int i = 0; i < 8; i++)
+            m->token = m->token << 8 | body[i];
+        break;
+    }
+    return TAG_LEN + body_len[m->type];
+}
+
+int protoEncodeMove(int move, char *buf) {
+    memcpy(buf, &move, sizeof(int));
+    return sizeof(int);
+}
+
+int protoDecodeMove(const char *buf, int len, int *move) {
+    if (len < (int)sizeof(int))
+        return 0;
+    memcpy(move, buf, sizeof(int));
+    return sizeof(int);
+}
+
+int protoEncodeResume(unsigned long long token, char *buf) {
+    int n = protoEncodeMove(ROOM_RESUME, buf);
+
+    for (int i = 0; i < 8; i++)
+        buf[n + i] = token >> (56 - 8 * i);
+    return RESUME_LEN;
+}
+
+int protoDecodeResume(const char *buf, int len, unsigned long long *token) {
+    const unsigned char *p = (const unsigned char *)buf + sizeof(int);
+
+    if (len < RESUME_LEN)
+        return 0;
+    *token = 0;
+    for (int i = 0; i < 8; i++)
+        *token = *token << 8 | p[i];
+    return RESUME_LEN;
+}
+
+void protoFormatCode(unsigned code, char *buf) {
+    for (int i = ROOM_CODE_LEN - 1; i >= 0; i--, code >>= 5)
+        buf[i] = code_digits[code & 31];
+    buf[ROOM_CODE_LEN] = '\0';
+}
+
+unsigned protoParseCode(const char *str) {
+    unsigned code = 0;
+
+    if (strlen(str) != ROOM_CODE_LEN)
+        return 0;
+    for (int i = 0; i < ROOM_CODE_LEN; i++) {
+        const char *digit = strchr(code_digits, toupper((unsigned char)str[i]));
+        if (digit == NULL)
+            return 0;
+        code = code << 5 | (digit - code_digits);
+    }
+    return code;
+}
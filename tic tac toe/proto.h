@@ -0,0 +1,139 @@
+/****************************************************************************
+*       Encoding and decoding of the messages exchanged by the server
+*       and its clients.
+*
+*       Server to client messages are a 3 byte tag, optionally followed by
+*       a body. Client to server messages are a bare int with the move.
+*
+*       Clients that negotiate FEATURE_DELTA get a packed snapshot (SNP)
+*       when they join or ask for a resync, and a one move delta (DLT)
+*       for every other update instead of the full board (UPD). Both
+*       carry the number of moves played so far as a sequence number; a
+*       client that sees a gap sends RESYNC_REQUEST in place of a move.
+*       Multi byte fields of SNP, DLT, ROM and PLY are in network byte
+*       order.
+*
+*       Clients that negotiate FEATURE_TURN get one PLY frame per turn in
+*       place of all of the above: the sequence number, the last move
+*       (player id and position, or none), the packed board and what
+*       comes next, MSG_TRN for their move, MSG_INV for their move again
+*       after an invalid one, MSG_WAT for the opponent's move (only after
+*       a resume) or MSG_WIN, MSG_LSE or MSG_DRW. A valid move
+*       that does not end the game is not answered at all; the mover
+*       hears next when the opponent has moved. A turn therefore costs a
+*       move frame one way and a PLY frame the other.
+*
+*       Clients that negotiate FEATURE_LOBBY are not paired with whoever
+*       comes next. Their first frame is ROOM_CREATE, answered with ROM
+*       and the code of a new room, ROOM_ANY to be paired as usual, or
+*       the code of a room to join, or ROOM_BOT to play the computer.
+*       NRM says there is no such room, or that the client's own room
+*       expired, or that there is no computer to play; the client is back
+*       in the lobby either way.
+*
+*       Clients that negotiate FEATURE_RESUME send HEARTBEAT whenever they
+*       have sent nothing for HEARTBEAT_MS, and the server takes one that
+*       stays silent much longer for gone. They get TOK with a resume
+*       token when their game starts. If they lose the connection the
+*       game waits for them a while, and the opponent gets AWY if it has
+*       the feature too; a lobby client that sends ROOM_RESUME and the
+*       token takes its seat again (the opponent gets BAK) and the board,
+*       or gets NRM if the game is over. Multi byte fields of TOK and
+*       ROOM_RESUME are in network byte order too.
+*
+*****************************************************************************/
+
+#ifndef PROTO_H
+#define PROTO_H
+
+#define TAG_LEN 3
+
+/* Server to client message types. */
+#define MSG_TRN 0   /* Your turn. */
+#define MSG_INV 1   /* Invalid move, try again. */
+#define MSG_UPD 2   /* Board update, followed by the board. */
+#define MSG_BRD 3   /* Board without redraw, followed by the board. */
+#define MSG_WAT 4   /* Wait for the other player. */
+#define MSG_WIN 5
+#define MSG_LSE 6
+#define MSG_DRW 7
+#define MSG_SNP 8   /* Sequence number and board, 2 bits per cell. */
+#define MSG_DLT 9   /* Sequence number, player id and move. */
+#define MSG_ROM 10  /* Room created, followed by its code. */
+#define MSG_NRM 11  /* No such room. */
+#define MSG_BSY 12  /* Server busy, connection turned away. */
+#define MSG_PLY 13  /* Last move, board and what comes next, in one. */
+#define MSG_TOK 14  /* Resume token for the game that starts. */
+#define MSG_AWY 15  /* The opponent lost its connection. */
+#define MSG_BAK 16  /* The opponent is back. */
+#define MSG_TYPES 17
+
+#define MSG_MAX_LEN (TAG_LEN + 9)
+
+/* Protocol features negotiated in the connection hello. */
+#define FEATURE_DELTA 0x01
+#define FEATURE_LOBBY 0x02
+#define FEATURE_TURN  0x04
+#define FEATURE_RESUME 0x08
+#define FEATURES_ALL  (FEATURE_DELTA | FEATURE_LOBBY | FEATURE_TURN | FEATURE_RESUME)
+
+/* Sent by the client in place of a move to ask for a snapshot. */
+#define RESYNC_REQUEST -2
+
+/* Lobby requests, see above. */
+#define ROOM_CREATE -3
+#define ROOM_ANY    -4
+#define ROOM_BOT    -5
+#define ROOM_RESUME -6      /* Followed by the 8 byte token. */
+#define RESUME_LEN  12
+
+/* Sent by FEATURE_RESUME clients that have been quiet, in any state. */
+#define HEARTBEAT    -7
+#define HEARTBEAT_MS 5000
+
+/* Room codes are 30 bits, written as ROOM_CODE_LEN base 32 digits. */
+#define ROOM_CODE_BITS 30
+#define ROOM_CODE_LEN  6
+
+struct msg {
+    int type;
+    char board[3][3];   /* MSG_UPD, MSG_BRD, MSG_SNP and MSG_PLY. */
+    int seq;            /* MSG_SNP, MSG_DLT and MSG_PLY. */
+    int player_id;      /* MSG_DLT and MSG_PLY. */
+    int move;           /* MSG_DLT, and MSG_PLY where -1 is none yet. */
+    unsigned code;      /* MSG_ROM. */
+    unsigned long long token;   /* MSG_TOK. */
+    int next;           /* MSG_PLY: MSG_TRN, MSG_INV, MSG_WAT, MSG_WIN, MSG_LSE or MSG_DRW. */
+};
+
+/* Returns the type for a tag or -1 if unknown. */
+int protoType(const char *tag);
+const char *protoTag(int type);
+
+/* Number of bytes that follow the tag of a message type. */
+int protoBodyLen(int type);
+
+/* Encodes m into buf, which must hold MSG_MAX_LEN bytes. Returns the
+ * number of bytes written. */
+int protoEncode(const struct msg *m, char *buf);
+
+/* Decodes one message from the first len bytes of buf. Returns the number
+ * of bytes consumed, 0 if more bytes are needed or -1 on an unknown tag. */
+int protoDecode(const char *buf, int len, struct msg *m);
+
+/* Moves sent by the client. */
+int protoEncodeMove(int move, char *buf);
+int protoDecodeMove(const char *buf, int len, int *move);
+
+/* ROOM_RESUME and the token, RESUME_LEN bytes. protoDecodeResume expects
+ * the ROOM_RESUME frame to be there already; it returns 0 if the token
+ * has not all arrived yet. */
+int protoEncodeResume(unsigned long long token, char *buf);
+int protoDecodeResume(const char *buf, int len, unsigned long long *token);
+
+/* Room codes as text. protoFormatCode writes ROOM_CODE_LEN characters and
+ * a NUL; protoParseCode returns 0 if str is not a room code. */
+void protoFormatCode(unsigned code, char *buf);
+unsigned protoParseCode(const char *str);
+
+#endif
@@ -0,0 +1,338 @@
+/****************************************************************************
+*       Queries the history store of finished games (see history.h).
+*
+*       Usage : ./query.out [-t threads] [-s since] [-u until] [-r result]
+*                           [-x player] [-o player] <dir> <query>
+*
+*       Queries:
+*
+*       results   how the games ended
+*       openings  results and length by the first move
+*       hours     games and average length by hour of the day (UTC)
+*       lengths   results by number of moves
+*
+*       -s and -u keep the games started in [since, until), in unix
+*       seconds. -r keeps one result, x, o, draw or abandoned. -x and -o
+*       keep one kind of player on that side: human, computer or the name
+*       of a self-play bot.
+*
+*       The segments are split into chunks that the threads take in
+*       turn, each adding into its own table, and the tables are summed
+*       at the end. A chunk is scanned BLOCK rows at a time with vector
+*       types: the filters compare a whole block of every column they
+*       need and combine into a mask, which then adds each row into its
+*       group without branching. Only the columns a query reads are ever
+*       touched, so pages of the others never come in.
+*
+*****************************************************************************/
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "bot.h"
+#include "history.h"
+
+#define BLOCK 16                /* Rows per vector. */
+#define CHUNK_ROWS (1 << 16)    /* Rows a thread takes at a time. */
+#define MAX_GROUPS 24
+
+#define QUERY_RESULTS  0
+#define QUERY_OPENINGS 1
+#define QUERY_HOURS    2
+#define QUERY_LENGTHS  3
+
+typedef uint32_t v32 __attribute__((vector_size(BLOCK * 4)));
+typedef int32_t m32 __attribute__((vector_size(BLOCK * 4)));
+typedef uint64_t v64 __attribute__((vector_size(BLOCK * 8)));
+typedef uint8_t v8 __attribute__((vector_size(BLOCK)));
+typedef int8_t m8 __attribute__((vector_size(BLOCK)));
+
+/* Widens a mask from comparing byte columns to the lanes of the others.
+ * A macro, as vectors this wide are passed differently by ISA level. */
+#define widen(mask) __builtin_convertvector((m8)(mask), m32)
+
+struct group {
+    long games[HIST_RESULTS];   /* By result. */
+    long moves;
+    long duration_ms;
+};
+
+struct table {
+    struct group groups[MAX_GROUPS];
+};
+
+struct chunk {
+    const struct history_segment *seg;
+    long lo, hi;
+};
+
+/* Filters, all as inclusive ranges so that every one is always applied. */
+static uint32_t since, until = UINT32_MAX;
+static uint8_t result_lo, result_hi = UINT8_MAX;
+static uint8_t px_lo, px_hi = UINT8_MAX;
+static uint8_t po_lo, po_hi = UINT8_MAX;
+
+static int query;
+static struct chunk *chunks;
+static long nchunks;
+static atomic_long next_chunk;
+
+void error(const char *msg) {
+    perror(msg);
+    exit(EXIT_FAILURE);
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static void scanChunk(const struct chunk *ch, struct table *t) {
+    const struct history_segment *seg = ch->seg;
+    m32 iota;
+
+    for (int l = 0; l < BLOCK; l++)
+        iota[l] = l;
+
+    for (long i = ch->lo; i < ch->hi; i += BLOCK) {
+        v32 start, duration;
+        v8 length, result, px, po;
+        v64 moves;
+        m32 m, key;
+
+        /* Columns are page aligned and i is a multiple of BLOCK. Rows past
+         * the count are in the file and masked out below. */
+        memcpy(&start, seg->start + i, sizeof(start));
+        memcpy(&result, seg->result + i, sizeof(result));
+        memcpy(&px, seg->player_x + i, sizeof(px));
+        memcpy(&po, seg->player_o + i, sizeof(po));
+
+        m = iota + (int32_t)i < (int32_t)ch->hi;
+        m &= (start >= since) & (start < until);
+        m &= widen((result >= result_lo) & (result <= result_hi));
+        m &= widen((px >= px_lo) & (px <= px_hi));
+        m &= widen((po >= po_lo) & (po <= po_hi));
+        if (!__builtin_memcmp(&m, &(m32){0}, sizeof(m)))
+            continue;
+
+        memcpy(&length, seg->length + i, sizeof(length));
+        memcpy(&duration, seg->duration + i, sizeof(duration));
+        switch (query) {
+        case QUERY_OPENINGS:
+            memcpy(&moves, seg->moves + i, sizeof(moves));
+            key = __builtin_convertvector(moves & 15, m32);
+            /* A game with no moves has no opening. */
+            m &= widen(length > 0);
+            break;
+        case QUERY_HOURS:
+            key = (m32)(start / 3600 % 24);
+            break;
+        case QUERY_LENGTHS:
+            key = __builtin_convertvector(length, m32);
+            break;
+        default:
+            key = (m32){0};
+        }
+
+        /* Masked out rows add zero to group 0. */
+        key &= m;
+        m32 lengths = __builtin_convertvector(length, m32) & m;
+        m32 durations = (m32)duration & m;
+        for (int l = 0; l < BLOCK; l++) {
+            struct group *g = &t->groups[key[l]];
+            g->games[result[l] & (HIST_RESULTS - 1)] += m[l] & 1;
+            g->moves += lengths[l];
+            g->duration_ms += (uint32_t)durations[l];
+        }
+    }
+}
+
+static void *runWorker(void *arg) {
+    struct table *t = arg;
+    long n;
+
+    while ((n = atomic_fetch_add(&next_chunk, 1)) < nchunks)
+        scanChunk(&chunks[n], t);
+    return NULL;
+}
+
+static long total(const struct group *g) {
+    long n = 0;
+    for (int r = 0; r < HIST_RESULTS; r++)
+        n += g->games[r];
+    return n;
+}
+
+static void printRates(const struct group *g) {
+    long n = total(g);
+    double per = n ? 100.0 / n : 0;
+
+    printf("%10ld  %6.2f%%  %6.2f%%  %6.2f%%  %6.2f%%", n, g->games[HIST_X_WON] * per,
+           g->games[HIST_O_WON] * per, g->games[HIST_DRAW] * per, g->games[HIST_ABANDONED] * per);
+}
+
+static void report(const struct table *t) {
+    const struct group *g;
+
+    switch (query) {
+    case QUERY_RESULTS:
+        g = &t->groups[0];
+        printf("games:     %ld\n", total(g));
+        printf("X won:     %ld\n", g->games[HIST_X_WON]);
+        printf("O won:     %ld\n", g->games[HIST_O_WON]);
+        printf("draw:      %ld\n", g->games[HIST_DRAW]);
+        printf("abandoned: %ld\n", g->games[HIST_ABANDONED]);
+        if (total(g))
+            printf("average:   %.2f moves, %.3f s\n", (double)g->moves / total(g),
+                   g->duration_ms / 1000.0 / total(g));
+        break;
+    case QUERY_OPENINGS:
+        printf("opening       games   X won   O won    draw  abandoned  moves\n");
+        for (int cell = 0; cell < BOARD_CELLS; cell++) {
+            g = &t->groups[cell];
+            printf("%d (%d,%d)", cell, cell / 3, cell % 3);
+            printRates(g);
+            printf("  %5.2f\n", total(g) ? (double)g->moves / total(g) : 0);
+        }
+        break;
+    case QUERY_HOURS:
+        printf("hour       games   moves  seconds\n");
+        for (int h = 0; h < 24; h++) {
+            g = &t->groups[h];
+            long n = total(g);
+            printf("%02d  %10ld   %5.2f  %7.3f\n", h, n, n ? (double)g->moves / n : 0,
+                   n ? g->duration_ms / 1000.0 / n : 0);
+        }
+        break;
+    case QUERY_LENGTHS:
+        printf("moves      games   X won   O won    draw  abandoned\n");
+        for (int len = 0; len <= BOARD_CELLS; len++) {
+            g = &t->groups[len];
+            printf("%5d", len);
+            printRates(g);
+            printf("\n");
+        }
+        break;
+    }
+}
+
+static int parsePlayer(const char *name) {
+    if (!strcmp(name, "human"))
+        return HIST_HUMAN;
+    if (!strcmp(name, "computer"))
+        return HIST_COMPUTER;
+    int kind = botParse(name);
+    return kind < 0 ? -1 : HIST_BOT + kind;
+}
+
+static int parseResult(const char *name) {
+    static const char *names[HIST_RESULTS] = { "x", "o", "draw", "abandoned" };
+    for (int r = 0; r < HIST_RESULTS; r++)
+        if (!strcmp(name, names[r]))
+            return r;
+    return -1;
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage   : ./query.out [-t threads] [-s since] [-u until] [-r result]\n"
+                    "                      [-x player] [-o player] <dir> <query>\n"
+                    "Queries : results, openings, hours, lengths\n"
+                    "Results : x, o, draw, abandoned\n"
+                    "Players : human, computer, random, greedy, perfect\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+  int opt, nthreads = sysconf(_SC_NPROCESSORS_ONLN), nsegs, n;
+  static const char *queries[] = { "results", "openings", "hours", "lengths" };
+  struct history_segment *segs;
+  struct table *tables, sum;
+  pthread_t *threads;
+  long rows = 0;
+
+  while ((opt = getopt(argc, argv, "t:s:u:r:x:o:")) != -1) {
+    switch (opt) {
+    case 't': nthreads = strtol(optarg, NULL, 10); break;
+    case 's': since = strtoul(optarg, NULL, 10); break;
+    case 'u': until = strtoul(optarg, NULL, 10); break;
+    case 'r':
+      if ((n = parseResult(optarg)) < 0)
+        usage();
+      result_lo = result_hi = n;
+      break;
+    case 'x':
+      if ((n = parsePlayer(optarg)) < 0)
+        usage();
+      px_lo = px_hi = n;
+      break;
+    case 'o':
+      if ((n = parsePlayer(optarg)) < 0)
+        usage();
+      po_lo = po_hi = n;
+      break;
+    default: usage();
+    }
+  }
+  if (argc - optind != 2 || nthreads < 1)
+    usage();
+  for (query = 0; query < 4 && strcmp(argv[optind + 1], queries[query]); query++)
+    ;
+  if (query == 4)
+    usage();
+
+  if ((nsegs = historyMap(argv[optind], &segs)) < 0)
+    error("ERROR mapping history");
+
+  /* Chunks never span segments. */
+  for (int s = 0; s < nsegs; s++)
+    nchunks += (segs[s].count + CHUNK_ROWS - 1) / CHUNK_ROWS;
+  chunks = calloc(nchunks ? nchunks : 1, sizeof(*chunks));
+  tables = calloc(nthreads, sizeof(*tables));
+  threads = calloc(nthreads, sizeof(*threads));
+  if (chunks == NULL || tables == NULL || threads == NULL)
+    error("ERROR allocating");
+  nchunks = 0;
+  for (int s = 0; s < nsegs; s++) {
+    for (long lo = 0; lo < segs[s].count; lo += CHUNK_ROWS) {
+      chunks[nchunks].seg = &segs[s];
+      chunks[nchunks].lo = lo;
+      chunks[nchunks].hi = lo + CHUNK_ROWS < segs[s].count ? lo + CHUNK_ROWS : segs[s].count;
+      nchunks++;
+    }
+    rows += segs[s].count;
+  }
+
+  double start = now();
+  for (int i = 0; i < nthreads; i++)
+    if (pthread_create(&threads[i], NULL, runWorker, &tables[i]))
+      error("ERROR starting thread");
+  for (int i = 0; i < nthreads; i++)
+    pthread_join(threads[i], NULL);
+  double elapsed = now() - start;
+
+  memset(&sum, 0, sizeof(sum));
+  for (int i = 0; i < nthreads; i++) {
+    for (int g = 0; g < MAX_GROUPS; g++) {
+      for (int r = 0; r < HIST_RESULTS; r++)
+        sum.groups[g].games[r] += tables[i].groups[g].games[r];
+      sum.groups[g].moves += tables[i].groups[g].moves;
+      sum.groups[g].duration_ms += tables[i].groups[g].duration_ms;
+    }
+  }
+  report(&sum);
+  printf("scanned %ld games in %d segments, %d threads, %.1f ms (%.0f M games/sec)\n", rows, nsegs,
+         nthreads, elapsed * 1000, elapsed > 0 ? rows / elapsed / 1e6 : 0);
+
+  historyUnmap(segs, nsegs);
+  free(chunks);
+  free(tables);
+  free(threads);
+  return 0;
+}
@@ -0,0 +1,650 @@
+/****************************************************************************
+*       Replays a trace captured by the server (-r) against a running
+*       server, and reports the response latency and the connections
+*       whose game ended differently than in the trace.
+*
+*       Usage : ./replay.out [-x speed] [-u unix socket path]
+*                            [-a address] <trace file> <port>
+*
+*       Every traced connection is opened again and sends the same bytes
+*       at the same offsets, divided by the speed (-x 10 replays ten
+*       times faster). Bytes the client sent after its n-th TRN wait for
+*       the n-th TRN of the replay too, so games stay in step when the
+*       server answers slower or faster than it did. Connections made
+*       on the UNIX socket use it again if -u is given; the replay never
+*       asks for the shared memory ring.
+*
+*       Room codes and resume tokens are random, so the replayed server
+*       hands out others than the traced one did. The bytes of a client
+*       that quote a traced code or token, to join a room or to resume a
+*       game, wait until the connection it was handed to has the new
+*       one, and are sent with it in their place. If that connection
+*       never gets it, they are sent as they were.
+*
+*       The latency is the time from sending bytes to the first bytes of
+*       the answer.
+*
+*****************************************************************************/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "conn.h"
+#include "proto.h"
+#include "trace.h"
+
+#define MAX_EVENTS 256
+#define IDLE_MS 5000        /* Gives up on the server after this long idle. */
+#define IN_LEN 64
+
+#define RESULT_NONE -1      /* Connection closed without a result. */
+
+#define SECRET_ROOM  0
+#define SECRET_TOKEN 1
+#define SECRET_BUCKETS 4096
+
+/* A room code or resume token the traced server handed out, and the one
+ * the replayed server handed out in its place. */
+struct secret {
+    int kind;
+    unsigned long long traced, replayed;
+    int known;              /* replayed is set. */
+    struct secret *next;    /* In its bucket. */
+};
+
+/* Bytes a client sent that quote a secret. A frame may be split over
+ * steps, hence a pointer per byte. */
+struct patch {
+    long off;               /* Of the first byte, in the client's stream. */
+    int len;
+    struct secret *s;
+    unsigned char *at[8];
+};
+
+struct step {
+    long long at_us;        /* Since the start of the trace. */
+    int turns;              /* TRNs the client had seen before sending. */
+    long off;               /* In the client's stream. */
+    int len;
+    unsigned char *data;    /* In the trace buffer; patched in place. */
+};
+
+struct action {
+    long long at_us;
+    int type;               /* TRACE_OPEN, TRACE_DATA or TRACE_CLOSE. */
+    struct rconn *c;
+};
+
+/* A traced connection and the state of its replay. */
+struct rconn {
+    unsigned id;
+    int flags;
+    struct step *steps;
+    int nsteps, cap;
+    int turns_traced;       /* TRNs seen while reading the trace. */
+    int result;             /* Recorded outcome, RESULT_NONE if none. */
+    long stream_len;
+    struct secret **issued[2];  /* Handed to this client, by kind, in order. */
+    int nissued[2];
+    struct patch *patches;  /* In stream order. */
+    long npatches, cap_patches;
+
+    int fd;                 /* -1 until opened and after closing. */
+    int connecting;
+    int hello;              /* Sent a hello, waiting for the answer. */
+    int released;           /* Steps whose time has come. */
+    int sent;               /* Steps sent. */
+    int turns;              /* TRNs received. */
+    int close_due;
+    int done;
+    int got;                /* Outcome of the replay. */
+    int learned[2];         /* Secrets of issued replayed so far. */
+    long next_patch;
+    int blocked;            /* On a secret not known yet. */
+    long long sent_ns;      /* Waiting for an answer since, or 0. */
+    char in[IN_LEN];
+    int in_len;
+};
+
+static struct rconn **conns;    /* Indexed by trace id. */
+static unsigned nconns;
+static struct action *actions;
+static long nactions, cap_actions;
+static long long *latency;      /* ns */
+static long nlatency, cap_latency;
+static int epfd;
+static struct sockaddr_in tcp_addr;
+static struct sockaddr_un unix_addr;
+static const char *unix_path;
+static long live;              /* Connections open right now. */
+static struct secret *secrets[SECRET_BUCKETS];
+static int woken;              /* Secrets became known; retry the blocked. */
+static long failed_connects, protocol_errors;
+
+void error(const char *msg) {
+    perror(msg);
+    exit(EXIT_FAILURE);
+}
+
+static long long nowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void *grow(void *p, long *cap, long n, size_t size) {
+    if (n < *cap)
+        return p;
+    *cap = *cap ? *cap * 2 : 1024;
+    p = realloc(p, *cap * size);
+    if (p == NULL)
+        error("ERROR allocating memory");
+    return p;
+}
+
+static void addAction(long long at_us, int type, struct rconn *c) {
+    actions = grow(actions, &cap_actions, nactions, sizeof(*actions));
+    actions[nactions].at_us = at_us;
+    actions[nactions].type = type;
+    actions[nactions].c = c;
+    nactions++;
+}
+
+static struct rconn *findConn(unsigned id) {
+    return id < nconns ? conns[id] : NULL;
+}
+
+static struct secret *findSecret(int kind, unsigned long long traced, int add) {
+    struct secret **bucket = &secrets[(traced ^ traced >> 29) % SECRET_BUCKETS], *s;
+
+    for (s = *bucket; s; s = s->next)
+        if (s->kind == kind && s->traced == traced)
+            return s;
+    if (!add)
+        return NULL;
+    if ((s = calloc(1, sizeof(*s))) == NULL)
+        error("ERROR allocating secret");
+    s->kind = kind;
+    s->traced = traced;
+    s->next = *bucket;
+    *bucket = s;
+    return s;
+}
+
+static void issueSecret(struct rconn *c, int kind, unsigned long long traced) {
+    struct secret **issued = realloc(c->issued[kind], (c->nissued[kind] + 1) * sizeof(*issued));
+
+    if (issued == NULL)
+        error("ERROR allocating secret");
+    issued[c->nissued[kind]++] = findSecret(kind, traced, 1);
+    c->issued[kind] = issued;
+}
+
+/* The replayed server handed the client its next secret of the kind. */
+static void learnSecret(struct rconn *c, int kind, unsigned long long replayed) {
+    struct secret *s;
+
+    if (c->learned[kind] == c->nissued[kind])
+        return;
+    s = c->issued[kind][c->learned[kind]++];
+    s->replayed = replayed;
+    s->known = 1;
+    woken = 1;
+}
+
+/* A client that will not get the rest of its secrets: whoever quotes
+ * them sends them unchanged. */
+static void forgetSecrets(struct rconn *c) {
+    for (int kind = 0; kind < 2; kind++)
+        while (c->learned[kind] < c->nissued[kind])
+            learnSecret(c, kind, c->issued[kind][c->learned[kind]]->traced);
+}
+
+static void addPatch(struct rconn *c, long off, int len, struct secret *s, unsigned char **at) {
+    struct patch *p;
+
+    c->patches = grow(c->patches, &c->cap_patches, c->npatches, sizeof(*c->patches));
+    p = &c->patches[c->npatches++];
+    p->off = off;
+    p->len = len;
+    p->s = s;
+    memcpy(p->at, at, len * sizeof(*at));
+}
+
+/* Finds the frames of a client that quote a traced room code or token:
+ * ints after the hello, ROOM_RESUME with 8 more bytes. */
+static void findPatches(struct rconn *c) {
+    unsigned char frame[RESUME_LEN], *at[RESUME_LEN];
+    int have = 0, want = sizeof(int), skip = 0;
+    struct secret *s;
+
+    if (c->nsteps && c->steps[0].len >= HELLO_TAG_LEN &&
+        (!memcmp(c->steps[0].data, HELLO_SCK, HELLO_TAG_LEN) || !memcmp(c->steps[0].data, HELLO_SHM, HELLO_TAG_LEN)))
+        skip = HELLO_LEN;
+    for (int i = 0; i < c->nsteps; i++) {
+        struct step *st = &c->steps[i];
+
+        for (int j = 0; j < st->len; j++) {
+            int move;
+            if (skip) {
+                skip--;
+                continue;
+            }
+            frame[have] = st->data[j];
+            at[have++] = &st->data[j];
+            if (have < want)
+                continue;
+            if (want == RESUME_LEN) {
+                unsigned long long token = 0;
+                for (int k = sizeof(int); k < RESUME_LEN; k++)
+                    token = token << 8 | frame[k];
+                if ((s = findSecret(SECRET_TOKEN, token, 0)) != NULL)
+                    addPatch(c, st->off + j + 1 - 8, 8, s, at + sizeof(int));
+            } else {
+                protoDecodeMove((const char *)frame, have, &move);
+                if (move == ROOM_RESUME) {
+                    want = RESUME_LEN;
+                    continue;
+                }
+                if (move > 0 && (s = findSecret(SECRET_ROOM, move, 0)) != NULL)
+                    addPatch(c, st->off + j + 1 - sizeof(int), sizeof(int), s, at);
+            }
+            have = 0;
+            want = sizeof(int);
+        }
+    }
+}
+
+/* Puts the replayed secrets into the bytes of the next step. Returns -1
+ * if one of them is not known yet. */
+static int applyPatches(struct rconn *c, const struct step *st) {
+    while (c->next_patch < c->npatches && c->patches[c->next_patch].off < st->off + st->len) {
+        struct patch *p = &c->patches[c->next_patch];
+        char buf[sizeof(int)];
+
+        if (!p->s->known) {
+            c->blocked = 1;
+            return -1;
+        }
+        if (p->s->kind == SECRET_ROOM) {
+            protoEncodeMove(p->s->replayed, buf);
+            for (int i = 0; i < p->len; i++)
+                *p->at[i] = buf[i];
+        } else {
+            for (int i = 0; i < p->len; i++)
+                *p->at[i] = p->s->replayed >> (56 - 8 * i);
+        }
+        c->next_patch++;
+    }
+    return 0;
+}
+
+/* Reads the trace into conns and the time ordered list of actions. The
+ * step data points into buf, which has to stay around. */
+static void loadTrace(unsigned char *buf, long len) {
+    struct trace_reader r;
+    struct trace_rec rec;
+    struct rconn *c;
+    int n;
+
+    if (traceReaderInit(&r, buf, len) < 0) {
+        fprintf(stderr, "ERROR not a trace file\n");
+        exit(EXIT_FAILURE);
+    }
+    while ((n = traceNext(&r, &rec)) > 0) {
+        if (rec.type == TRACE_OPEN) {
+            if (rec.id >= nconns) {
+                unsigned want = rec.id + 1 > nconns * 2 ? rec.id + 1 : nconns * 2;
+                conns = realloc(conns, want * sizeof(*conns));
+                if (conns == NULL)
+                    error("ERROR allocating connections");
+                memset(conns + nconns, 0, (want - nconns) * sizeof(*conns));
+                nconns = want;
+            }
+            c = calloc(1, sizeof(*c));
+            if (c == NULL)
+                error("ERROR allocating connection");
+            c->id = rec.id;
+            c->flags = rec.arg;
+            c->result = RESULT_NONE;
+            c->got = RESULT_NONE;
+            c->fd = -1;
+            conns[rec.id] = c;
+            addAction(rec.time_us, TRACE_OPEN, c);
+            continue;
+        }
+
+        /* Connections opened before the capture started are skipped. */
+        if ((c = findConn(rec.id)) == NULL)
+            continue;
+        if (rec.type == TRACE_DATA) {
+            long cap = c->cap;
+            c->steps = grow(c->steps, &cap, c->nsteps, sizeof(*c->steps));
+            c->cap = cap;
+            c->steps[c->nsteps].at_us = rec.time_us;
+            c->steps[c->nsteps].turns = c->turns_traced;
+            c->steps[c->nsteps].off = c->stream_len;
+            c->steps[c->nsteps].len = rec.len;
+            c->steps[c->nsteps].data = buf + (rec.data - buf);
+            c->stream_len += rec.len;
+            c->nsteps++;
+            addAction(rec.time_us, TRACE_DATA, c);
+        } else if (rec.type == TRACE_TURN) {
+            c->turns_traced++;
+        } else if (rec.type == TRACE_RESULT) {
+            c->result = rec.arg;
+        } else if (rec.type == TRACE_CLOSE) {
+            addAction(rec.time_us, TRACE_CLOSE, c);
+        } else if (rec.type == TRACE_ROOM) {
+            issueSecret(c, SECRET_ROOM, rec.value);
+        } else if (rec.type == TRACE_TOKEN) {
+            issueSecret(c, SECRET_TOKEN, rec.value);
+        }
+    }
+    if (n < 0)
+        fprintf(stderr, "Trace cut short, replaying what was read.\n");
+    for (unsigned i = 0; i < nconns; i++)
+        if (conns[i])
+            findPatches(conns[i]);
+}
+
+static void finish(struct rconn *c) {
+    if (c->fd >= 0) {
+        close(c->fd);   /* Also takes it out of epoll. */
+        live--;
+    }
+    c->fd = -1;
+    c->done = 1;
+    forgetSecrets(c);
+}
+
+static void openConn(struct rconn *c) {
+    struct epoll_event ev = { EPOLLIN | EPOLLOUT, { .ptr = c } };
+    int on_unix = (c->flags & TRACE_UNIX) && unix_path;
+    int fd = socket(on_unix ? AF_UNIX : AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int r;
+
+    if (fd < 0)
+        error("ERROR opening socket");
+    if (on_unix)
+        r = connect(fd, (struct sockaddr *)&unix_addr, sizeof(unix_addr));
+    else
+        r = connect(fd, (struct sockaddr *)&tcp_addr, sizeof(tcp_addr));
+    if (r < 0 && errno != EINPROGRESS) {
+        close(fd);
+        failed_connects++;
+        c->done = 1;
+        forgetSecrets(c);
+        return;
+    }
+    c->fd = fd;
+    c->connecting = 1;
+    live++;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        error("ERROR adding to epoll");
+}
+
+/* Sends the steps that are due and allowed, then closes the connection
+ * if the client closed it by now. */
+static void trySend(struct rconn *c) {
+    if (c->fd < 0 || c->connecting)
+        return;
+    while (c->sent < c->released && c->turns >= c->steps[c->sent].turns) {
+        struct step *st = &c->steps[c->sent];
+        char buf[256];
+        const void *data = st->data;
+
+        if (applyPatches(c, st) < 0)
+            return;
+
+        /* Bytes starting with a shared memory hello ask for the socket. */
+        if (c->sent == 0 && st->len >= HELLO_LEN && !memcmp(st->data, HELLO_SHM, HELLO_TAG_LEN) &&
+            st->len <= (int)sizeof(buf)) {
+            memcpy(buf, st->data, st->len);
+            memcpy(buf, HELLO_SCK, HELLO_TAG_LEN);
+            data = buf;
+        }
+        if (c->sent == 0 && st->len >= HELLO_LEN &&
+            (!memcmp(data, HELLO_SCK, HELLO_TAG_LEN) || !memcmp(data, HELLO_SHM, HELLO_TAG_LEN)))
+            c->hello = 1;
+
+        if (send(c->fd, data, st->len, MSG_NOSIGNAL) != st->len) {
+            finish(c);
+            return;
+        }
+        if (!c->sent_ns)
+            c->sent_ns = nowNs();
+        c->sent++;
+    }
+    if (c->close_due && c->sent == c->nsteps && (c->got != RESULT_NONE || c->result == RESULT_NONE))
+        finish(c);
+}
+
+static void addLatency(long long ns) {
+    latency = grow(latency, &cap_latency, nlatency, sizeof(*latency));
+    latency[nlatency++] = ns;
+}
+
+/* Follows the server's side of the conversation: TRNs and the result.
+ * A PLY counts as what it carries; one with MSG_INV grants a turn too. */
+static void parseInput(struct rconn *c) {
+    struct msg m;
+    int off = 0, n;
+
+    if (c->hello) {
+        if (c->in_len < HELLO_LEN)
+            return;
+        off = HELLO_LEN;
+        c->hello = 0;
+    }
+    while ((n = protoDecode(c->in + off, c->in_len - off, &m)) > 0) {
+        off += n;
+        if (m.type == MSG_PLY)
+            m.type = m.next == MSG_INV ? MSG_TRN : m.next;
+        if (m.type == MSG_TRN)
+            c->turns++;
+        else if (m.type == MSG_WIN || m.type == MSG_LSE || m.type == MSG_DRW)
+            c->got = m.type;
+        else if (m.type == MSG_ROM)
+            learnSecret(c, SECRET_ROOM, m.code);
+        else if (m.type == MSG_TOK)
+            learnSecret(c, SECRET_TOKEN, m.token);
+    }
+    if (n < 0) {
+        protocol_errors++;
+        finish(c);
+        return;
+    }
+    c->in_len -= off;
+    memmove(c->in, c->in + off, c->in_len);
+}
+
+static void handleConn(struct rconn *c, int events) {
+    if (c->connecting && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+        struct epoll_event ev = { EPOLLIN, { .ptr = c } };
+        int err = 0;
+        socklen_t len = sizeof(err);
+
+        getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err) {
+            failed_connects++;
+            finish(c);
+            return;
+        }
+        c->connecting = 0;
+        epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+    }
+
+    if (events & EPOLLIN) {
+        for (;;) {
+            int n = read(c->fd, c->in + c->in_len, IN_LEN - c->in_len);
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            if (n <= 0) {
+                finish(c);
+                return;
+            }
+            if (c->sent_ns) {
+                addLatency(nowNs() - c->sent_ns);
+                c->sent_ns = 0;
+            }
+            c->in_len += n;
+            parseInput(c);
+            if (c->fd < 0)
+                return;
+        }
+    }
+    trySend(c);
+}
+
+static int cmpLatency(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(double p) {
+    long i = (long)(p / 100 * nlatency);
+    return latency[i < nlatency ? i : nlatency - 1] / 1e3;
+}
+
+static const char *resultName(int result) {
+    return result == RESULT_NONE ? "none" : protoTag(result);
+}
+
+int main(int argc, char *argv[]) {
+    struct epoll_event events[MAX_EVENTS];
+    double speed = 1;
+    const char *address = "127.0.0.1";
+    unsigned char *buf;
+    struct stat st;
+    long next = 0, diverged = 0, opened = 0;
+    long long start, last_progress;
+    int opt, fd;
+
+    while ((opt = getopt(argc, argv, "x:u:a:")) != -1) {
+        if (opt == 'x')
+            speed = strtod(optarg, NULL);
+        else if (opt == 'u')
+            unix_path = optarg;
+        else if (opt == 'a')
+            address = optarg;
+        else
+            optind = argc + 1;
+    }
+    if (optind + 2 != argc || speed <= 0) {
+        fprintf(stderr, "Usage : ./replay.out [-x speed] [-u unix socket path] [-a address] <trace file> <port>\n");
+        exit(EXIT_FAILURE);
+    }
+
+    fd = open(argv[optind], O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0)
+        error("ERROR opening trace");
+    buf = malloc(st.st_size ? st.st_size : 1);
+    if (buf == NULL || read(fd, buf, st.st_size) != st.st_size)
+        error("ERROR reading trace");
+    close(fd);
+    loadTrace(buf, st.st_size);
+
+    tcp_addr.sin_family = AF_INET;
+    tcp_addr.sin_port = htons(strtol(argv[optind + 1], NULL, 10));
+    if (inet_pton(AF_INET, address, &tcp_addr.sin_addr) != 1) {
+        fprintf(stderr, "ERROR bad address %s\n", address);
+        exit(EXIT_FAILURE);
+    }
+    if (unix_path) {
+        unix_addr.sun_family = AF_UNIX;
+        strncpy(unix_addr.sun_path, unix_path, sizeof(unix_addr.sun_path) - 1);
+    }
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0)
+        error("ERROR creating epoll instance");
+
+    start = last_progress = nowNs();
+    for (;;) {
+        long long now = nowNs();
+        int timeout = -1, n;
+
+        /* Everything that is due. */
+        while (next < nactions && actions[next].at_us * 1000 / speed <= now - start) {
+            struct action *a = &actions[next++];
+            if (a->c->done)
+                continue;
+            if (a->type == TRACE_OPEN) {
+                openConn(a->c);
+                opened++;
+            } else if (a->type == TRACE_DATA) {
+                a->c->released++;
+                trySend(a->c);
+            } else {
+                a->c->close_due = 1;
+                trySend(a->c);
+            }
+        }
+
+        /* Clients waiting for a secret that came in. */
+        while (woken) {
+            woken = 0;
+            for (unsigned i = 0; i < nconns; i++) {
+                if (conns[i] && conns[i]->blocked) {
+                    conns[i]->blocked = 0;
+                    trySend(conns[i]);
+                }
+            }
+        }
+
+        if (next == nactions && live == 0)
+            break;
+        if (now - last_progress > IDLE_MS * 1000000LL) {
+            fprintf(stderr, "Server idle for %d ms, giving up on %ld connections.\n", IDLE_MS, live);
+            break;
+        }
+
+        if (next < nactions) {
+            long long left = actions[next].at_us * 1000 / speed - (now - start);
+            timeout = left > 0 ? (left + 999999) / 1000000 : 0;
+        }
+        if (timeout < 0 || timeout > IDLE_MS)
+            timeout = IDLE_MS;
+
+        n = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+        if (n < 0 && errno != EINTR)
+            error("ERROR waiting for events");
+        if (n > 0 || next < nactions)
+            last_progress = nowNs();
+        for (int i = 0; i < n; i++)
+            handleConn(events[i].data.ptr, events[i].events);
+    }
+
+    double elapsed = (nowNs() - start) / 1e9;
+    printf("connections: %ld  speed: %gx  elapsed: %.3f s  frames/sec: %.0f\n",
+           opened, speed, elapsed, nlatency / (elapsed > 0 ? elapsed : 1));
+    if (nlatency) {
+        qsort(latency, nlatency, sizeof(*latency), cmpLatency);
+        printf("latency us: p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f  (%ld samples)\n",
+               percentile(50), percentile(90), percentile(99), percentile(99.9),
+               latency[nlatency - 1] / 1e3, nlatency);
+    }
+    for (unsigned i = 0; i < nconns; i++) {
+        struct rconn *c = conns[i];
+        if (c && c->got != c->result) {
+            if (diverged++ < 10)
+                printf("  connection %u: traced %s, replayed %s\n", c->id, resultName(c->result), resultName(c->got));
+        }
+    }
+    printf("divergences: %ld  failed connects: %ld  protocol errors: %ld\n",
+           diverged, failed_connects, protocol_errors);
+    return diverged || failed_connects || protocol_errors ? 1 : 0;
+}
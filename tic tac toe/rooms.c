@@ -0,0 +1,87 @@
+/****************************************************************************
+*       Lock free index from lobby room codes to rooms.
+*
+*****************************************************************************/
+
+#include <stddef.h>
+#include <sys/mman.h>
+
+#include "rooms.h"
+
+static unsigned home(struct room_index *ix, uint32_t key) {
+    /* Fibonacci hashing; the top bits are the best mixed. */
+    return (uint32_t)(key * 2654435769u) >> ix->shift;
+}
+
+int roomIndexInit(struct room_index *ix, unsigned capacity) {
+    unsigned nslots = ROOM_WINDOW;
+    int bits = 3;
+    void *p;
+
+    while (nslots < capacity * 2) {
+        nslots *= 2;
+        bits++;
+    }
+    /* Fresh anonymous pages are zero, that is empty, and cost nothing
+     * until touched. */
+    p = mmap(NULL, nslots * sizeof(uint64_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return -1;
+    ix->slots = p;
+    ix->mask = nslots - 1;
+    ix->shift = 32 - bits;
+    return 0;
+}
+
+void roomIndexFree(struct room_index *ix) {
+    munmap((void *)ix->slots, (ix->mask + 1) * sizeof(uint64_t));
+    ix->slots = NULL;
+}
+
+int roomIndexInsert(struct room_index *ix, uint32_t key, uint32_t value) {
+    unsigned h = home(ix, key);
+    uint64_t entry = (uint64_t)value << 32 | key;
+
+    for (unsigned i = 0; i < ROOM_WINDOW; i++)
+        if ((uint32_t)atomic_load_explicit(&ix->slots[(h + i) & ix->mask], memory_order_acquire) == key)
+            return ROOM_EXISTS;
+
+    for (unsigned i = 0; i < ROOM_WINDOW; i++) {
+        uint64_t empty = 0;
+        if (atomic_compare_exchange_strong_explicit(&ix->slots[(h + i) & ix->mask], &empty, entry,
+                                                    memory_order_acq_rel, memory_order_relaxed))
+            return ROOM_OK;
+    }
+    return ROOM_FULL;
+}
+
+int roomIndexFind(struct room_index *ix, uint32_t key, uint32_t *value) {
+    unsigned h = home(ix, key);
+
+    for (unsigned i = 0; i < ROOM_WINDOW; i++) {
+        uint64_t entry = atomic_load_explicit(&ix->slots[(h + i) & ix->mask], memory_order_acquire);
+        if ((uint32_t)entry == key) {
+            *value = entry >> 32;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int roomIndexTake(struct room_index *ix, uint32_t key, uint32_t *value) {
+    unsigned h = home(ix, key);
+
+    for (unsigned i = 0; i < ROOM_WINDOW; i++) {
+        _Atomic uint64_t *slot = &ix->slots[(h + i) & ix->mask];
+        uint64_t entry = atomic_load_explicit(slot, memory_order_acquire);
+
+        if ((uint32_t)entry != key)
+            continue;
+        /* Losing the race means another thread took it. */
+        if (!atomic_compare_exchange_strong_explicit(slot, &entry, 0, memory_order_acq_rel, memory_order_relaxed))
+            return 0;
+        *value = entry >> 32;
+        return 1;
+    }
+    return 0;
+}
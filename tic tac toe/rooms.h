@@ -0,0 +1,52 @@
+/****************************************************************************
+*       Index from lobby room codes to rooms, safe to read and write from
+*       any number of threads without a lock.
+*
+*       Open addressing: an entry lives in one of the ROOM_WINDOW slots
+*       that follow its home slot. Every slot is one 64 bit word with the
+*       key in the low half and the value in the high half, so entries
+*       appear and disappear with a single compare and swap and a reader
+*       sees either all of an entry or nothing. Lookups scan the whole
+*       window, which is at most two cache lines, so removing an entry
+*       just clears its slot and there are no tombstones to clean up.
+*
+*       The same key must not be inserted by two threads at once; keys
+*       picked at random by the one that inserts them are fine. A key
+*       whose window is full cannot go in, so the table gets twice as
+*       many slots as the capacity asked for.
+*
+*****************************************************************************/
+
+#ifndef ROOMS_H
+#define ROOMS_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#define ROOM_WINDOW 8
+
+/* roomIndexInsert results. */
+#define ROOM_OK      0
+#define ROOM_EXISTS -1
+#define ROOM_FULL   -2
+
+struct room_index {
+    _Atomic uint64_t *slots;
+    unsigned mask;
+    int shift;
+};
+
+/* Sizes the index for capacity entries. Returns -1 if out of memory. */
+int roomIndexInit(struct room_index *ix, unsigned capacity);
+void roomIndexFree(struct room_index *ix);
+
+/* Keys must not be 0. */
+int roomIndexInsert(struct room_index *ix, uint32_t key, uint32_t value);
+
+/* Return 1 and set *value if the key is there, 0 if not. roomIndexTake
+ * also removes the entry; of several threads taking the same key, only
+ * one gets it. */
+int roomIndexFind(struct room_index *ix, uint32_t key, uint32_t *value);
+int roomIndexTake(struct room_index *ix, uint32_t key, uint32_t *value);
+
+#endif
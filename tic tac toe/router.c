@@ -0,0 +1,856 @@
+/****************************************************************************
+*       Front end that spreads games over several game servers.
+*
+*       Usage : ./router.out -b address:port:admin port [-b ...] <port>
+*
+*       Clients connect to the router as they would to a server. The
+*       router answers their hello itself, pairs quick match clients and
+*       connects each player to a backend server.out. There it opens a
+*       lobby room for the pair: the first player creates the room, the
+*       second joins it by its code, so the backend pairs exactly these
+*       two. Lobby clients are routed as well. A client that creates a
+*       room, or asks to play the computer, goes where a new game would;
+*       for a room the router notes which backend owns the code, so that
+*       clients joining by the code end up on the same backend.
+*
+*       Every new game gets an id, and goes to the backend that owns the
+*       id on a consistent hash ring with VNODES points per backend, so
+*       adding or removing a backend only moves its own share of games.
+*       A backend that is down, or has more than twice the load of the
+*       least loaded one plus LOAD_SLACK, loses the game to the least
+*       loaded one. Every HEALTH_MS the router asks the admin port of
+*       each backend (server.out -a) for its status. A backend that does
+*       not answer in time, or says BUSY, is down until it says OK again;
+*       the games it reports plus the games sent there since are its
+*       load.
+*
+*       Once a player is on its backend the router gets out of the way:
+*       bytes go from socket to pipe to socket with splice(2) and never
+*       enter user space. The backend ends the game and closes both of
+*       its connections; the router closes each client once the last
+*       bytes from the backend are through. A player whose backend fails
+*       before that gets BSY, and so does its opponent.
+*
+*       The router never offers the shared memory ring; clients that ask
+*       for it stay on the socket. Nor does it offer FEATURE_RESUME: a
+*       resume token does not say which backend holds the game.
+*
+*****************************************************************************/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "conn.h"
+#include "proto.h"
+#include "rooms.h"
+
+#define MAX_EVENTS 256
+#define MAX_BACKENDS 64
+#define VNODES 160          /* Points per backend on the hash ring. */
+#define LOAD_SLACK 16
+#define HEALTH_MS 1000
+#define HELLO_WAIT_MS 100   /* Same as the server's. */
+#define CODES_MAX (1 << 16) /* Room codes remembered at once. */
+#define CODE_TTL_MS (5 * 60 * 1000)    /* ROOM_TTL_MS of the server. */
+#define PIPE_LEN 65536
+
+/* What an epoll event points at; every source starts with its kind. */
+#define SOURCE_LISTENER 0
+#define SOURCE_CLIENT   1   /* A player's client socket. */
+#define SOURCE_BACKEND  2   /* A player's backend socket. */
+#define SOURCE_HEALTH   3   /* A health check in flight. */
+
+/* Player states. */
+#define PLAYER_HELLO   0    /* Waiting for the client's hello, if any. */
+#define PLAYER_LOBBY   1    /* Waiting for the client's lobby request. */
+#define PLAYER_WAITING 2    /* Waiting for an opponent. */
+#define PLAYER_CONNECT 3    /* Connecting to the backend. */
+#define PLAYER_ANSWER  4    /* Waiting for the backend's hello. */
+#define PLAYER_CODE    5    /* Second of a pair, waiting for the room code. */
+#define PLAYER_ROOM    6    /* Waiting for ROM or NRM. */
+#define PLAYER_SPLICE  7
+#define PLAYER_CLOSED  8
+
+/* What a player asks its backend for. */
+#define ASK_HOST   0        /* A room for the pair, not shown to the client. */
+#define ASK_GUEST  1        /* The pair's room. */
+#define ASK_CREATE 2        /* The client's own ROOM_CREATE. */
+#define ASK_JOIN   3        /* The client's own code. */
+#define ASK_BOT    4        /* The client's own ROOM_BOT. */
+
+struct player;
+
+struct endpoint {
+    int kind;
+    int fd;                 /* -1 once closed. */
+    struct player *p;
+};
+
+/* One direction of a spliced player. */
+struct flow {
+    int pipe[2];
+    int len;                /* Bytes in the pipe. */
+    int eof;
+};
+
+struct backend {
+    int kind;               /* SOURCE_HEALTH, for the check in flight. */
+    const char *name;
+    struct sockaddr_in addr, admin;
+    int up;
+    int games;              /* As of the last check. */
+    int sent;               /* Games sent there since. */
+    int check_fd;           /* -1 unless a check is in flight. */
+    char line[128];
+    int line_len;
+};
+
+struct player {
+    struct endpoint client, backend;
+    int state;
+    int hello;              /* The client sent a hello. */
+    int features;
+    int ask;
+    unsigned code;          /* Room of the pair, 0 until known. */
+    long hello_deadline;    /* ms */
+    char in[MSG_MAX_LEN];   /* Frame being read. */
+    int in_len;
+    struct player *partner; /* Other half of a pair, until both are in. */
+    struct backend *b;
+    struct flow up, down;   /* Client to backend and back. */
+    struct player *next;    /* Hello queue, then the closed list. */
+};
+
+struct point {
+    uint32_t hash;
+    int backend;
+};
+
+struct code_entry {
+    unsigned code;
+    int backend;
+    long deadline;          /* ms */
+};
+
+static struct backend backends[MAX_BACKENDS];
+static int nbackends;
+static struct point ring[MAX_BACKENDS * VNODES];
+static int nring;
+static int epfd;
+static struct player *hello_head, *hello_tail;
+static struct player *waiting;
+static struct player *closed;
+static unsigned next_game = 1;
+static struct room_index codes;     /* Room code to backend. */
+static struct code_entry code_queue[CODES_MAX];     /* By deadline. */
+static int code_head, ncodes;
+
+void error(const char *msg) {
+    perror(msg);
+    exit(EXIT_FAILURE);
+}
+
+static long nowMs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+/* splitmix64 finalizer. */
+static uint32_t mix(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x >> 32;
+}
+
+static int cmpPoint(const void *a, const void *b) {
+    uint32_t x = ((const struct point *)a)->hash, y = ((const struct point *)b)->hash;
+    return x < y ? -1 : x > y;
+}
+
+/* Points come from the backend's address, not its position on the
+ * command line, so the ring is the same whatever the order. */
+static void buildRing(void) {
+    for (int i = 0; i < nbackends; i++) {
+        uint64_t id = (uint64_t)ntohl(backends[i].addr.sin_addr.s_addr) << 32 |
+                      (uint64_t)ntohs(backends[i].addr.sin_port) << 16;
+        for (int v = 0; v < VNODES; v++) {
+            ring[nring].hash = mix(id | v);
+            ring[nring].backend = i;
+            nring++;
+        }
+    }
+    qsort(ring, nring, sizeof(*ring), cmpPoint);
+}
+
+static int load(const struct backend *b) {
+    return b->games + b->sent;
+}
+
+/* Returns NULL if every backend is down. */
+static struct backend *pickBackend(unsigned game) {
+    uint32_t h = mix(game);
+    struct backend *b, *least = NULL;
+    int lo = 0, hi = nring;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (ring[mid].hash < h)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    b = &backends[ring[lo % nring].backend];
+
+    for (int i = 0; i < nbackends; i++)
+        if (backends[i].up && (least == NULL || load(&backends[i]) < load(least)))
+            least = &backends[i];
+    if (least == NULL)
+        return NULL;
+    if (!b->up || load(b) > 2 * load(least) + LOAD_SLACK)
+        b = least;
+    b->sent++;
+    return b;
+}
+
+static void setBackendUp(struct backend *b, int up) {
+    if (b->up != up)
+        printf("Backend %s is %s.\n", b->name, up ? "up" : "down");
+    b->up = up;
+}
+
+static void parseBackend(struct backend *b, char *arg) {
+    char *port = strchr(arg, ':');
+    char *admin = port ? strchr(port + 1, ':') : NULL;
+
+    if (nbackends == MAX_BACKENDS || admin == NULL) {
+        fprintf(stderr, "ERROR backends are address:port:admin port, at most %d\n", MAX_BACKENDS);
+        exit(EXIT_FAILURE);
+    }
+    b->name = strdup(arg);
+    *port++ = 0;
+    *admin++ = 0;
+    b->addr.sin_family = b->admin.sin_family = AF_INET;
+    if (inet_pton(AF_INET, arg, &b->addr.sin_addr) != 1) {
+        fprintf(stderr, "ERROR bad address %s\n", arg);
+        exit(EXIT_FAILURE);
+    }
+    b->admin.sin_addr = b->addr.sin_addr;
+    b->addr.sin_port = htons(strtol(port, NULL, 10));
+    b->admin.sin_port = htons(strtol(admin, NULL, 10));
+    b->kind = SOURCE_HEALTH;
+    b->up = 1;              /* Until a check says otherwise. */
+    b->check_fd = -1;
+    nbackends++;
+}
+
+/* Room codes, so clients joining by code go where the room is. */
+static void forgetCode(struct code_entry *e) {
+    uint32_t backend;
+
+    /* The code may have been taken, or reused by another backend since. */
+    if (roomIndexFind(&codes, e->code, &backend) && (int)backend == e->backend)
+        roomIndexTake(&codes, e->code, &backend);
+}
+
+static void rememberCode(unsigned code, int backend) {
+    struct code_entry *e;
+    uint32_t old;
+
+    if (ncodes == CODES_MAX) {
+        forgetCode(&code_queue[code_head]);
+        code_head = (code_head + 1) % CODES_MAX;
+        ncodes--;
+    }
+    if (roomIndexInsert(&codes, code, backend) == ROOM_EXISTS) {
+        roomIndexTake(&codes, code, &old);
+        roomIndexInsert(&codes, code, backend);
+    }
+    e = &code_queue[(code_head + ncodes++) % CODES_MAX];
+    e->code = code;
+    e->backend = backend;
+    e->deadline = nowMs() + CODE_TTL_MS;
+}
+
+static void expireCodes(void) {
+    long now = nowMs();
+
+    while (ncodes && code_queue[code_head].deadline <= now) {
+        forgetCode(&code_queue[code_head]);
+        code_head = (code_head + 1) % CODES_MAX;
+        ncodes--;
+    }
+}
+
+static void watch(int fd, int events, void *source) {
+    struct epoll_event ev = { events, { .ptr = source } };
+
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        error("ERROR adding to epoll");
+}
+
+static void noDelay(int fd) {
+    int option = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &option, sizeof(option));
+}
+
+/* Small frames go out whole or the connection is no good. */
+static int sendAll(int fd, const void *buf, int len) {
+    return send(fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL) == len ? 0 : -1;
+}
+
+static int sendMsgType(int fd, int type) {
+    struct msg m = { type };
+    char buf[MSG_MAX_LEN];
+
+    return sendAll(fd, buf, protoEncode(&m, buf));
+}
+
+static int sendMove(int fd, int move) {
+    char buf[sizeof(int)];
+
+    return sendAll(fd, buf, protoEncodeMove(move, buf));
+}
+
+/* Reads until the frame being read has len bytes. Returns 1 once it has,
+ * 0 if the rest is not there yet and -1 if the peer went away. */
+static int readFrame(struct player *p, int fd, int len) {
+    while (p->in_len < len) {
+        int n = recv(fd, p->in + p->in_len, len - p->in_len, 0);
+
+        if (n > 0)
+            p->in_len += n;
+        else if (n < 0 && errno == EAGAIN)
+            return 0;
+        else if (n == 0 || errno != EINTR)
+            return -1;
+    }
+    return 1;
+}
+
+static void unqueueHello(struct player *p) {
+    struct player **pp = &hello_head;
+
+    /* Only players that just arrived are on it, so it stays short. */
+    while (*pp && *pp != p)
+        pp = &(*pp)->next;
+    if (*pp == NULL)
+        return;
+    *pp = p->next;
+    if (hello_tail == p) {
+        hello_tail = NULL;
+        for (struct player *q = hello_head; q; q = q->next)
+            hello_tail = q;
+    }
+    p->next = NULL;
+}
+
+static void closeEndpoint(struct endpoint *e) {
+    if (e->fd >= 0)
+        close(e->fd);   /* Also takes it out of epoll. */
+    e->fd = -1;
+}
+
+static void closeFlow(struct flow *f) {
+    if (f->pipe[0] >= 0) {
+        close(f->pipe[0]);
+        close(f->pipe[1]);
+    }
+    f->pipe[0] = f->pipe[1] = -1;
+}
+
+static void failPlayer(struct player *p);
+
+/* The memory goes once the events in hand are handled. */
+static void closePlayer(struct player *p) {
+    struct player *partner = p->partner;
+
+    if (p->state == PLAYER_CLOSED)
+        return;
+    if (p->state == PLAYER_HELLO)
+        unqueueHello(p);
+    if (waiting == p)
+        waiting = NULL;
+    p->state = PLAYER_CLOSED;
+    closeEndpoint(&p->client);
+    closeEndpoint(&p->backend);
+    closeFlow(&p->up);
+    closeFlow(&p->down);
+    p->next = closed;
+    closed = p;
+
+    /* A pair that is not on its backend yet breaks up. */
+    p->partner = NULL;
+    if (partner) {
+        partner->partner = NULL;
+        failPlayer(partner);
+    }
+}
+
+/* Tells the client the game is off. */
+static void failPlayer(struct player *p) {
+    if (p->state == PLAYER_CLOSED)
+        return;
+    sendMsgType(p->client.fd, MSG_BSY);
+    closePlayer(p);
+}
+
+static void backendFailed(struct player *p) {
+    setBackendUp(p->b, 0);
+    failPlayer(p);
+}
+
+/* Moves what it can one way. Returns -1 once that way is done with. */
+static int pumpFlow(struct flow *f, int from, int to) {
+    for (;;) {
+        ssize_t n;
+
+        if (f->len) {
+            n = splice(f->pipe[0], NULL, to, NULL, f->len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n < 0)
+                return errno == EAGAIN ? 0 : -1;
+            f->len -= n;
+            continue;
+        }
+        if (f->eof)
+            return -1;
+        n = splice(from, NULL, f->pipe[1], NULL, PIPE_LEN, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n < 0)
+            return errno == EAGAIN ? 0 : -1;
+        if (n == 0)
+            f->eof = 1;
+        f->len = n;
+    }
+}
+
+/* Runs both ways. Edge triggered, so it goes until neither way can move. */
+static void pump(struct player *p) {
+    if (pumpFlow(&p->up, p->client.fd, p->backend.fd) < 0 ||
+        pumpFlow(&p->down, p->backend.fd, p->client.fd) < 0)
+        closePlayer(p);
+}
+
+static void startSplice(struct player *p) {
+    if (pipe2(p->up.pipe, O_NONBLOCK | O_CLOEXEC) < 0 ||
+        pipe2(p->down.pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+        perror("ERROR creating pipes");
+        failPlayer(p);
+        return;
+    }
+    p->state = PLAYER_SPLICE;
+    /* Whatever either side sent in the meantime is already waiting. */
+    pump(p);
+}
+
+/* The second of a pair joins the room of the first. */
+static void joinPair(struct player *p) {
+    if (sendMove(p->backend.fd, p->code) < 0) {
+        backendFailed(p);
+        return;
+    }
+    /* Both are in; the backend has the game now. */
+    p->partner->partner = NULL;
+    p->partner = NULL;
+    startSplice(p);
+}
+
+static void startBackend(struct player *p, struct backend *b) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    p->b = b;
+    p->backend.fd = fd;
+    p->state = PLAYER_CONNECT;
+    p->in_len = 0;
+    if (fd < 0 || (connect(fd, (struct sockaddr *)&b->addr, sizeof(b->addr)) < 0 && errno != EINPROGRESS)) {
+        backendFailed(p);
+        return;
+    }
+    noDelay(fd);
+    watch(fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, &p->backend);
+}
+
+static void quickMatch(struct player *p) {
+    struct player *first = waiting;
+    struct backend *b;
+    unsigned game;
+
+    if (first == NULL) {
+        p->state = PLAYER_WAITING;
+        waiting = p;
+        return;
+    }
+    waiting = NULL;
+    game = next_game++;
+    if ((b = pickBackend(game)) == NULL) {
+        printf("No backend for game %u.\n", game);
+        failPlayer(first);
+        failPlayer(p);
+        return;
+    }
+    printf("Game %u on %s.\n", game, b->name);
+    first->partner = p;
+    p->partner = first;
+    first->ask = ASK_HOST;
+    p->ask = ASK_GUEST;
+    startBackend(first, b);
+    if (p->partner)     /* Unless the first one failed already. */
+        startBackend(p, b);
+}
+
+static void handleLobby(struct player *p, int move) {
+    struct backend *b;
+    uint32_t backend;
+
+    if (move == ROOM_CREATE || move == ROOM_BOT) {
+        if ((b = pickBackend(next_game++)) == NULL) {
+            failPlayer(p);
+            return;
+        }
+        p->ask = move == ROOM_BOT ? ASK_BOT : ASK_CREATE;
+        startBackend(p, b);
+    } else if (move == ROOM_ANY) {
+        quickMatch(p);
+    } else if (move > 0 && roomIndexTake(&codes, move, &backend)) {
+        p->ask = ASK_JOIN;
+        p->code = move;
+        startBackend(p, &backends[backend]);
+    } else if (move > 0) {
+        if (sendMsgType(p->client.fd, MSG_NRM) < 0)
+            closePlayer(p);
+    } else if (move != RESYNC_REQUEST) {
+        closePlayer(p);
+    }
+}
+
+static void helloDone(struct player *p) {
+    unqueueHello(p);
+    if (p->features & FEATURE_LOBBY)
+        p->state = PLAYER_LOBBY;
+    else
+        quickMatch(p);
+}
+
+static void handleClient(struct player *p, int events) {
+    int move, r;
+
+    while (p->state == PLAYER_HELLO || p->state == PLAYER_LOBBY) {
+        int len = p->state == PLAYER_HELLO ? HELLO_LEN : (int)sizeof(int);
+        char reply[HELLO_LEN];
+
+        if ((r = readFrame(p, p->client.fd, len)) <= 0) {
+            if (r < 0)
+                closePlayer(p);
+            return;
+        }
+        p->in_len = 0;
+        if (p->state == PLAYER_LOBBY) {
+            protoDecodeMove(p->in, len, &move);
+            handleLobby(p, move);
+            continue;
+        }
+
+        if (memcmp(p->in, HELLO_SCK, HELLO_TAG_LEN) && memcmp(p->in, HELLO_SHM, HELLO_TAG_LEN)) {
+            closePlayer(p);
+            return;
+        }
+        p->hello = 1;
+        p->features = p->in[HELLO_TAG_LEN] & FEATURES_ALL & ~FEATURE_RESUME;
+        memcpy(reply, HELLO_SCK, HELLO_TAG_LEN);
+        reply[HELLO_TAG_LEN] = p->features;
+        if (sendAll(p->client.fd, reply, HELLO_LEN) < 0) {
+            closePlayer(p);
+            return;
+        }
+        helloDone(p);
+    }
+
+    if (p->state == PLAYER_SPLICE)
+        pump(p);
+    else if (p->state != PLAYER_CLOSED && (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+        closePlayer(p);     /* Left before its game started. */
+}
+
+static void handleBackend(struct player *p, int events) {
+    struct msg m;
+    int r, err = 0;
+    socklen_t len = sizeof(err);
+
+    if (p->state == PLAYER_CONNECT) {
+        char hello[HELLO_LEN];
+
+        if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+            return;
+        getsockopt(p->backend.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        memcpy(hello, HELLO_SCK, HELLO_TAG_LEN);
+        hello[HELLO_TAG_LEN] = p->features | FEATURE_LOBBY;
+        if (err || sendAll(p->backend.fd, hello, HELLO_LEN) < 0) {
+            backendFailed(p);
+            return;
+        }
+        p->state = PLAYER_ANSWER;
+    }
+
+    if (p->state == PLAYER_ANSWER) {
+        if ((r = readFrame(p, p->backend.fd, HELLO_LEN)) <= 0) {
+            if (r < 0)
+                backendFailed(p);
+            return;
+        }
+        p->in_len = 0;
+        if (!memcmp(p->in, HELLO_BSY, HELLO_TAG_LEN)) {
+            backendFailed(p);
+            return;
+        }
+        if (p->ask == ASK_GUEST) {
+            if (p->code)
+                joinPair(p);
+            else
+                p->state = PLAYER_CODE;
+            return;
+        }
+        if (p->ask == ASK_JOIN || p->ask == ASK_BOT) {
+            /* The backend answers the client itself. */
+            if (sendMove(p->backend.fd, p->ask == ASK_BOT ? ROOM_BOT : p->code) < 0)
+                backendFailed(p);
+            else
+                startSplice(p);
+            return;
+        }
+        if (sendMove(p->backend.fd, ROOM_CREATE) < 0) {
+            backendFailed(p);
+            return;
+        }
+        p->state = PLAYER_ROOM;
+    }
+
+    if (p->state == PLAYER_ROOM) {
+        /* NRM, or ROM and its code. */
+        if ((r = readFrame(p, p->backend.fd, TAG_LEN)) > 0 && protoType(p->in) == MSG_ROM)
+            r = readFrame(p, p->backend.fd, TAG_LEN + protoBodyLen(MSG_ROM));
+        if (r <= 0) {
+            if (r < 0)
+                backendFailed(p);
+            return;
+        }
+        if (protoDecode(p->in, p->in_len, &m) <= 0 || (m.type != MSG_ROM && m.type != MSG_NRM)) {
+            backendFailed(p);
+            return;
+        }
+        if (p->ask == ASK_HOST) {
+            struct player *guest = p->partner;
+
+            if (m.type != MSG_ROM) {
+                failPlayer(p);
+                return;
+            }
+            guest->code = m.code;
+            startSplice(p);
+            if (guest->state == PLAYER_CODE)
+                joinPair(guest);
+            return;
+        }
+        /* The client's own room; it gets the answer. */
+        if (m.type == MSG_ROM)
+            rememberCode(m.code, p->b - backends);
+        if (sendAll(p->client.fd, p->in, p->in_len) < 0)
+            closePlayer(p);
+        else
+            startSplice(p);
+        return;
+    }
+
+    if (p->state == PLAYER_SPLICE)
+        pump(p);
+    else if (p->state == PLAYER_CODE && (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+        backendFailed(p);
+}
+
+static void acceptClients(int lfd) {
+    struct player *p;
+    int fd;
+
+    while ((fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        p = calloc(1, sizeof(*p));
+        if (p == NULL)
+            error("ERROR allocating player");
+        p->client.kind = SOURCE_CLIENT;
+        p->client.fd = fd;
+        p->client.p = p;
+        p->backend.kind = SOURCE_BACKEND;
+        p->backend.fd = -1;
+        p->backend.p = p;
+        p->up.pipe[0] = p->up.pipe[1] = -1;
+        p->down.pipe[0] = p->down.pipe[1] = -1;
+        p->state = PLAYER_HELLO;
+        p->hello_deadline = nowMs() + HELLO_WAIT_MS;
+        if (hello_tail)
+            hello_tail->next = p;
+        else
+            hello_head = p;
+        hello_tail = p;
+        noDelay(fd);
+        watch(fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, &p->client);
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        perror("ERROR accepting connection");
+}
+
+/* Clients that said nothing are legacy clients. */
+static void expireHellos(void) {
+    long now = nowMs();
+
+    while (hello_head && hello_head->hello_deadline <= now)
+        helloDone(hello_head);
+}
+
+static void endCheck(struct backend *b) {
+    close(b->check_fd);
+    b->check_fd = -1;
+}
+
+static void startChecks(void) {
+    for (int i = 0; i < nbackends; i++) {
+        struct backend *b = &backends[i];
+
+        /* The last one never answered. */
+        if (b->check_fd >= 0) {
+            endCheck(b);
+            setBackendUp(b, 0);
+        }
+        b->line_len = 0;
+        b->check_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (b->check_fd < 0)
+            error("ERROR opening socket");
+        if (connect(b->check_fd, (struct sockaddr *)&b->admin, sizeof(b->admin)) < 0 && errno != EINPROGRESS) {
+            endCheck(b);
+            setBackendUp(b, 0);
+            continue;
+        }
+        watch(b->check_fd, EPOLLIN | EPOLLRDHUP | EPOLLET, b);
+    }
+}
+
+/* Reads the status line: OK or BUSY, then "games" and their number. */
+static void handleCheck(struct backend *b) {
+    char status[8];
+    int n, games;
+
+    if (b->check_fd < 0)
+        return;
+    while ((n = recv(b->check_fd, b->line + b->line_len, sizeof(b->line) - 1 - b->line_len, 0)) > 0)
+        b->line_len += n;
+    if (n < 0 && errno == EAGAIN && !memchr(b->line, '\n', b->line_len))
+        return;
+    b->line[b->line_len] = 0;
+    endCheck(b);
+    if (sscanf(b->line, "%7s games %d", status, &games) != 2) {
+        setBackendUp(b, 0);
+        return;
+    }
+    b->games = games;
+    b->sent = 0;
+    setBackendUp(b, !strcmp(status, "OK"));
+}
+
+static void freeClosed(void) {
+    while (closed) {
+        struct player *p = closed;
+        closed = p->next;
+        free(p);
+    }
+}
+
+static int setupListener(int portno) {
+    struct sockaddr_in addr = { 0 };
+    int option = 1;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (fd < 0)
+        error("ERROR opening listener socket.");
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &option, sizeof(option));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(portno);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        error("ERROR binding listener socket.");
+    listen(fd, SOMAXCONN);
+    return fd;
+}
+
+int main(int argc, char *argv[]) {
+    struct epoll_event events[MAX_EVENTS];
+    int listener = SOURCE_LISTENER;
+    long next_check = 0;
+    int opt, lfd;
+
+    while ((opt = getopt(argc, argv, "b:")) != -1) {
+        if (opt == 'b')
+            parseBackend(&backends[nbackends], optarg);
+        else
+            optind = argc + 1;
+    }
+    if (optind + 1 != argc || nbackends == 0) {
+        fprintf(stderr, "Usage : ./router.out -b address:port:admin port [-b ...] <port>\n");
+        exit(EXIT_FAILURE);
+    }
+    buildRing();
+    if (roomIndexInit(&codes, CODES_MAX) < 0)
+        error("ERROR allocating room codes");
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0)
+        error("ERROR creating epoll instance");
+    lfd = setupListener(strtol(argv[optind], NULL, 10));
+    watch(lfd, EPOLLIN, &listener);
+
+    for (;;) {
+        long now = nowMs();
+        long next = next_check;
+        int n;
+
+        if (now >= next_check) {
+            startChecks();
+            next = next_check = now + HEALTH_MS;
+        }
+        if (hello_head && hello_head->hello_deadline < next)
+            next = hello_head->hello_deadline;
+        fflush(stdout);
+
+        n = epoll_wait(epfd, events, MAX_EVENTS, next > now ? next - now : 0);
+        if (n < 0 && errno != EINTR)
+            error("ERROR waiting for events");
+        for (int i = 0; i < n; i++) {
+            int kind = *(int *)events[i].data.ptr;
+            struct endpoint *e = events[i].data.ptr;
+
+            if (kind == SOURCE_LISTENER)
+                acceptClients(lfd);
+            else if (kind == SOURCE_HEALTH)
+                handleCheck(events[i].data.ptr);
+            else if (e->p->state == PLAYER_CLOSED)
+                continue;
+            else if (kind == SOURCE_CLIENT)
+                handleClient(e->p, events[i].events);
+            else
+                handleBackend(e->p, events[i].events);
+        }
+        expireHellos();
+        expireCodes();
+        freeClosed();
+    }
+}
@@ -0,0 +1,250 @@
+/****************************************************************************
+*       Self-play simulator. Plays bot vs bot games in process on every
+*       core and reports games/sec and the outcome distribution.
+*
+*       Usage : ./selfplay.out [-n games] [-t threads] [-x bot] [-o bot]
+*                              [-s seed] [-H dir]
+*
+*       Bots are random, greedy and perfect. X (player 2) always opens.
+*       Game i is seeded from the seed and i alone, so the results do not
+*       depend on the number of threads.
+*
+*       -H appends every game to the history store in dir (see history.h),
+*       a chunk at a time, which is a quick way to fill one for query.out.
+*
+*****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "game.h"
+#include "bot.h"
+#include "history.h"
+
+#define CHUNK 1024      /* Games taken from the own queue at a time. */
+
+struct stats {
+    long games;
+    long wins[2];       /* Indexed by player id. */
+    long draws;
+    long moves;
+    long length[BOARD_CELLS + 1];
+};
+
+/* Each worker owns a range of game numbers. Idle workers steal the upper
+ * half of another worker's range. */
+struct worker {
+    pthread_mutex_t lock;
+    long next, end;
+    int id;
+    pthread_t thread;
+    struct stats stats;
+    struct history_game *records;   /* The chunk being played, with -H. */
+};
+
+static struct worker *workers;
+static int nworkers;
+static int bots[2];
+static unsigned seed = 1;
+static struct history history;
+static int recording;
+static pthread_mutex_t history_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void error(const char *msg) {
+    perror(msg);
+    exit(EXIT_FAILURE);
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void playGame(long number, struct stats *stats, struct history_game *rec) {
+    struct game g;
+    unsigned rng = seed * 2654435761u ^ (unsigned)number * 40503u;
+    int result = MOVE_OK;
+
+    if (rng == 0)
+        rng = 1;
+    gameInit(&g);
+    while (result == MOVE_OK) {
+        int player_id = g.turn;
+        result = gamePlay(&g, player_id, botMove(bots[player_id], &g, &rng));
+    }
+
+    stats->games++;
+    stats->moves += g.moves;
+    stats->length[g.moves]++;
+    if (g.status == GAME_WON)
+        stats->wins[g.winner]++;
+    else
+        stats->draws++;
+
+    if (rec) {
+        rec->id = number;
+        rec->start = time(NULL);
+        rec->duration = 0;
+        rec->moves = g.history;
+        rec->length = g.moves;
+        rec->result = g.status == GAME_DRAW ? HIST_DRAW : g.winner ? HIST_X_WON : HIST_O_WON;
+        rec->player_x = HIST_BOT + bots[1];
+        rec->player_o = HIST_BOT + bots[0];
+    }
+}
+
+/* Appends a played chunk to the store. */
+static void record(struct history_game *recs, long n) {
+    pthread_mutex_lock(&history_lock);
+    for (long i = 0; i < n; i++)
+        if (historyAppend(&history, &recs[i]) < 0)
+            error("ERROR appending to history");
+    pthread_mutex_unlock(&history_lock);
+}
+
+/* Takes up to CHUNK games from the own range. */
+static int takeOwn(struct worker *w, long *lo, long *hi) {
+    int found = 0;
+
+    pthread_mutex_lock(&w->lock);
+    if (w->next < w->end) {
+        *lo = w->next;
+        *hi = w->next + CHUNK < w->end ? w->next + CHUNK : w->end;
+        w->next = *hi;
+        found = 1;
+    }
+    pthread_mutex_unlock(&w->lock);
+    return found;
+}
+
+/* Moves the upper half of some other worker's range into our own. */
+static int steal(struct worker *w) {
+    for (int i = 1; i < nworkers; i++) {
+        struct worker *victim = &workers[(w->id + i) % nworkers];
+        long lo = 0, hi = 0;
+
+        pthread_mutex_lock(&victim->lock);
+        if (victim->next < victim->end) {
+            lo = victim->next + (victim->end - victim->next) / 2;
+            hi = victim->end;
+            victim->end = lo;
+        }
+        pthread_mutex_unlock(&victim->lock);
+
+        if (lo < hi) {
+            pthread_mutex_lock(&w->lock);
+            w->next = lo;
+            w->end = hi;
+            pthread_mutex_unlock(&w->lock);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void *runWorker(void *arg) {
+    struct worker *w = arg;
+    long lo, hi;
+
+    do {
+        while (takeOwn(w, &lo, &hi)) {
+            for (long number = lo; number < hi; number++)
+                playGame(number, &w->stats, w->records ? &w->records[number - lo] : NULL);
+            if (w->records)
+                record(w->records, hi - lo);
+        }
+    } while (steal(w));
+    return NULL;
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage : ./selfplay.out [-n games] [-t threads] [-x bot] [-o bot] [-s seed] [-H dir]\n"
+                    "Bots  : random, greedy, perfect\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    long games = 1000000;
+    int opt;
+    struct stats total;
+    const char *history_dir = NULL;
+
+    nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+    bots[0] = bots[1] = BOT_RANDOM;
+
+    while ((opt = getopt(argc, argv, "n:t:x:o:s:H:")) != -1) {
+        switch (opt) {
+        case 'n': games = strtol(optarg, NULL, 10); break;
+        case 't': nworkers = strtol(optarg, NULL, 10); break;
+        case 'x': bots[1] = botParse(optarg); break;
+        case 'o': bots[0] = botParse(optarg); break;
+        case 's': seed = strtoul(optarg, NULL, 10); break;
+        case 'H': history_dir = optarg; break;
+        default: usage();
+        }
+    }
+    if (games < 0 || nworkers < 1 || bots[0] < 0 || bots[1] < 0)
+        usage();
+
+    botInit();
+    workers = calloc(nworkers, sizeof(*workers));
+    if (workers == NULL)
+        error("ERROR allocating workers");
+    if (history_dir) {
+        if (historyOpen(&history, history_dir) < 0)
+            error("ERROR opening history");
+        recording = 1;
+    }
+
+    /* Split the games evenly, stealing evens out the rest. */
+    for (int i = 0; i < nworkers; i++) {
+        pthread_mutex_init(&workers[i].lock, NULL);
+        workers[i].id = i;
+        workers[i].next = games * i / nworkers;
+        workers[i].end = games * (i + 1) / nworkers;
+        if (recording && (workers[i].records = malloc(CHUNK * sizeof(struct history_game))) == NULL)
+            error("ERROR allocating records");
+    }
+
+    double start = now();
+    for (int i = 0; i < nworkers; i++)
+        if (pthread_create(&workers[i].thread, NULL, runWorker, &workers[i]))
+            error("ERROR starting worker");
+    for (int i = 0; i < nworkers; i++)
+        pthread_join(workers[i].thread, NULL);
+    double elapsed = now() - start;
+
+    memset(&total, 0, sizeof(total));
+    for (int i = 0; i < nworkers; i++) {
+        struct stats *s = &workers[i].stats;
+        total.games += s->games;
+        total.wins[0] += s->wins[0];
+        total.wins[1] += s->wins[1];
+        total.draws += s->draws;
+        total.moves += s->moves;
+        for (int n = 0; n <= BOARD_CELLS; n++)
+            total.length[n] += s->length[n];
+    }
+
+    double per = total.games ? 100.0 / total.games : 0;
+    printf("games: %ld  threads: %d  elapsed: %.3f s  games/sec: %.0f\n",
+           total.games, nworkers, elapsed, elapsed > 0 ? total.games / elapsed : 0);
+    printf("X (%s) wins: %ld (%.2f%%)\n", botName(bots[1]), total.wins[1], total.wins[1] * per);
+    printf("O (%s) wins: %ld (%.2f%%)\n", botName(bots[0]), total.wins[0], total.wins[0] * per);
+    printf("draws: %ld (%.2f%%)\n", total.draws, total.draws * per);
+    printf("average length: %.2f moves\n", total.games ? (double)total.moves / total.games : 0);
+    for (int n = 5; n <= BOARD_CELLS; n++)
+        printf("  %d moves: %ld (%.2f%%)\n", n, total.length[n], total.length[n] * per);
+
+    if (recording)
+        historyClose(&history);
+    for (int i = 0; i < nworkers; i++)
+        free(workers[i].records);
+    free(workers);
+    return 0;
+}
@@ -0,0 +1,219 @@
+/****************************************************************************
+*       State of the event loop server, shared by game_server.c and the
+*       hot restart code in handover.c.
+*
+*****************************************************************************/
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "game.h"
+#include "conn.h"
+#include "proto.h"
+#include "trace.h"
+#include "rooms.h"
+#include "admit.h"
+#include "mcts.h"
+#include "history.h"
+#include "prof.h"
+
+#define MAX_LISTENERS 2
+
+/* What an epoll event points at; every source starts with its kind. */
+#define SOURCE_LISTENER 0
+#define SOURCE_CLIENT   1
+#define SOURCE_CONTROL  2
+#define SOURCE_ADMIN    3
+#define SOURCE_AI       4
+
+/* Listener types, as serverAddListener and the hot restart know them. */
+#define LISTENER_TCP   0
+#define LISTENER_UNIX  1
+#define LISTENER_ADMIN 2    /* Answers every connection with a status line. */
+
+/* Client states. */
+#define CLIENT_HELLO   0    /* Waiting for the hello, optional on TCP. */
+#define CLIENT_WAITING 1    /* Waiting for an opponent. */
+#define CLIENT_PLAYING 2
+#define CLIENT_DRAINING 3   /* Game over, flushing the last messages. */
+#define CLIENT_LOBBY   4    /* Has to create, join or ask for any room. */
+#define CLIENT_HOSTING 5    /* Waiting in its room for someone to join. */
+#define CLIENT_CLOSED  6    /* Freed once the current events are handled. */
+
+#define CLIENT_IN_LEN 16    /* Room for a hello or a few moves. */
+
+/* Output queue of a client. Past the high water mark the client counts
+ * as slow until the queue is back under the low water mark; a client
+ * that stays slow too long, or would overflow the queue, is dealt with
+ * according to the slow client policy. */
+#define OUT_LIMIT      4096
+#define OUT_HIGH_WATER 1024
+#define OUT_LOW_WATER  256
+
+/* What happens to a slow client in a game. */
+#define SLOW_FORFEIT    0   /* It loses, the opponent is told it won. */
+#define SLOW_DISCONNECT 1   /* Both are disconnected. */
+
+/* FEATURE_RESUME clients. One not heard from for HEARTBEAT_TIMEOUT_MS is
+ * gone; a player that is gone from a game has RESUME_GRACE_MS to come
+ * back with its token before it forfeits. */
+#define HEARTBEAT_TIMEOUT_MS (3 * HEARTBEAT_MS)
+#define RESUME_GRACE_MS 30000
+#define TOKEN_BITS 16       /* Resume tokens, log2 of the buckets. */
+
+struct listener {
+    int kind;
+    int fd;                 /* -1 if there is none. */
+    int is_unix;
+};
+
+/* Lobby rooms. A room nobody joins expires after ROOM_TTL_MS. */
+#define ROOMS_MAX   (1 << 19)
+#define ROOM_TTL_MS (5 * 60 * 1000)
+
+/* Why a new connection was turned away. */
+#define SHED_LAG     0      /* The event loop is falling behind. */
+#define SHED_GAMES   1      /* Too many games. */
+#define SHED_ADDR    2      /* Its address connects too often. */
+#define SHED_GLOBAL  3      /* Everybody together does. */
+#define SHED_REASONS 4
+
+struct admission {
+    int addr_rate;          /* Connections a second, 0 for no limit. */
+    int global_rate;
+    int max_games;          /* 0 for no limit. */
+    struct bucket global;
+    struct addr_table addrs;
+    double lag_ms;          /* Average time a pass of the loop takes. */
+    long shed[SHED_REASONS];    /* Since the last report. */
+    long report_at;         /* ms */
+};
+
+struct match;
+struct client;
+
+struct room {
+    unsigned code;
+    struct client *host;
+    long deadline;          /* ms */
+    struct room *prev, *next;   /* Expiry queue, or the free list. */
+};
+
+struct client {
+    int kind;
+    struct conn conn;
+    int state;
+    long hello_deadline;    /* ms, TCP clients in CLIENT_HELLO only. */
+    struct match *match;
+    int player_id;
+    int seq;                /* Moves this client has seen, delta mode. */
+    int awaiting_move;      /* TRN sent, no valid move back yet. */
+    char in[CLIENT_IN_LEN]; /* Bytes read but not yet handled. */
+    int in_len;
+    char *out;              /* Bytes not sent yet, allocated when needed. */
+    int out_len;
+    long slow_deadline;     /* ms, set while over the high water mark. */
+    int failed;             /* Write error or overflow, dealt with later. */
+    int backlogged;         /* On the backlog list. */
+    unsigned trace_id;      /* Connection id in the trace, 0 if none. */
+    struct room *room;      /* CLIENT_HOSTING only. */
+    int bot;                /* The computer: not on the client list, never
+                             * written to, moves chosen by the AI. */
+    int thinking;           /* A bot with a search under way. */
+    struct client *prev, *next;             /* All clients. */
+    struct client *hello_prev, *hello_next; /* TCP hello queue. */
+    struct client *out_prev, *out_next;     /* Backlog list. */
+    long live_deadline;     /* ms, -1 when not on the live list. */
+    struct client *live_prev, *live_next;   /* Live list, by deadline. */
+};
+
+struct match {
+    int id;
+    struct game g;
+    long started;           /* Wall clock, ms since the epoch. */
+    struct client *players[2];
+    int slot;               /* Position in a hot restart snapshot. */
+    unsigned long long secret[2];   /* Resume tokens; bit 0 is the player id. */
+    int away;               /* Player waited for, or -1. */
+    long away_deadline;     /* ms, when it forfeits. */
+    struct match *prev, *next;
+    struct match *away_prev, *away_next;    /* Away list, by deadline. */
+    struct match *token_next[2];    /* Token bucket chains, by player. */
+};
+
+struct control {
+    int kind;
+    int fd;                 /* Listening SOCK_SEQPACKET socket or -1. */
+    const char *path;
+};
+
+/* The computer player. Its engine starts with the first game against it. */
+struct ai {
+    int kind;
+    struct mcts *engine;
+    int threads;            /* 0 for one less than there are cores. */
+    int move_ms;            /* Time budget of a move. */
+};
+
+struct server {
+    int epfd;
+    struct listener listeners[MAX_LISTENERS];
+    int nlisteners;
+    struct control control;
+    struct listener admin;
+    struct client *clients;
+    struct client *hello_head, *hello_tail;
+    struct client *waiting;
+    struct client *closed;  /* Linked through next. */
+    struct client *backlog; /* Clients with queued output or a failure. */
+    int slow_policy;
+    struct trace trace;     /* Capture of the inbound traffic (-r). */
+    unsigned next_trace_id;
+    struct room_index room_index;   /* Code to index in rooms. */
+    struct room *rooms;     /* ROOMS_MAX of them, NULL until needed. */
+    int rooms_used;         /* Rooms past this one were never used. */
+    struct room *free_rooms;
+    struct room *rooms_head, *rooms_tail;   /* By deadline. */
+    int nrooms;             /* Open rooms. */
+    struct match *matches;
+    int nmatches;
+    int next_match_id;
+    struct admission admit;
+    struct ai ai;
+    struct history history; /* Finished games (-H); dir is NULL without. */
+    struct prof prof;       /* Counters per phase of a turn (-P). */
+    struct client *live_head, *live_tail;
+    struct match *away_head, *away_tail;
+    struct match *tokens[2][1 << TOKEN_BITS];   /* By player, then token. */
+};
+
+/* Used by the hot restart code to rebuild the state it receives. */
+void serverAddListener(struct server *s, int fd, int type);
+struct match *serverAddMatch(struct server *s, int id, const struct game *g, const unsigned long long *secret);
+struct client *serverAddClient(struct server *s, struct conn *conn, int state, long hello_deadline);
+/* Puts the computer in a game, and has it think if it is its turn. */
+void serverAddBot(struct server *s, struct match *m, int player_id);
+/* Has the game wait for a player that lost its connection. */
+void serverAwayMatch(struct server *s, struct match *m, int player_id, long deadline);
+
+/* Sends what the client can take right away and queues the rest. Never
+ * blocks; failures are dealt with once the current events are handled.
+ * serverQueue only queues, for output handed over by the old server. */
+void serverSend(struct server *s, struct client *c, const void *buf, int len);
+void serverQueue(struct server *s, struct client *c, const void *buf, int len);
+
+/* Opens a room with the given code for a client in CLIENT_HOSTING. Returns
+ * -1 if the code is taken or there is no room left. */
+int serverAddRoom(struct server *s, struct client *c, unsigned code, long deadline);
+
+long nowMs(void);
+
+/* Hot restart, see handover.c. handoverSend answers a takeover request
+ * on a control connection; it returns 0 once the new process has
+ * everything, and the caller must then exit without touching anything,
+ * or -1 if the handover failed and this process keeps serving.
+ * handoverReceive takes over from the server listening on path. */
+int handoverSend(struct server *s, int ctl_fd);
+int handoverReceive(struct server *s, const char *path);
+
+#endif
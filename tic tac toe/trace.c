@@ -0,0 +1,137 @@
+/****************************************************************************
+*       Traffic traces: the record format shared by the server and the
+*       replay tool.
+*
+*****************************************************************************/
+
+#include <string.h>
+#include <time.h>
+
+#include "trace.h"
+
+#define TRACE_BUF_SIZE 65536
+
+static long long nowUs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void putVarint(FILE *f, unsigned long long v) {
+    while (v >= 0x80) {
+        putc((v & 0x7f) | 0x80, f);
+        v >>= 7;
+    }
+    putc(v, f);
+}
+
+int traceOpen(struct trace *t, const char *path) {
+    t->f = fopen(path, "wb");
+    if (t->f == NULL)
+        return -1;
+    setvbuf(t->f, NULL, _IOFBF, TRACE_BUF_SIZE);
+    fwrite(TRACE_MAGIC, 1, TRACE_MAGIC_LEN, t->f);
+    putc(TRACE_VERSION, t->f);
+    t->last_us = nowUs();
+    return 0;
+}
+
+static void putHeader(struct trace *t, int type, unsigned id) {
+    long long now = nowUs();
+
+    putc(type, t->f);
+    putVarint(t->f, id);
+    putVarint(t->f, now - t->last_us);
+    t->last_us = now;
+}
+
+void traceWrite(struct trace *t, int type, unsigned id, int arg, const void *data, int len) {
+    putHeader(t, type, id);
+    if (type == TRACE_OPEN || type == TRACE_RESULT) {
+        putc(arg, t->f);
+    } else if (type == TRACE_DATA) {
+        putVarint(t->f, len);
+        fwrite(data, 1, len, t->f);
+    }
+}
+
+void traceWriteValue(struct trace *t, int type, unsigned id, unsigned long long value) {
+    putHeader(t, type, id);
+    putVarint(t->f, value);
+}
+
+void traceFlush(struct trace *t) {
+    fflush(t->f);
+}
+
+void traceClose(struct trace *t) {
+    fclose(t->f);
+    t->f = NULL;
+}
+
+int traceReaderInit(struct trace_reader *r, const void *buf, long len) {
+    const unsigned char *p = buf;
+
+    if (len < TRACE_MAGIC_LEN + 1 || memcmp(p, TRACE_MAGIC, TRACE_MAGIC_LEN) ||
+        p[TRACE_MAGIC_LEN] < 1 || p[TRACE_MAGIC_LEN] > TRACE_VERSION)
+        return -1;
+    r->p = p + TRACE_MAGIC_LEN + 1;
+    r->end = p + len;
+    r->time_us = 0;
+    return 0;
+}
+
+static int getVarint(struct trace_reader *r, unsigned long long *v) {
+    *v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (r->p == r->end)
+            return -1;
+        *v |= (unsigned long long)(*r->p & 0x7f) << shift;
+        if (!(*r->p++ & 0x80))
+            return 0;
+    }
+    return -1;
+}
+
+int traceNext(struct trace_reader *r, struct trace_rec *rec) {
+    unsigned long long id, delta, len;
+
+    if (r->p == r->end)
+        return 0;
+    rec->type = *r->p++;
+    if (getVarint(r, &id) < 0 || getVarint(r, &delta) < 0)
+        return -1;
+    rec->id = id;
+    rec->time_us = r->time_us += delta;
+    rec->arg = 0;
+    rec->len = 0;
+    rec->data = NULL;
+    rec->value = 0;
+
+    switch (rec->type) {
+    case TRACE_OPEN:
+    case TRACE_RESULT:
+        if (r->p == r->end)
+            return -1;
+        rec->arg = *r->p++;
+        break;
+    case TRACE_DATA:
+        if (getVarint(r, &len) < 0 || len > (unsigned long long)(r->end - r->p))
+            return -1;
+        rec->len = len;
+        rec->data = r->p;
+        r->p += len;
+        break;
+    case TRACE_ROOM:
+    case TRACE_TOKEN:
+        if (getVarint(r, &rec->value) < 0)
+            return -1;
+        break;
+    case TRACE_TURN:
+    case TRACE_CLOSE:
+        break;
+    default:
+        return -1;
+    }
+    return 1;
+}
@@ -0,0 +1,78 @@
+/****************************************************************************
+*       Traffic traces, written by the server (-r) and read by the replay
+*       tool.
+*
+*       A trace is the magic TRACE_MAGIC and a version byte followed by
+*       records. Every record is a type byte, the connection id and the
+*       time since the previous record in microseconds, both as varints
+*       (7 bits a byte, low bits first), and then the type's arguments:
+*
+*       TRACE_OPEN    flags byte (TRACE_UNIX)
+*       TRACE_DATA    varint length and the bytes read from the client,
+*                     as they came in
+*       TRACE_TURN    none; the server sent TRN
+*       TRACE_RESULT  message type byte: MSG_WIN, MSG_LSE or MSG_DRW
+*       TRACE_CLOSE   none
+*       TRACE_ROOM    varint room code the server sent in ROM
+*       TRACE_TOKEN   varint resume token the server sent in TOK
+*
+*       Room codes and resume tokens are random, so a replayed server
+*       hands out others; the replay tool needs the traced ones to put
+*       the new ones in the bytes that quote them. Version 1 traces have
+*       neither record and are still read.
+*
+*****************************************************************************/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+
+#define TRACE_MAGIC "TTTR"
+#define TRACE_MAGIC_LEN 4
+#define TRACE_VERSION 2
+
+#define TRACE_OPEN   'O'
+#define TRACE_DATA   'D'
+#define TRACE_TURN   'T'
+#define TRACE_RESULT 'R'
+#define TRACE_CLOSE  'C'
+#define TRACE_ROOM   'M'
+#define TRACE_TOKEN  'K'
+
+#define TRACE_UNIX 0x01     /* Accepted on the UNIX socket. */
+
+struct trace {
+    FILE *f;
+    long long last_us;      /* Time of the previous record. */
+};
+
+struct trace_rec {
+    int type;
+    unsigned id;
+    long long time_us;      /* Since the start of the trace. */
+    int arg;                /* Flags of TRACE_OPEN, type of TRACE_RESULT. */
+    int len;                /* TRACE_DATA. */
+    const unsigned char *data;
+    unsigned long long value;   /* TRACE_ROOM and TRACE_TOKEN. */
+};
+
+/* Writing. Records are buffered; traceFlush pushes them to the file.
+ * traceOpen returns -1 if the file cannot be created. */
+int traceOpen(struct trace *t, const char *path);
+void traceWrite(struct trace *t, int type, unsigned id, int arg, const void *data, int len);
+void traceWriteValue(struct trace *t, int type, unsigned id, unsigned long long value);
+void traceFlush(struct trace *t);
+void traceClose(struct trace *t);
+
+/* Reading a whole trace from memory. traceNext fills r and returns 1,
+ * 0 at the end or -1 if the trace is cut short or corrupt. */
+struct trace_reader {
+    const unsigned char *p, *end;
+    long long time_us;
+};
+
+int traceReaderInit(struct trace_reader *r, const void *buf, long len);
+int traceNext(struct trace_reader *r, struct trace_rec *rec);
+
+#endif